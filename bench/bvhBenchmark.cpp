@@ -0,0 +1,138 @@
+/**
+ * Measures closest-hit rays per second on the host for a linear scan over
+ * every instance versus the SAH TLAS, for scenes of increasing object count.
+ *
+ * Usage: bvh_benchmark [RAYS]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include "src/bvh.h"
+#include "src/pathtraceStages.h"
+
+static std::vector<Instance> randomInstances(int count, float extent, std::mt19937 &rng) {
+    std::uniform_real_distribution<float> pos(-extent, extent);
+    std::uniform_real_distribution<float> size(0.5f, 2.0f);
+    std::uniform_real_distribution<float> angle(0.0f, 360.0f);
+
+    std::vector<Instance> instances(count);
+    for (int i = 0; i < count; i++) {
+        glm::mat4 transform = utilityCore::buildTransformationMatrix(
+            glm::vec3(pos(rng), pos(rng), pos(rng)),
+            glm::vec3(angle(rng), angle(rng), angle(rng)),
+            glm::vec3(size(rng), size(rng), size(rng)));
+        // blas 0 is the sphere, blas 1 the cube
+        instances[i] = bvh::makeInstance(transform, i % 2, 0);
+    }
+    return instances;
+}
+
+static float linearClosestHit(const Ray &ray, const SceneView &scene) {
+    glm::vec3 n;
+    bool outside;
+    float tMin = FLT_MAX;
+    for (int i = 0; i < scene.numInstances; i++) {
+        float t = instanceIntersectionTest(scene, i, ray, tMin, n, outside);
+        if (t > 0.0f && t < tMin) {
+            tMin = t;
+        }
+    }
+    return tMin == FLT_MAX ? -1.0f : tMin;
+}
+
+int main(int argc, char **argv) {
+    const int numRays = argc > 1 ? atoi(argv[1]) : 200000;
+    const int counts[] = { 16, 64, 256, 1024, 4096, 16384 };
+
+    std::vector<Blas> blases;
+    blases.push_back(bvh::makeImplicitBlas(SPHERE));
+    blases.push_back(bvh::makeImplicitBlas(CUBE));
+
+    printf("%8s %10s %8s %14s %14s %8s %s\n",
+        "objects", "build_ms", "nodes", "linear_Mray/s", "bvh_Mray/s", "speedup", "mismatches");
+
+    for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+        std::mt19937 rng(1234);
+        // keep density roughly constant so hit distances stay comparable
+        float extent = 4.0f * cbrtf((float)counts[c]);
+        std::vector<Instance> instances = randomInstances(counts[c], extent, rng);
+
+        using clock = std::chrono::high_resolution_clock;
+        clock::time_point buildStart = clock::now();
+        std::vector<AABB> bounds(instances.size());
+        for (size_t i = 0; i < instances.size(); i++) {
+            bounds[i] = bvh::instanceBounds(instances[i], blases[instances[i].blasId]);
+        }
+        std::vector<BVHNode> nodes;
+        std::vector<int> order;
+        bvh::build(bounds, nodes, order);
+        std::vector<Instance> sorted(instances.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            sorted[i] = instances[order[i]];
+        }
+        double buildMs = std::chrono::duration<double, std::milli>(clock::now() - buildStart).count();
+
+        std::uniform_real_distribution<float> pos(-extent, extent);
+        std::normal_distribution<float> dir;
+        std::vector<PathSegment> paths(numRays);
+        for (int i = 0; i < numRays; i++) {
+            paths[i].ray.origin = glm::vec3(pos(rng), pos(rng), pos(rng));
+            paths[i].ray.direction = glm::normalize(glm::vec3(dir(rng), dir(rng), dir(rng)));
+        }
+
+        // pack the instances the way Scene does; only the traversal arrays are needed
+        std::vector<glm::vec4> rows[3];
+        std::vector<int> blasIds, materialIds;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            glm::mat3x4 m = glm::transpose(sorted[i].worldToObject);
+            for (int r = 0; r < 3; r++) {
+                rows[r].push_back(m[r]);
+            }
+            blasIds.push_back(sorted[i].blasId);
+            materialIds.push_back(sorted[i].materialid);
+        }
+
+        SceneView scene = SceneView();  // no meshes: leaves the triangle arrays null
+        scene.numInstances = sorted.size();
+        scene.instRow0 = rows[0].data();
+        scene.instRow1 = rows[1].data();
+        scene.instRow2 = rows[2].data();
+        scene.instBlasId = blasIds.data();
+        scene.instMaterialId = materialIds.data();
+        scene.blases = blases.data();
+        scene.tlasNodes = nodes.data();
+
+        // the linear scan gets slow quickly; time it on a subset
+        int linearRays = std::max(1000, std::min(numRays, (int)(2e7 / counts[c])));
+        std::vector<float> linearT(linearRays);
+        clock::time_point linearStart = clock::now();
+        for (int i = 0; i < linearRays; i++) {
+            linearT[i] = linearClosestHit(paths[i].ray, scene);
+        }
+        double linearSec = std::chrono::duration<double>(clock::now() - linearStart).count();
+
+        std::vector<ShadeableIntersection> hits(numRays);
+        clock::time_point bvhStart = clock::now();
+        for (int i = 0; i < numRays; i++) {
+            computePathIntersection(paths[i], scene, hits[i]);
+        }
+        double bvhSec = std::chrono::duration<double>(clock::now() - bvhStart).count();
+
+        int mismatches = 0;
+        for (int i = 0; i < linearRays; i++) {
+            if (fabsf(linearT[i] - hits[i].t) > 1e-3f) {
+                mismatches++;
+            }
+        }
+
+        double linearRate = linearRays / linearSec / 1e6;
+        double bvhRate = numRays / bvhSec / 1e6;
+        printf("%8d %10.2f %8d %14.3f %14.3f %7.1fx %d\n",
+            counts[c], buildMs, (int)nodes.size(), linearRate, bvhRate, bvhRate / linearRate, mismatches);
+    }
+    return 0;
+}
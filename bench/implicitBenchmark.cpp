@@ -0,0 +1,141 @@
+/**
+ * Compares the fixed-step ray marcher the implicit surfaces used to have with
+ * Lipschitz sphere tracing. Every camera ray of the scene that reaches an
+ * implicit instance's bounds (the rays the TLAS hands to the marcher) is
+ * traced with both, on the host.
+ *
+ * Usage: implicit_benchmark SCENEFILE.txt [SCENEFILE.txt ...]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "src/bvh.h"
+#include "src/scene.h"
+#include "src/pathtraceStages.h"
+
+/**
+ * The previous marcher, verbatim apart from the step counter: 700 steps of
+ * 0.1 from t = 0, then back off and refine in steps of 0.02. Returns 0 on a
+ * miss.
+ */
+static float legacyMarch(GeomType type, glm::vec3 cam, glm::vec3 ray, int &steps) {
+    float BIGSTEPSIZE = 0.1;
+    float SMALLSTEPSIZE = 0.02;
+    float t = 0.0f;
+    float step = BIGSTEPSIZE;
+    steps = 0;
+
+    for (int i = 0; i < 700; i++) {
+        glm::vec3 p = cam + ray * t;
+        float distance = type == CSG1 ? csg1SDF(p) : csg2SDF(p);
+        steps++;
+
+        if (distance < 0.001) {
+            t -= step;
+            step = SMALLSTEPSIZE;
+
+            for (int i = 0; i < 10; i++) {
+                p = cam + ray * t;
+                distance = type == CSG1 ? csg1SDF(p) : csg2SDF(p);
+                steps++;
+                if (distance < 0.001) {
+                    t -= step;
+                    return t;
+                }
+                t += step;
+            }
+            return 0;
+        }
+        t += step;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s SCENEFILE.txt [SCENEFILE.txt ...]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-24s %6s %8s %9s %12s %12s %14s %14s %8s %s\n", "scene", "shape", "rays", "rejected",
+        "old_steps", "new_steps", "old_Mray/s", "new_Mray/s", "speedup", "agree");
+
+    for (int s = 1; s < argc; s++) {
+        Scene *scene = new Scene(argv[s]);
+        Camera cam = scene->state.camera;
+        cam.view = glm::normalize(cam.lookAt - cam.position);
+        cam.right = glm::normalize(glm::cross(cam.view, cam.up));
+        cam.up = glm::cross(cam.right, cam.view);
+        // unjittered rays never read the sampler
+        SamplerView sampler = { SAMPLER_RANDOM, 1, cam.resolution.x, NULL };
+
+        for (int i = 0; i < (int)scene->instances.size(); i++) {
+            const Blas &blas = scene->blases[scene->instBlasId[i]];
+            if (blas.type != CSG1 && blas.type != CSG2) {
+                continue;
+            }
+            AABB bounds = bvh::instanceBounds(scene->instances[i], blas);
+
+            // the object-space rays the TLAS would pass to this instance
+            std::vector<Ray> rays;
+            for (int y = 0; y < cam.resolution.y; y++) {
+                for (int x = 0; x < cam.resolution.x; x++) {
+                    PathSegment segment;
+                    generateCameraRay(cam, 1, 1, x, y, false, sampler, segment);
+                    const Ray &r = segment.ray;
+                    if (aabbIntersectionTest(bounds.min, bounds.max, r.origin,
+                            safeInverseDirection(r.direction), FLT_MAX) >= 0.0f) {
+                        rays.push_back(transformRay(scene->instRow0[i], scene->instRow1[i], scene->instRow2[i], r));
+                    }
+                }
+            }
+            if (rays.empty()) {
+                continue;
+            }
+
+            using clock = std::chrono::high_resolution_clock;
+            std::vector<float> oldT(rays.size());
+            long long oldSteps = 0;
+            clock::time_point oldStart = clock::now();
+            for (size_t r = 0; r < rays.size(); r++) {
+                int steps;
+                oldT[r] = legacyMarch(blas.type, rays[r].origin, rays[r].direction, steps);
+                oldSteps += steps;
+            }
+            double oldSec = std::chrono::duration<double>(clock::now() - oldStart).count();
+
+            std::vector<float> newT(rays.size());
+            long long newSteps = 0;
+            int rejected = 0;
+            clock::time_point newStart = clock::now();
+            for (size_t r = 0; r < rays.size(); r++) {
+                int steps;
+                bool outside;
+                newT[r] = implicitSphereTrace(blas.type, rays[r], FLT_MAX, outside, steps);
+                newSteps += steps;
+                rejected += steps == 0;
+            }
+            double newSec = std::chrono::duration<double>(clock::now() - newStart).count();
+
+            // same hit or miss, and hits within the old marcher's 0.02 refine step
+            int agree = 0;
+            for (size_t r = 0; r < rays.size(); r++) {
+                bool oldHit = oldT[r] > 0.0f;
+                bool newHit = newT[r] > 0.0f;
+                if (oldHit == newHit && (!oldHit || fabsf(oldT[r] - newT[r]) <= 0.04f)) {
+                    agree++;
+                }
+            }
+
+            double oldRate = rays.size() / oldSec / 1e6;
+            double newRate = rays.size() / newSec / 1e6;
+            printf("%-24s %6s %8d %8.1f%% %12.1f %12.1f %14.3f %14.3f %7.1fx %.2f%%\n",
+                argv[s], blas.type == CSG1 ? "csg1" : "csg2", (int)rays.size(), 100.0 * rejected / rays.size(),
+                (double)oldSteps / rays.size(), (double)newSteps / rays.size(),
+                oldRate, newRate, newRate / oldRate, 100.0 * agree / rays.size());
+        }
+    }
+    return 0;
+}
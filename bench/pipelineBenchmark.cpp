@@ -0,0 +1,616 @@
+/**
+ * Renders every scene given on the command line, plus a few generated stress
+ * scenes, under each combination of the compact, sorting and caching render
+ * options and writes the results as JSON. Each run reports rays per second,
+ * the paths alive at each bounce, milliseconds per pipeline stage and memory
+ * use, so two builds can be compared run by run.
+ *
+ * Every run renders twice from a fresh pathtraceInit(): once untimed by the
+ * stage hooks for the wall time, then once with PathtraceStats recording.
+ * The stage timers synchronize after every stage and would skew the rates.
+ *
+ * On the CUDA backend every sorted run is also weighed against the unsorted
+ * run with the same other options, in the JSON's "sorting" list: the time
+ * the sort takes, the shading time it saves and the net change per
+ * iteration.
+ *
+ * Other render options, such as --nee or --sampler=sobol, apply to every
+ * run, so two invocations compare a feature before and after;
+ * --sortdirection compares the two kinds of sort key.
+ *
+ * --replay=N adds an interactive replay of every scene: N frames of a mouse
+ * drag, each moving the camera and restarting the image like the window
+ * does, then N frames of the camera holding still. It reports the frame
+ * latency of both phases with full-resolution frames during the drag and
+ * with preview frames at the strides in REPLAY_STRIDES.
+ *
+ * --reference=FILE.png adds a denoiser study of the first scene: at each
+ * sample count in DENOISE_SAMPLES it reports the denoiser's time per filter
+ * level and the error of the noisy and the denoised image against the
+ * reference, e.g. one of the 5000-sample renders in img/. --denoise=LEVELS
+ * picks the levels; without it the study uses the default.
+ *
+ * Usage: pipeline_benchmark [--cpu] [--threads=N] [--iterations=N]
+ *            [--warmup=N] [--replay=N] [--reference=FILE.png]
+ *            [--out=FILE.json] [--no-stress] [--OPTION[=0|1] ...]
+ *            SCENEFILE.txt ...
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include <stb_image.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "src/pathtrace.h"
+#include "src/renderOptions.h"
+#include "src/scene.h"
+
+// Camera orbit per drag frame of the interactive replay, in radians
+#define REPLAY_ORBIT_STEP 0.01f
+
+/**
+ * Scenes generated next to the first scene file, in the style of
+ * cornell.txt. `objects` is appended after the box.
+ */
+struct StressScene {
+    const char *name;
+    int traceDepth;
+    const char *objects;
+};
+
+static const char *STRESS_HEADER =
+    "MATERIAL 0\nRGB 1 1 1\nSPECEX 0\nSPECRGB 0 0 0\nREFL 0\nREFR 0\nREFRIOR 0\nEMITTANCE 5\n\n"
+    "MATERIAL 1\nRGB .98 .98 .98\nSPECEX 0\nSPECRGB 0 0 0\nREFL 0\nREFR 0\nREFRIOR 0\nEMITTANCE 0\n\n"
+    "MATERIAL 2\nRGB .85 .35 .35\nSPECEX 0\nSPECRGB 0 0 0\nREFL 0\nREFR 0\nREFRIOR 0\nEMITTANCE 0\n\n"
+    "MATERIAL 3\nRGB .35 .85 .35\nSPECEX 0\nSPECRGB 0 0 0\nREFL 0\nREFR 0\nREFRIOR 0\nEMITTANCE 0\n\n"
+    "MATERIAL 4\nRGB .98 .98 .98\nSPECEX 0\nSPECRGB .98 .98 .98\nREFL 0\nREFR 1\nREFRIOR 1.52\nEMITTANCE 0\n\n"
+    "MATERIAL 5\nRGB .98 .98 .98\nSPECEX 0\nSPECRGB .98 .98 .98\nREFL 1\nREFR 0\nREFRIOR 0\nEMITTANCE 0\n\n"
+    "CAMERA\nRES 400 400\nFOVY 45\nITERATIONS 16\nDEPTH %d\nFILE %s\n"
+    "EYE 0.0 5 10.5\nLOOKAT 0 5 0\nUP 0 1 0\n\n"
+    "OBJECT 0\ncube\nmaterial 0\nTRANS 0 10 0\nROTAT 0 0 0\nSCALE 3 .3 3\n\n"
+    "OBJECT 1\ncube\nmaterial 1\nTRANS 0 0 0\nROTAT 0 0 0\nSCALE 10 .01 10\n\n"
+    "OBJECT 2\ncube\nmaterial 1\nTRANS 0 10 0\nROTAT 0 0 90\nSCALE .01 10 10\n\n"
+    "OBJECT 3\ncube\nmaterial 1\nTRANS 0 5 -5\nROTAT 0 90 0\nSCALE .01 10 10\n\n"
+    "OBJECT 4\ncube\nmaterial 2\nTRANS -5 5 0\nROTAT 0 0 0\nSCALE .01 10 10\n\n"
+    "OBJECT 5\ncube\nmaterial 3\nTRANS 5 5 0\nROTAT 0 0 0\nSCALE .01 10 10\n\n";
+
+static const StressScene STRESS_SCENES[] = {
+    // long glass paths: many live paths late, divergent materials
+    { "stress-glass", 16,
+        "OBJECT 6\nsphere\nmaterial 4\nTRANS -3.5 1 -3.5\nROTAT 0 0 0\nSCALE .8 .8 .8\n"
+        "ARRAY 8 3 8 1 2.5 1\n" },
+    // thousands of mesh instances: TLAS and BLAS traversal bound
+    { "stress-meshes", 8,
+        "OBJECT 6\nmesh models/torus.obj\nmaterial 5\nTRANS -4.2 .5 -4.2\nROTAT 30 0 20\nSCALE .6 .6 .6\n"
+        "ARRAY 15 6 15 .6 1.5 .6\n" },
+    // sphere traced implicit surfaces: long per-thread loops
+    { "stress-implicit", 8,
+        "OBJECT 6\ncsg1\nmaterial 1\nTRANS -2.5 2.5 -1\nROTAT 0 30 0\nSCALE .6 .6 .6\n"
+        "ARRAY 3 2 1 2.5 4 1\n" },
+    // diffuse, mirror and glass spheres interleaved: neighboring pixels shade
+    // different materials, the divergence material sorting removes
+    { "stress-materials", 8,
+        "OBJECT 6\nsphere\nmaterial 2\nTRANS -4 .5 -4\nROTAT 0 0 0\nSCALE .5 .5 .5\n"
+        "ARRAY 6 4 6 1.5 2 1.5\n\n"
+        "OBJECT 7\nsphere\nmaterial 5\nTRANS -3.25 1 -3.5\nROTAT 0 0 0\nSCALE .5 .5 .5\n"
+        "ARRAY 6 4 6 1.5 2 1.5\n\n"
+        "OBJECT 8\nsphere\nmaterial 4\nTRANS -3.5 1.5 -3.25\nROTAT 0 0 0\nSCALE .5 .5 .5\n"
+        "ARRAY 6 4 6 1.5 2 1.5\n" },
+};
+
+// Writes a stress scene to `path`; false if the file cannot be written.
+static bool writeStressScene(const std::string &path, const StressScene &stress) {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        return false;
+    }
+    fprintf(fp, STRESS_HEADER, stress.traceDepth, stress.name);
+    fputs(stress.objects, fp);
+    fclose(fp);
+    return true;
+}
+
+// High-water mark of the process's resident memory, in bytes.
+static long long hostPeakBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#  ifdef __APPLE__
+    return usage.ru_maxrss;
+#  else
+    return usage.ru_maxrss * 1024LL;
+#  endif
+#endif
+}
+
+// Device memory in use by every process, in bytes; 0 on the CPU backend.
+static long long deviceUsedBytes() {
+    if (pathtraceGetBackend() != BACKEND_CUDA) {
+        return 0;
+    }
+    size_t freeBytes, totalBytes;
+    cudaMemGetInfo(&freeBytes, &totalBytes);
+    return (long long)(totalBytes - freeBytes);
+}
+
+// Same camera basis as runHeadless() sees for an unmoved camera.
+static void setupCamera(Camera &cam) {
+    cam.view = glm::normalize(cam.lookAt - cam.position);
+    cam.right = glm::normalize(glm::cross(cam.view, cam.up));
+    cam.up = glm::cross(cam.right, cam.view);
+}
+
+static std::string jsonString(const std::string &s) {
+    std::string out = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\') {
+            out += '\\';
+        }
+        out += s[i];
+    }
+    return out + "\"";
+}
+
+// Per-iteration times of one run, for comparing runs of a scene
+struct RunTimes {
+    double ms;
+    double stageMs[NUM_PATHTRACE_STAGES];
+};
+
+/**
+ * Renders `scene` for `warmup` + `iterations` iterations under its current
+ * options, appends one JSON run object to `fp` and returns its times.
+ */
+static RunTimes benchmarkRun(FILE *fp, bool first, const std::string &sceneName, Scene *scene,
+        int warmup, int iterations) {
+    const Camera &cam = scene->state.camera;
+    const RenderOptions &options = scene->state.options;
+    using clock = std::chrono::high_resolution_clock;
+
+    // wall time, no stage synchronization
+    long long deviceBefore = deviceUsedBytes();
+    pathtraceInit(scene);
+    long long deviceBytes = deviceUsedBytes() - deviceBefore;
+    for (int iter = 1; iter <= warmup; iter++) {
+        pathtrace(NULL, 0, iter);
+    }
+    clock::time_point start = clock::now();
+    for (int iter = warmup + 1; iter <= warmup + iterations; iter++) {
+        pathtrace(NULL, 0, iter);
+    }
+    // waits for the last iteration, which may still be running on the device
+    pathtraceReadImage();
+    double seconds = std::chrono::duration<double>(clock::now() - start).count();
+    pathtraceFree();
+
+    // the same iterations again, with the per-stage and per-bounce hooks
+    PathtraceStats stats;
+    pathtraceInit(scene);
+    for (int iter = 1; iter <= warmup + iterations; iter++) {
+        pathtraceSetStats(iter > warmup ? &stats : NULL);
+        pathtrace(NULL, 0, iter);
+    }
+    pathtraceSetStats(NULL);
+    pathtraceFree();
+
+    long long rays = 0;
+    for (size_t d = 0; d < stats.activePaths.size(); d++) {
+        rays += stats.activePaths[d];
+    }
+    double samples = (double)cam.resolution.x * cam.resolution.y * iterations;
+
+    fprintf(fp, "%s\n    {\"scene\": %s, \"resolution\": [%d, %d], \"traceDepth\": %d,\n",
+        first ? "" : ",", jsonString(sceneName).c_str(), cam.resolution.x, cam.resolution.y,
+        scene->state.traceDepth);
+    fprintf(fp, "     \"options\": {\"compact\": %s, \"sorting\": %s, \"caching\": %s, "
+        "\"nee\": %s, \"roulette\": %s, \"adaptive\": %g, \"sampler\": \"%s\"},\n",
+        options.compact ? "true" : "false", options.sorting ? "true" : "false",
+        options.caching ? "true" : "false", options.nee ? "true" : "false",
+        options.roulette ? "true" : "false", options.adaptive, renderOptions::samplerName(options.sampler));
+    fprintf(fp, "     \"seconds\": %.6f, \"rays\": %lld, \"raysPerSecond\": %.1f, \"samplesPerSecond\": %.1f,\n",
+        seconds, rays, rays / seconds, samples / seconds);
+    fprintf(fp, "     \"activePathsPerIteration\": [");
+    for (size_t d = 0; d < stats.activePaths.size(); d++) {
+        fprintf(fp, "%s%.1f", d ? ", " : "", (double)stats.activePaths[d] / iterations);
+    }
+    fprintf(fp, "],\n     \"stageMsPerIteration\": {");
+    for (int s = 0; s < NUM_PATHTRACE_STAGES; s++) {
+        fprintf(fp, "%s\"%s\": %.4f", s ? ", " : "", pathtraceStageName(s), stats.stageMs[s] / iterations);
+    }
+    fprintf(fp, "},\n     \"deviceBytes\": %lld, \"hostPeakBytes\": %lld}",
+        deviceBytes, hostPeakBytes());
+    fflush(fp);
+
+    printf("%-28s %s  %8.2f Mrays/s  %8.2f ms/iter\n", sceneName.c_str(),
+        renderOptions::toString(options).c_str(), rays / seconds / 1e6, seconds * 1e3 / iterations);
+
+    RunTimes times;
+    times.ms = seconds * 1e3 / iterations;
+    for (int s = 0; s < NUM_PATHTRACE_STAGES; s++) {
+        times.stageMs[s] = stats.stageMs[s] / iterations;
+    }
+    return times;
+}
+
+// A sorted run of a scene and the unsorted run with the same other options
+struct SortingPayoff {
+    std::string sceneName;
+    bool compact;
+    bool caching;
+    RunTimes unsorted;
+    RunTimes sorted;
+};
+
+/**
+ * Appends one JSON object to `fp` weighing `payoff`'s runs: the time the
+ * sort takes, the shading time it saves and the net change of the iteration
+ * time, all per iteration. Sorting pays off where the net change is
+ * negative.
+ */
+static void writeSortingPayoff(FILE *fp, bool first, const SortingPayoff &payoff) {
+    double sortMs = payoff.sorted.stageMs[STAGE_SORT];
+    double shadeSavedMs = payoff.unsorted.stageMs[STAGE_SHADE] - payoff.sorted.stageMs[STAGE_SHADE];
+    double netMs = payoff.sorted.ms - payoff.unsorted.ms;
+    fprintf(fp, "%s\n    {\"scene\": %s, \"compact\": %s, \"caching\": %s, \"sortMsPerIteration\": %.4f, "
+        "\"shadeMsSavedPerIteration\": %.4f, \"netMsPerIteration\": %.4f}",
+        first ? "" : ",", jsonString(payoff.sceneName).c_str(), payoff.compact ? "true" : "false",
+        payoff.caching ? "true" : "false", sortMs, shadeSavedMs, netMs);
+    printf("%-28s sorting compact=%d caching=%d  sort %7.2f ms  shade saved %7.2f ms  net %+8.2f ms/iter\n",
+        payoff.sceneName.c_str(), payoff.compact, payoff.caching, sortMs, shadeSavedMs, netMs);
+}
+
+// Pixel strides of the drag frames the interactive replay compares; 1 is
+// full resolution
+static const int REPLAY_STRIDES[] = { 1, 2, 4 };
+
+// Turns `cam` about the vertical axis through its look-at point.
+static void orbitCamera(Camera &cam, float angle) {
+    glm::vec3 offset = cam.position - cam.lookAt;
+    float c = cosf(angle);
+    float s = sinf(angle);
+    cam.position = cam.lookAt + glm::vec3(c * offset.x + s * offset.z, offset.y, c * offset.z - s * offset.x);
+    cam.up = glm::vec3(0.0f, 1.0f, 0.0f);
+    setupCamera(cam);
+}
+
+// Waits for the frame the backend is rendering.
+static void finishFrame() {
+    if (pathtraceGetBackend() == BACKEND_CUDA) {
+        cudaDeviceSynchronize();
+    }
+}
+
+/**
+ * Replays a drag of `frames` frames and then `frames` frames holding still,
+ * once per REPLAY_STRIDES entry, and appends one JSON replay object per
+ * stride to `fp`. Drag frames restart the image like a camera move in the
+ * window; with a stride above 1 they render a preview frame instead of the
+ * first full-resolution iteration.
+ */
+static void benchmarkReplay(FILE *fp, bool first, const std::string &sceneName, Scene *scene, int frames) {
+    using clock = std::chrono::high_resolution_clock;
+    Camera &cam = scene->state.camera;
+    const Camera start = cam;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+    // a stand-in for the window's PBO, so frames include the display pass
+    uchar4 *pbo = NULL;
+    std::vector<uchar4> hostPbo;
+    if (pathtraceGetBackend() == BACKEND_CUDA) {
+        cudaMalloc(&pbo, pixelcount * sizeof(uchar4));
+    } else {
+        hostPbo.resize(pixelcount);
+        pbo = hostPbo.data();
+    }
+
+    for (size_t i = 0; i < sizeof(REPLAY_STRIDES) / sizeof(REPLAY_STRIDES[0]); i++) {
+        const int stride = REPLAY_STRIDES[i];
+        cam = start;
+        pathtraceInit(scene);
+        pathtrace(pbo, 0, 1);
+        finishFrame();
+
+        double dragMs = 0.0;
+        double dragMaxMs = 0.0;
+        for (int f = 0; f < frames; f++) {
+            clock::time_point frameStart = clock::now();
+            orbitCamera(cam, REPLAY_ORBIT_STEP);
+            pathtraceResetImage();
+            if (stride > 1) {
+                pathtracePreview(pbo, stride);
+            } else {
+                pathtrace(pbo, 0, 1);
+            }
+            finishFrame();
+            double ms = std::chrono::duration<double, std::milli>(clock::now() - frameStart).count();
+            dragMs += ms;
+            dragMaxMs = std::max(dragMaxMs, ms);
+        }
+
+        // the window's first still frame starts the image over at iteration 1
+        // after a preview, and continues it after a full-resolution drag frame
+        const int firstIteration = stride > 1 ? 1 : 2;
+        clock::time_point settleStart = clock::now();
+        for (int iter = firstIteration; iter < firstIteration + frames; iter++) {
+            pathtrace(pbo, 0, iter);
+        }
+        finishFrame();
+        double settleMs = std::chrono::duration<double, std::milli>(clock::now() - settleStart).count();
+        pathtraceFree();
+
+        fprintf(fp, "%s\n    {\"scene\": %s, \"resolution\": [%d, %d], \"stride\": %d, \"frames\": %d, "
+            "\"dragMsPerFrame\": %.4f, \"dragMaxMs\": %.4f, \"settleMsPerFrame\": %.4f}",
+            first && i == 0 ? "" : ",", jsonString(sceneName).c_str(), cam.resolution.x, cam.resolution.y,
+            stride, frames, dragMs / frames, dragMaxMs, settleMs / frames);
+        fflush(fp);
+        printf("%-28s replay stride %d  %8.2f ms/drag frame  %8.2f ms/still frame\n", sceneName.c_str(),
+            stride, dragMs / frames, settleMs / frames);
+    }
+    cam = start;
+
+    if (pathtraceGetBackend() == BACKEND_CUDA) {
+        cudaFree(pbo);
+    }
+}
+
+// Samples per pixel at which the denoiser study compares against the
+// reference
+static const int DENOISE_SAMPLES[] = { 1, 4, 16, 64 };
+
+/**
+ * Root mean square error, in 8-bit steps over every channel, of `image`
+ * divided by `samples` against `reference`, with the image mirrored, clamped
+ * and quantized as main.cpp saves it.
+ */
+static double referenceError(const std::vector<glm::vec3> &image, float samples,
+        const unsigned char *reference, glm::ivec2 resolution) {
+    double sum = 0.0;
+    for (int y = 0; y < resolution.y; y++) {
+        for (int x = 0; x < resolution.x; x++) {
+            glm::vec3 pix = glm::clamp(image[x + y * resolution.x] / samples, glm::vec3(), glm::vec3(1)) * 255.f;
+            const unsigned char *ref = reference + 3 * (resolution.x - 1 - x + y * resolution.x);
+            for (int c = 0; c < 3; c++) {
+                double d = (double)(unsigned char)pix[c] - ref[c];
+                sum += d * d;
+            }
+        }
+    }
+    return sqrt(sum / (3.0 * resolution.x * resolution.y));
+}
+
+/**
+ * Renders `scene` up to the last of DENOISE_SAMPLES iterations and, at each
+ * of them, denoises the image and appends one JSON object to `fp`: the
+ * denoiser's time per filter level and the error of the noisy and the
+ * denoised image against `reference`.
+ */
+static void benchmarkDenoise(FILE *fp, const std::string &sceneName, Scene *scene,
+        const unsigned char *reference) {
+    const Camera &cam = scene->state.camera;
+    const int levels = scene->state.options.denoise;
+    const int numSamples = sizeof(DENOISE_SAMPLES) / sizeof(DENOISE_SAMPLES[0]);
+
+    pathtraceInit(scene);
+    std::vector<glm::vec3> denoised;
+    int next = 0;
+    for (int iter = 1; next < numSamples; iter++) {
+        pathtrace(NULL, 0, iter);
+        if (iter != DENOISE_SAMPLES[next]) {
+            continue;
+        }
+        pathtraceReadImage();
+        double noisyError = referenceError(scene->state.image, (float)iter, reference, cam.resolution);
+
+        PathtraceStats stats;
+        pathtraceSetStats(&stats);
+        pathtraceDenoise(denoised);
+        pathtraceSetStats(NULL);
+        double denoisedError = referenceError(denoised, 1.0f, reference, cam.resolution);
+        double msPerLevel = stats.stageMs[STAGE_DENOISE] / levels;
+
+        fprintf(fp, "%s\n    {\"scene\": %s, \"resolution\": [%d, %d], \"samples\": %d, \"levels\": %d, "
+            "\"msPerLevel\": %.4f, \"noisyError\": %.4f, \"denoisedError\": %.4f}",
+            next == 0 ? "" : ",", jsonString(sceneName).c_str(), cam.resolution.x, cam.resolution.y,
+            iter, levels, msPerLevel, noisyError, denoisedError);
+        fflush(fp);
+        printf("%-28s denoise %4d spp  %8.2f ms/level  error %7.2f -> %7.2f\n", sceneName.c_str(),
+            iter, msPerLevel, noisyError, denoisedError);
+        next++;
+    }
+    pathtraceFree();
+}
+
+/**
+ * Applies a `name[=value]` render option argument; a bare name means on.
+ */
+static bool setRenderOption(RenderOptions &options, const std::string &arg) {
+    size_t eq = arg.find('=');
+    if (eq == std::string::npos) {
+        return renderOptions::set(options, arg, "1");
+    }
+    return renderOptions::set(options, arg.substr(0, eq), arg.substr(eq + 1));
+}
+
+int main(int argc, char **argv) {
+    RenderBackend backend = BACKEND_CUDA;
+    int numThreads = 0;
+    int iterations = 16;
+    int warmup = 1;
+    int replayFrames = 0;
+    const char *referenceFile = NULL;
+    bool stress = true;
+    const char *outFile = "benchmark.json";
+    std::vector<std::string> sceneFiles;
+    // applied over the defaults before the compact/sorting/caching sweep
+    RenderOptions baseOptions = renderOptions::defaults();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu") == 0) {
+            backend = BACKEND_CPU;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            numThreads = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--iterations=", 13) == 0) {
+            iterations = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            warmup = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replayFrames = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--reference=", 12) == 0) {
+            referenceFile = argv[i] + 12;
+        } else if (strncmp(argv[i], "--out=", 6) == 0) {
+            outFile = argv[i] + 6;
+        } else if (strcmp(argv[i], "--no-stress") == 0) {
+            stress = false;
+        } else if (argv[i][0] != '-') {
+            sceneFiles.push_back(argv[i]);
+        } else if (strncmp(argv[i], "--", 2) == 0 && setRenderOption(baseOptions, argv[i] + 2)) {
+            continue;
+        } else {
+            printf("Unknown argument: %s\n", argv[i]);
+            sceneFiles.clear();
+            break;
+        }
+    }
+    if (sceneFiles.empty() || iterations < 1 || warmup < 0 || replayFrames < 0) {
+        printf("Usage: %s [--cpu] [--threads=N] [--iterations=N] [--warmup=N] [--replay=N] "
+            "[--reference=FILE.png] [--out=FILE.json] [--no-stress] [--OPTION[=0|1] ...] SCENEFILE.txt ...\n",
+            argv[0]);
+        return 1;
+    }
+    pathtraceSetBackend(backend, numThreads);
+
+    // stress scenes live next to the first scene so their mesh paths resolve
+    std::vector<std::string> generated;
+    if (stress) {
+        size_t slash = sceneFiles[0].find_last_of("/\\");
+        std::string dir = slash == std::string::npos ? "" : sceneFiles[0].substr(0, slash + 1);
+        for (size_t i = 0; i < sizeof(STRESS_SCENES) / sizeof(STRESS_SCENES[0]); i++) {
+            std::string path = dir + STRESS_SCENES[i].name + ".generated.txt";
+            if (writeStressScene(path, STRESS_SCENES[i])) {
+                sceneFiles.push_back(path);
+                generated.push_back(path);
+            } else {
+                printf("Could not write %s, skipping it\n", path.c_str());
+            }
+        }
+    }
+
+    FILE *fp = fopen(outFile, "w");
+    if (!fp) {
+        printf("Could not open %s\n", outFile);
+        return 1;
+    }
+    fprintf(fp, "{\"backend\": \"%s\", ", backend == BACKEND_CPU ? "cpu" : "cuda");
+    if (backend == BACKEND_CUDA) {
+        cudaDeviceProp prop;
+        cudaGetDeviceProperties(&prop, 0);
+        fprintf(fp, "\"device\": %s, ", jsonString(prop.name).c_str());
+    } else {
+        fprintf(fp, "\"threads\": %d, ", numThreads);
+    }
+    fprintf(fp, "\"iterations\": %d, \"warmup\": %d,\n  \"runs\": [", iterations, warmup);
+
+    bool first = true;
+    std::vector<Scene *> scenes;
+    std::vector<SortingPayoff> payoffs;
+    for (size_t s = 0; s < sceneFiles.size(); s++) {
+        // leaked on purpose: Scene::~Scene is declared but never defined
+        Scene *scene = new Scene(sceneFiles[s]);
+        scenes.push_back(scene);
+        setupCamera(scene->state.camera);
+        size_t slash = sceneFiles[s].find_last_of("/\\");
+        std::string sceneName = slash == std::string::npos ? sceneFiles[s] : sceneFiles[s].substr(slash + 1);
+
+        RunTimes times[8];
+        for (int config = 0; config < 8; config++) {
+            // the CPU backend never compacts or sorts, only caching changes it
+            if (backend == BACKEND_CPU && (config & 3) != 0) {
+                continue;
+            }
+            RenderOptions &options = scene->state.options;
+            options = baseOptions;
+            options.compact = (config & 1) != 0;
+            options.sorting = (config & 2) != 0;
+            options.caching = (config & 4) != 0;
+            times[config] = benchmarkRun(fp, first, sceneName, scene, warmup, iterations);
+            first = false;
+            if (options.sorting) {
+                SortingPayoff payoff = { sceneName, options.compact, options.caching, times[config & ~2], times[config] };
+                payoffs.push_back(payoff);
+            }
+        }
+    }
+    fprintf(fp, "\n  ]");
+
+    if (!payoffs.empty()) {
+        fprintf(fp, ",\n  \"sorting\": [");
+        for (size_t i = 0; i < payoffs.size(); i++) {
+            writeSortingPayoff(fp, i == 0, payoffs[i]);
+        }
+        fprintf(fp, "\n  ]");
+    }
+
+    if (replayFrames > 0) {
+        fprintf(fp, ",\n  \"replays\": [");
+        for (size_t s = 0; s < scenes.size(); s++) {
+            size_t slash = sceneFiles[s].find_last_of("/\\");
+            std::string sceneName = slash == std::string::npos ? sceneFiles[s] : sceneFiles[s].substr(slash + 1);
+            scenes[s]->state.options = baseOptions;
+            benchmarkReplay(fp, s == 0, sceneName, scenes[s], replayFrames);
+        }
+        fprintf(fp, "\n  ]");
+    }
+
+    if (referenceFile) {
+        // the study denoises whether or not the runs did
+        RenderOptions &options = scenes[0]->state.options;
+        options = baseOptions;
+        if (options.denoise == 0) {
+            renderOptions::set(options, "denoise", "1");
+        }
+        const Camera &cam = scenes[0]->state.camera;
+        int width, height, channels;
+        unsigned char *reference = stbi_load(referenceFile, &width, &height, &channels, 3);
+        if (!reference) {
+            printf("Could not read %s\n", referenceFile);
+        } else if (width != cam.resolution.x || height != cam.resolution.y) {
+            printf("%s is %dx%d, not %dx%d like %s\n", referenceFile, width, height,
+                cam.resolution.x, cam.resolution.y, sceneFiles[0].c_str());
+        } else {
+            size_t slash = sceneFiles[0].find_last_of("/\\");
+            std::string sceneName = slash == std::string::npos ? sceneFiles[0] : sceneFiles[0].substr(slash + 1);
+            fprintf(fp, ",\n  \"reference\": %s, \"denoise\": [", jsonString(referenceFile).c_str());
+            benchmarkDenoise(fp, sceneName, scenes[0], reference);
+            fprintf(fp, "\n  ]");
+        }
+        stbi_image_free(reference);
+    }
+    fprintf(fp, "}\n");
+    fclose(fp);
+    printf("Wrote %s\n", outFile);
+
+    for (size_t i = 0; i < generated.size(); i++) {
+        remove(generated[i].c_str());
+        remove((generated[i] + ".bvh").c_str());
+    }
+    if (backend == BACKEND_CUDA) {
+        cudaDeviceReset();
+    }
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include "accumulation.h"
+
+namespace {
+// File magics; the last byte is the format version
+const char BUFFER_MAGIC[8] = { 'P', 'T', 'A', 'C', 'C', 'U', 'M', 1 };
+const char CHECKPOINT_MAGIC[8] = { 'P', 'T', 'C', 'K', 'P', 'T', 'V', 1 };
+
+struct Header {
+    char magic[8];
+    int width;
+    int height;
+    int firstIteration;
+    int lastIteration;
+};
+
+// Follows the buffer in a checkpoint, then the options and the variance
+struct CheckpointHeader {
+    glm::vec3 orbit;
+    glm::vec3 lookAt;
+    int optionsLength;
+    int numVariance;
+};
+
+bool byFirstIteration(const accumulation::Buffer *a, const accumulation::Buffer *b) {
+    return a->firstIteration < b->firstIteration;
+}
+
+/**
+ * Calls `write` on a temporary file and renames it over `path`, like
+ * bvhCache::save(). Returns false, leaving `path` as it was, if any step
+ * fails.
+ */
+template<class Write>
+bool saveAtomically(const std::string &path, Write write) {
+    std::string tmpPath = path + ".tmp";
+    FILE *fp = fopen(tmpPath.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = write(fp);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    return MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+#endif
+}
+
+bool writeBuffer(FILE *fp, const char *magic, const accumulation::Buffer &buffer) {
+    Header header;
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.width = buffer.width;
+    header.height = buffer.height;
+    header.firstIteration = buffer.firstIteration;
+    header.lastIteration = buffer.lastIteration;
+    return fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(buffer.sum.data(), sizeof(glm::vec3), buffer.sum.size(), fp) == buffer.sum.size();
+}
+
+// Opens `path` and reads the buffer at its start. Returns NULL and prints
+// why on failure.
+FILE *readBuffer(const std::string &path, const char *magic, accumulation::Buffer &buffer) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        printf("Could not open %s\n", path.c_str());
+        return NULL;
+    }
+    Header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, magic, sizeof(header.magic)) != 0
+            || header.width <= 0 || header.height <= 0) {
+        printf("%s is not %s\n", path.c_str(),
+            magic == BUFFER_MAGIC ? "an accumulation buffer" : "a checkpoint");
+        fclose(fp);
+        return NULL;
+    }
+    buffer.width = header.width;
+    buffer.height = header.height;
+    buffer.firstIteration = header.firstIteration;
+    buffer.lastIteration = header.lastIteration;
+    buffer.sum.resize((size_t)header.width * header.height);
+    if (fread(buffer.sum.data(), sizeof(glm::vec3), buffer.sum.size(), fp) != buffer.sum.size()) {
+        printf("%s is truncated\n", path.c_str());
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+}
+
+bool accumulation::save(const std::string &path, const Buffer &buffer) {
+    return saveAtomically(path, [&buffer](FILE *fp) {
+        return writeBuffer(fp, BUFFER_MAGIC, buffer);
+    });
+}
+
+bool accumulation::saveCheckpoint(const std::string &path, const Checkpoint &checkpoint) {
+    return saveAtomically(path, [&checkpoint](FILE *fp) {
+        CheckpointHeader header;
+        header.orbit = checkpoint.orbit;
+        header.lookAt = checkpoint.lookAt;
+        header.optionsLength = checkpoint.options.size();
+        header.numVariance = checkpoint.variance.size();
+        const std::vector<PixelVariance> &variance = checkpoint.variance;
+        return writeBuffer(fp, CHECKPOINT_MAGIC, checkpoint.buffer)
+            && fwrite(&header, sizeof(header), 1, fp) == 1
+            && fwrite(checkpoint.options.data(), 1, checkpoint.options.size(), fp) == checkpoint.options.size()
+            && fwrite(variance.data(), sizeof(PixelVariance), variance.size(), fp) == variance.size();
+    });
+}
+
+bool accumulation::load(const std::string &path, Buffer &buffer) {
+    FILE *fp = readBuffer(path, BUFFER_MAGIC, buffer);
+    if (!fp) {
+        return false;
+    }
+    fclose(fp);
+    return true;
+}
+
+bool accumulation::loadCheckpoint(const std::string &path, Checkpoint &checkpoint) {
+    FILE *fp = readBuffer(path, CHECKPOINT_MAGIC, checkpoint.buffer);
+    if (!fp) {
+        return false;
+    }
+    CheckpointHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1
+        && header.optionsLength >= 0 && header.numVariance >= 0;
+    if (ok) {
+        checkpoint.orbit = header.orbit;
+        checkpoint.lookAt = header.lookAt;
+        checkpoint.options.resize(header.optionsLength);
+        checkpoint.variance.resize(header.numVariance);
+        ok = fread(&checkpoint.options[0], 1, header.optionsLength, fp) == (size_t)header.optionsLength
+            && fread(checkpoint.variance.data(), sizeof(PixelVariance), header.numVariance, fp)
+                == (size_t)header.numVariance;
+    }
+    fclose(fp);
+    if (!ok) {
+        printf("%s is truncated\n", path.c_str());
+    }
+    return ok;
+}
+
+bool accumulation::merge(const std::vector<Buffer> &pieces, Buffer &merged) {
+    if (pieces.empty()) {
+        return false;
+    }
+    // add in iteration order, so the result does not depend on the order the
+    // pieces were listed or finished in
+    std::vector<const Buffer *> order;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        order.push_back(&pieces[i]);
+    }
+    std::sort(order.begin(), order.end(), byFirstIteration);
+
+    merged.width = order[0]->width;
+    merged.height = order[0]->height;
+    merged.firstIteration = order[0]->firstIteration;
+    merged.lastIteration = order[0]->firstIteration - 1;
+    merged.sum.assign((size_t)merged.width * merged.height, glm::vec3(0.0f));
+    for (size_t i = 0; i < order.size(); i++) {
+        const Buffer &piece = *order[i];
+        if (piece.width != merged.width || piece.height != merged.height) {
+            printf("Cannot merge a %dx%d buffer into %dx%d\n", piece.width, piece.height,
+                merged.width, merged.height);
+            return false;
+        }
+        if (piece.firstIteration != merged.lastIteration + 1) {
+            printf("Iterations %d-%d do not follow %d-%d\n", piece.firstIteration, piece.lastIteration,
+                merged.firstIteration, merged.lastIteration);
+            return false;
+        }
+        for (size_t p = 0; p < merged.sum.size(); p++) {
+            merged.sum[p] += piece.sum[p];
+        }
+        merged.lastIteration = std::max(merged.lastIteration, piece.lastIteration);
+    }
+    return true;
+}
+
+void accumulation::splitRange(int iterations, int k, int n, int &first, int &last) {
+    int base = iterations / n;
+    int extra = iterations % n;
+    first = k * base + std::min(k, extra) + 1;
+    last = first + base + (k < extra ? 1 : 0) - 1;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "sceneStructs.h"
+
+/**
+ * Raw accumulation buffers for rendering one frame in pieces. A worker
+ * renders a range of iterations and saves the float sum of its samples with
+ * the range; merge() adds the pieces and the sample counts. Random numbers
+ * are keyed by pixel and iteration (see philox.h), so the pieces sum to the
+ * same image a single process would render, up to float rounding.
+ *
+ * The file is a fixed header followed by width * height RGB floats, in the
+ * order of RenderState::image. Saving writes a temporary file and renames
+ * it over the target, so a reader never sees a half-written buffer.
+ *
+ * A checkpoint is a buffer plus what a render needs to continue it: the
+ * options and camera it was rendered with and the adaptive sampling state.
+ * The iteration count is the whole random number state, since every draw is
+ * keyed by iteration rather than by a generator's history.
+ */
+namespace accumulation {
+    struct Buffer {
+        int width;
+        int height;
+        int firstIteration;     // 1-based, inclusive
+        int lastIteration;      // inclusive; the buffer holds no samples if below firstIteration
+        std::vector<glm::vec3> sum;
+
+        int samples() const {
+            return lastIteration >= firstIteration ? lastIteration - firstIteration + 1 : 0;
+        }
+    };
+
+    struct Checkpoint {
+        Buffer buffer;
+        std::string options;                // renderOptions that change the image
+        glm::vec3 orbit;                    // camera phi, theta and zoom
+        glm::vec3 lookAt;
+        std::vector<PixelVariance> variance;    // adaptive sampling only
+    };
+
+    // Returns false if the file cannot be written.
+    extern bool save(const std::string &path, const Buffer &buffer);
+    extern bool saveCheckpoint(const std::string &path, const Checkpoint &checkpoint);
+
+    // Returns false and prints why if the file is missing, truncated or not
+    // an accumulation buffer.
+    extern bool load(const std::string &path, Buffer &buffer);
+    extern bool loadCheckpoint(const std::string &path, Checkpoint &checkpoint);
+
+    // Adds `pieces` in iteration order into `merged`. Returns false and prints
+    // why if their sizes differ or their ranges overlap or leave a gap.
+    extern bool merge(const std::vector<Buffer> &pieces, Buffer &merged);
+
+    // First and last iteration of piece `k` of `n` equal pieces of
+    // `iterations`; the first pieces take the remainder.
+    extern void splitRange(int iterations, int k, int n, int &first, int &last);
+}
@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <cfloat>
+
+#include "bvh.h"
+#include "intersections.h"
+
+// Number of buckets centroids are binned into when evaluating splits
+#define SAH_BINS 16
+// Cost of visiting a node relative to one primitive intersection test
+#define SAH_TRAVERSAL_COST 1.0f
+// Leaves this small are kept whenever splitting does not pay off
+#define MAX_LEAF_SIZE 4
+
+AABB::AABB() :
+        min(FLT_MAX),
+        max(-FLT_MAX) {
+}
+
+AABB::AABB(glm::vec3 min, glm::vec3 max) :
+        min(min),
+        max(max) {
+}
+
+void AABB::grow(glm::vec3 p) {
+    min = glm::min(min, p);
+    max = glm::max(max, p);
+}
+
+void AABB::grow(const AABB &box) {
+    min = glm::min(min, box.min);
+    max = glm::max(max, box.max);
+}
+
+glm::vec3 AABB::centroid() const {
+    return 0.5f * (min + max);
+}
+
+float AABB::surfaceArea() const {
+    glm::vec3 d = max - min;
+    if (d.x < 0 || d.y < 0 || d.z < 0) {
+        return 0;
+    }
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+Blas bvh::makeImplicitBlas(GeomType type) {
+    Blas blas;
+    blas.type = type;
+    switch (type) {
+    case CSG1:
+        blas.bboxMin = -CSG1_BOUND;
+        blas.bboxMax = CSG1_BOUND;
+        break;
+    case CSG2:
+        blas.bboxMin = -CSG2_BOUND;
+        blas.bboxMax = CSG2_BOUND;
+        break;
+    default:
+        // unit cube and sphere both fit in [-0.5, 0.5]
+        blas.bboxMin = glm::vec3(-0.5f);
+        blas.bboxMax = glm::vec3(0.5f);
+        break;
+    }
+    blas.nodeOffset = 0;
+    blas.triOffset = 0;
+    return blas;
+}
+
+void bvh::buildMesh(const std::vector<glm::vec3> &positions,
+        const std::vector<glm::ivec3> &triangles, std::vector<BVHNode> &nodes, std::vector<int> &order) {
+    std::vector<AABB> bounds(triangles.size());
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        bounds[i].grow(positions[triangles[i].x]);
+        bounds[i].grow(positions[triangles[i].y]);
+        bounds[i].grow(positions[triangles[i].z]);
+    }
+    build(bounds, nodes, order);
+}
+
+Blas bvh::makeMeshBlas(std::vector<glm::ivec3> &triangles,
+        const std::vector<BVHNode> &nodes, const std::vector<int> &order) {
+    std::vector<glm::ivec3> sorted(triangles.size());
+    for (int i = 0; i < (int)order.size(); i++) {
+        sorted[i] = triangles[order[i]];
+    }
+    triangles.swap(sorted);
+
+    Blas blas;
+    blas.type = TRIANGLE_MESH;
+    blas.bboxMin = nodes.empty() ? glm::vec3(0.0f) : nodes[0].bboxMin;
+    blas.bboxMax = nodes.empty() ? glm::vec3(0.0f) : nodes[0].bboxMax;
+    blas.nodeOffset = 0;
+    blas.triOffset = 0;
+    return blas;
+}
+
+Instance bvh::makeInstance(const glm::mat4 &transform, int blasId, int materialid) {
+    Instance instance;
+    instance.worldToObject = glm::mat4x3(glm::inverse(transform));
+    instance.blasId = blasId;
+    instance.materialid = materialid;
+    return instance;
+}
+
+AABB bvh::instanceBounds(const Instance &instance, const Blas &blas) {
+    glm::mat4 objectToWorld = glm::inverse(glm::mat4(instance.worldToObject));
+    AABB world;
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner(
+            (i & 1) ? blas.bboxMax.x : blas.bboxMin.x,
+            (i & 2) ? blas.bboxMax.y : blas.bboxMin.y,
+            (i & 4) ? blas.bboxMax.z : blas.bboxMin.z);
+        world.grow(glm::vec3(objectToWorld * glm::vec4(corner, 1.0f)));
+    }
+    return world;
+}
+
+namespace {
+struct BuildState {
+    const std::vector<AABB> &bounds;
+    std::vector<glm::vec3> centroids;
+    std::vector<BVHNode> &nodes;
+    std::vector<int> &order;
+
+    BuildState(const std::vector<AABB> &bounds, std::vector<BVHNode> &nodes, std::vector<int> &order) :
+            bounds(bounds),
+            nodes(nodes),
+            order(order) {
+    }
+};
+
+struct Bin {
+    AABB box;
+    int count;
+
+    Bin() : count(0) {}
+};
+}
+
+static int binIndex(float c, float cmin, float extent) {
+    int b = (int)((c - cmin) * SAH_BINS / extent);
+    return glm::clamp(b, 0, SAH_BINS - 1);
+}
+
+/**
+ * Builds the subtree over order[first, first + count) and returns its root.
+ */
+static int subdivide(BuildState &state, int first, int count, int depth) {
+    int nodeIndex = state.nodes.size();
+    state.nodes.push_back(BVHNode());
+
+    AABB box;
+    AABB centroidBox;
+    for (int i = first; i < first + count; i++) {
+        box.grow(state.bounds[state.order[i]]);
+        centroidBox.grow(state.centroids[state.order[i]]);
+    }
+    state.nodes[nodeIndex].bboxMin = box.min;
+    state.nodes[nodeIndex].bboxMax = box.max;
+    state.nodes[nodeIndex].leftFirst = first;
+    state.nodes[nodeIndex].count = count;
+
+    // Traversal keeps one stack entry per level, so never go deeper than that
+    if (count <= 1 || depth >= BVH_STACK_SIZE - 1) {
+        return nodeIndex;
+    }
+
+    // Evaluate the SAH at every bin boundary along every axis
+    int bestAxis = -1;
+    int bestBin = 0;
+    float bestCost = FLT_MAX;
+    for (int axis = 0; axis < 3; axis++) {
+        float cmin = centroidBox.min[axis];
+        float extent = centroidBox.max[axis] - cmin;
+        if (extent <= 0) {
+            continue;
+        }
+
+        Bin bins[SAH_BINS];
+        for (int i = first; i < first + count; i++) {
+            int p = state.order[i];
+            Bin &bin = bins[binIndex(state.centroids[p][axis], cmin, extent)];
+            bin.box.grow(state.bounds[p]);
+            bin.count++;
+        }
+
+        float rightArea[SAH_BINS];
+        int rightCount[SAH_BINS];
+        AABB rightBox;
+        int rightSum = 0;
+        for (int b = SAH_BINS - 1; b > 0; b--) {
+            rightBox.grow(bins[b].box);
+            rightSum += bins[b].count;
+            rightArea[b] = rightBox.surfaceArea();
+            rightCount[b] = rightSum;
+        }
+
+        AABB leftBox;
+        int leftSum = 0;
+        for (int b = 0; b < SAH_BINS - 1; b++) {
+            leftBox.grow(bins[b].box);
+            leftSum += bins[b].count;
+            if (leftSum == 0 || rightCount[b + 1] == 0) {
+                continue;
+            }
+            float cost = leftBox.surfaceArea() * leftSum + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    float leafCost = count;
+    float splitCost = SAH_TRAVERSAL_COST + bestCost / std::max(box.surfaceArea(), FLT_MIN);
+    if (bestAxis < 0 || splitCost >= leafCost) {
+        if (count <= MAX_LEAF_SIZE) {
+            return nodeIndex;
+        }
+    }
+
+    int mid;
+    if (bestAxis >= 0) {
+        float cmin = centroidBox.min[bestAxis];
+        float extent = centroidBox.max[bestAxis] - cmin;
+        int *begin = state.order.data() + first;
+        mid = std::partition(begin, begin + count, [&](int p) {
+            return binIndex(state.centroids[p][bestAxis], cmin, extent) <= bestBin;
+        }) - state.order.data();
+    } else {
+        // every centroid coincides; any split is as good as another
+        mid = first + count / 2;
+    }
+
+    subdivide(state, first, mid - first, depth + 1);
+    int right = subdivide(state, mid, first + count - mid, depth + 1);
+    state.nodes[nodeIndex].leftFirst = right;
+    state.nodes[nodeIndex].count = 0;
+    return nodeIndex;
+}
+
+void bvh::build(const std::vector<AABB> &bounds,
+        std::vector<BVHNode> &nodes, std::vector<int> &order) {
+    nodes.clear();
+    order.resize(bounds.size());
+    for (int i = 0; i < (int)bounds.size(); i++) {
+        order[i] = i;
+    }
+    if (bounds.empty()) {
+        return;
+    }
+
+    BuildState state(bounds, nodes, order);
+    state.centroids.resize(bounds.size());
+    for (int i = 0; i < (int)bounds.size(); i++) {
+        state.centroids[i] = bounds[i].centroid();
+    }
+
+    nodes.reserve(2 * bounds.size());
+    subdivide(state, 0, bounds.size(), 0);
+}
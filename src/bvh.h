@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "sceneStructs.h"
+
+struct AABB {
+    glm::vec3 min;
+    glm::vec3 max;
+
+    AABB();
+    AABB(glm::vec3 min, glm::vec3 max);
+    void grow(glm::vec3 p);
+    void grow(const AABB &box);
+    glm::vec3 centroid() const;
+    float surfaceArea() const;
+};
+
+namespace bvh {
+    // BLAS for one of the implicit shapes, with its object-space bounds.
+    extern Blas makeImplicitBlas(GeomType type);
+
+    // Builds the BVH of a triangle mesh into `nodes`, its leaf order in `order`.
+    extern void buildMesh(const std::vector<glm::vec3> &positions,
+        const std::vector<glm::ivec3> &triangles, std::vector<BVHNode> &nodes, std::vector<int> &order);
+
+    /**
+     * BLAS for a triangle mesh whose BVH is `nodes` and `order`, freshly
+     * built or loaded from the cache; reorders `triangles` into leaf order.
+     * Node and triangle indices are local to the mesh; the caller sets the
+     * offsets when packing meshes together.
+     */
+    extern Blas makeMeshBlas(std::vector<glm::ivec3> &triangles,
+        const std::vector<BVHNode> &nodes, const std::vector<int> &order);
+
+    // Instance of `blasId` placed in the world by `transform`.
+    extern Instance makeInstance(const glm::mat4 &transform, int blasId, int materialid);
+
+    // World-space bounds of an instance: the BLAS bounds under its transform.
+    extern AABB instanceBounds(const Instance &instance, const Blas &blas);
+
+    /**
+     * Builds a BVH over `bounds` using the surface area heuristic and writes
+     * it to `nodes`, flattened depth first. Leaves index primitives in the
+     * permuted order returned in `order`: leaf primitive i is bounds[order[i]].
+     */
+    extern void build(const std::vector<AABB> &bounds,
+        std::vector<BVHNode> &nodes, std::vector<int> &order);
+}
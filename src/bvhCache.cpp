@@ -0,0 +1,256 @@
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bvhCache.h"
+#include "intersections.h"
+
+// Bump whenever BVHNode or the builder changes in a way that invalidates
+// existing cache files.
+#define BVH_CACHE_VERSION 3
+
+namespace {
+struct CacheHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int nodeSize;
+    unsigned long long hash;
+    unsigned int numNodes;
+    unsigned int numPrims;
+};
+
+const char CACHE_MAGIC[8] = { 'P', 'T', 'B', 'V', 'H', 'C', 'A', 'C' };
+
+/**
+ * Read-only memory mapping of a whole file.
+ */
+class MappedFile {
+public:
+    MappedFile(const std::string &path) : data(NULL), size(0) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        mapping = NULL;
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            return;
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping) {
+            return;
+        }
+        data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        size = data ? (size_t)fileSize.QuadPart : 0;
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            return;
+        }
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            return;
+        }
+        data = (const char *)p;
+        size = st.st_size;
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data) munmap((void *)data, size);
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    const char *data;
+    size_t size;
+
+private:
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+}
+
+static void fnv1a(unsigned long long &h, const void *bytes, size_t n) {
+    const unsigned char *p = (const unsigned char *)bytes;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+}
+
+unsigned long long bvhCache::hashInstances(const std::vector<Instance> &instances,
+        const std::vector<Blas> &blases) {
+    unsigned long long h = 14695981039346656037ULL;
+    int version = BVH_CACHE_VERSION;
+    fnv1a(h, &version, sizeof(version));
+    // hash field by field so struct padding never leaks into the key
+    for (size_t i = 0; i < blases.size(); i++) {
+        const Blas &b = blases[i];
+        int type = b.type;
+        fnv1a(h, &type, sizeof(type));
+        fnv1a(h, &b.bboxMin, sizeof(b.bboxMin));
+        fnv1a(h, &b.bboxMax, sizeof(b.bboxMax));
+    }
+    for (size_t i = 0; i < instances.size(); i++) {
+        const Instance &inst = instances[i];
+        fnv1a(h, &inst.worldToObject, sizeof(inst.worldToObject));
+        fnv1a(h, &inst.blasId, sizeof(inst.blasId));
+        fnv1a(h, &inst.materialid, sizeof(inst.materialid));
+    }
+    return h;
+}
+
+unsigned long long bvhCache::hashMesh(const std::vector<glm::vec3> &positions,
+        const std::vector<glm::ivec3> &triangles) {
+    unsigned long long h = 14695981039346656037ULL;
+    int version = BVH_CACHE_VERSION;
+    fnv1a(h, &version, sizeof(version));
+    // glm vectors are tightly packed, so the arrays hash in one go
+    unsigned int numPositions = positions.size();
+    unsigned int numTriangles = triangles.size();
+    fnv1a(h, &numPositions, sizeof(numPositions));
+    fnv1a(h, positions.data(), positions.size() * sizeof(glm::vec3));
+    fnv1a(h, &numTriangles, sizeof(numTriangles));
+    fnv1a(h, triangles.data(), triangles.size() * sizeof(glm::ivec3));
+    return h;
+}
+
+/**
+ * Whether `nodes` is a tree that traversal can walk without leaving its
+ * arrays, as bvh::build() writes them: every interior node's children, at
+ * i + 1 and leftFirst, come after it, every node but the root has exactly
+ * one parent, no interior node is deeper than the builder lets it be, so the
+ * traversal stack cannot overflow, and every leaf covers a nonempty range of
+ * the `numPrims` primitives. `order` must be a permutation of those
+ * primitives. A damaged file whose hash still matches fails here.
+ */
+static bool isValidTree(const BVHNode *nodes, unsigned int numNodes, const int *order, unsigned int numPrims) {
+    if (numNodes == 0) {
+        return false;
+    }
+    std::vector<int> depth(numNodes, -1);
+    depth[0] = 0;
+    for (unsigned int i = 0; i < numNodes; i++) {
+        const BVHNode &node = nodes[i];
+        if (depth[i] < 0) {
+            return false;
+        }
+        if (node.count > 0) {
+            if (node.leftFirst < 0 || (long long)node.leftFirst + node.count > (long long)numPrims) {
+                return false;
+            }
+            continue;
+        }
+        if (node.count < 0 || depth[i] >= BVH_STACK_SIZE - 1 || i + 1 >= numNodes ||
+                node.leftFirst <= (int)i + 1 || (unsigned int)node.leftFirst >= numNodes) {
+            return false;
+        }
+        // children are visited after their parent, so a second parent shows
+        // up as a depth already set
+        if (depth[i + 1] >= 0 || depth[node.leftFirst] >= 0) {
+            return false;
+        }
+        depth[i + 1] = depth[i] + 1;
+        depth[node.leftFirst] = depth[i] + 1;
+    }
+
+    std::vector<bool> seen(numPrims, false);
+    for (unsigned int i = 0; i < numPrims; i++) {
+        if (order[i] < 0 || (unsigned int)order[i] >= numPrims || seen[order[i]]) {
+            return false;
+        }
+        seen[order[i]] = true;
+    }
+    return true;
+}
+
+bool bvhCache::load(const std::string &path, unsigned long long hash,
+        std::vector<BVHNode> &nodes, std::vector<int> &order) {
+    MappedFile file(path);
+    if (!file.data || file.size < sizeof(CacheHeader)) {
+        return false;
+    }
+
+    CacheHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+            header.version != BVH_CACHE_VERSION ||
+            header.nodeSize != sizeof(BVHNode) ||
+            header.hash != hash) {
+        return false;
+    }
+
+    size_t nodeBytes = (size_t)header.numNodes * sizeof(BVHNode);
+    size_t orderBytes = (size_t)header.numPrims * sizeof(int);
+    if (file.size != sizeof(CacheHeader) + nodeBytes + orderBytes) {
+        return false;
+    }
+
+    // the mapping is page aligned and the header keeps the nodes 4-byte
+    // aligned, which is all BVHNode's floats and ints need
+    const BVHNode *firstNode = (const BVHNode *)(file.data + sizeof(CacheHeader));
+    const int *firstPrim = (const int *)(file.data + sizeof(CacheHeader) + nodeBytes);
+    if (!isValidTree(firstNode, header.numNodes, firstPrim, header.numPrims)) {
+        return false;
+    }
+    nodes.assign(firstNode, firstNode + header.numNodes);
+    order.assign(firstPrim, firstPrim + header.numPrims);
+    return true;
+}
+
+bool bvhCache::save(const std::string &path, unsigned long long hash,
+        const std::vector<BVHNode> &nodes, const std::vector<int> &order) {
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = BVH_CACHE_VERSION;
+    header.nodeSize = sizeof(BVHNode);
+    header.hash = hash;
+    header.numNodes = nodes.size();
+    header.numPrims = order.size();
+
+    std::string tmpPath = path + ".tmp";
+    FILE *fp = fopen(tmpPath.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(nodes.data(), sizeof(BVHNode), nodes.size(), fp) == nodes.size();
+    ok = ok && fwrite(order.data(), sizeof(int), order.size(), fp) == order.size();
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    return MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+#endif
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "sceneStructs.h"
+
+/**
+ * On-disk cache of a flattened BVH. The file holds a small header, the node
+ * array and the primitive order exactly as they sit in memory, so loading is
+ * a memory map plus a copy. The header stores a hash of the primitives the
+ * tree was built over; a cache whose hash does not match is ignored.
+ */
+namespace bvhCache {
+    // FNV-1a over every field of every instance and BLAS, in scene order.
+    extern unsigned long long hashInstances(const std::vector<Instance> &instances,
+        const std::vector<Blas> &blases);
+
+    // FNV-1a over a mesh's vertex positions and triangles, as loaded.
+    extern unsigned long long hashMesh(const std::vector<glm::vec3> &positions,
+        const std::vector<glm::ivec3> &triangles);
+
+    // Returns false if the file is missing, malformed or built for another hash.
+    extern bool load(const std::string &path, unsigned long long hash,
+        std::vector<BVHNode> &nodes, std::vector<int> &order);
+
+    // Writes to a temporary file and renames it over `path`, so readers never
+    // see a half-written cache.
+    extern bool save(const std::string &path, unsigned long long hash,
+        const std::vector<BVHNode> &nodes, const std::vector<int> &order);
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "sceneStructs.h"
+
+// Color difference, in demodulated radiance, at which a neighbor of a
+// one-sample pixel weighs 1/e of the center; more samples make the filter
+// stricter, as their mean is less noisy
+#define DENOISE_SIGMA_COLOR 8.0f
+// Normal difference (length of the difference of the unit normals) at which
+// a neighbor weighs 1/e of the center
+#define DENOISE_SIGMA_NORMAL 0.3f
+// Distance of a neighbor from the pixel's surface plane at which it weighs
+// 1/e of the center, as a fraction of the pixel's distance from the camera
+#define DENOISE_SIGMA_PLANE 0.02f
+// Smallest albedo divided out of a color, so black surfaces and misses stay
+// finite
+#define DENOISE_MIN_ALBEDO 0.01f
+
+/**
+ * Edge-avoiding A-Trous wavelet denoiser (Dammertz et al. 2010) for shown
+ * and saved images. Each level convolves the image with the 5x5 B3-spline
+ * kernel, its taps spread 2^level pixels apart, and weights every tap down
+ * by how much its color, normal and surface plane differ from the center
+ * pixel's, taken from the G-buffer of the view's first iteration. Rendering
+ * never reads the result: the accumulated image, and so checkpoints, keep
+ * every sample unfiltered.
+ *
+ * The filter runs on each pixel's mean divided by its albedo, so it only
+ * smooths lighting and multiplies material colors back in sharp afterwards.
+ * An entry of the filtered image is that demodulated mean in rgb and the
+ * pixel's samples in w. The noise of a mean shrinks with its samples, and
+ * every level leaves about half of it, so color differences are scaled by
+ * the samples and by 4 per level before they stop a tap.
+ */
+
+// Taps of the B3-spline kernel by distance from its center, in steps
+__host__ __device__
+inline float atrousKernel(int distance) {
+    return distance == 0 ? 0.375f : (distance == 1 ? 0.25f : 0.0625f);
+}
+
+/**
+ * exp(-x) for the edge-stopping weights, as (1 - x / 16)^16: within 0.02 of
+ * it, exactly 0 from x = 16 on, and without a libm call, so the CPU
+ * backend's loops over a row vectorize.
+ */
+__host__ __device__
+inline float edgeStop(float x) {
+    float w = 1.0f - x * (1.0f / 16.0f);
+    // max(w, 0), spelled so that it vectorizes; fmaxf's NaN rules keep it
+    // from vectorizing without -ffast-math
+    w = 0.5f * (w + fabsf(w));
+    w *= w;
+    w *= w;
+    w *= w;
+    return w * w;
+}
+
+// Factor scaling a squared color difference at `level` of a pixel of `samples`
+__host__ __device__
+inline float denoiseColorScale(float samples, int level) {
+    return samples * (float)(1 << (2 * level)) / (DENOISE_SIGMA_COLOR * DENOISE_SIGMA_COLOR);
+}
+
+// Factor scaling a squared distance from the surface plane of `pixel`, seen
+// from `eye`; 0 where the camera ray missed
+__host__ __device__
+inline float denoisePlaneScale(const GBufferPixel &pixel, const glm::vec3 &eye) {
+    if (pixel.materialId < 0) {
+        return 0.0f;
+    }
+    float tolerance = DENOISE_SIGMA_PLANE * glm::length(pixel.position - eye);
+    return 1.0f / (tolerance * tolerance);
+}
+
+// Filter input of a pixel whose `samples` samples add up to `sum`
+__host__ __device__
+inline glm::vec4 denoiseInput(const glm::vec3 &sum, float samples, const GBufferPixel &pixel) {
+    glm::vec3 mean = samples > 0.0f ? sum / samples : glm::vec3(0.0f);
+    return glm::vec4(mean / glm::max(pixel.albedo, glm::vec3(DENOISE_MIN_ALBEDO)), samples);
+}
+
+// Denoised color of a pixel from its filtered entry
+__host__ __device__
+inline glm::vec3 denoiseOutput(const glm::vec4 &filtered, const GBufferPixel &pixel) {
+    return glm::vec3(filtered) * glm::max(pixel.albedo, glm::vec3(DENOISE_MIN_ALBEDO));
+}
+
+/**
+ * Filtered entry of pixel (x, y) at `level`, from the previous level's
+ * entries `in` (the inputs at level 0). Neighbors on the other side of the
+ * scene's silhouette, where one camera ray hit and the other missed, are
+ * skipped.
+ */
+__host__ __device__
+inline glm::vec4 atrousPixel(const glm::vec4 *in, const GBufferPixel *gbuffer, const glm::vec3 &eye,
+        glm::ivec2 resolution, int x, int y, int level) {
+    const int step = 1 << level;
+    const int index = x + y * resolution.x;
+    const glm::vec3 color = glm::vec3(in[index]);
+    const GBufferPixel &pixel = gbuffer[index];
+    const float colorScale = denoiseColorScale(in[index].w, level);
+    const float planeScale = denoisePlaneScale(pixel, eye);
+    const float normalScale = 1.0f / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL);
+
+    glm::vec3 sum(0.0f);
+    float weightSum = 0.0f;
+    for (int dy = -2; dy <= 2; dy++) {
+        const int yq = y + dy * step;
+        if (yq < 0 || yq >= resolution.y) {
+            continue;
+        }
+        for (int dx = -2; dx <= 2; dx++) {
+            const int xq = x + dx * step;
+            if (xq < 0 || xq >= resolution.x) {
+                continue;
+            }
+            const int q = xq + yq * resolution.x;
+            const GBufferPixel &neighbor = gbuffer[q];
+            if ((neighbor.materialId < 0) != (pixel.materialId < 0)) {
+                continue;
+            }
+            const glm::vec3 colorQ = glm::vec3(in[q]);
+            const glm::vec3 dc = colorQ - color;
+            const glm::vec3 dn = neighbor.normal - pixel.normal;
+            const float dp = glm::dot(neighbor.position - pixel.position, pixel.normal);
+            const float w = atrousKernel(dx < 0 ? -dx : dx) * atrousKernel(dy < 0 ? -dy : dy)
+                * edgeStop(glm::dot(dc, dc) * colorScale + glm::dot(dn, dn) * normalScale + dp * dp * planeScale);
+            sum += w * colorQ;
+            weightSum += w;
+        }
+    }
+    // the center tap always counts, so weightSum > 0
+    return glm::vec4(sum / weightSum, in[index].w);
+}
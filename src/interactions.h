@@ -1,20 +1,20 @@
 #pragma once
 
 #include "intersections.h"
+#include "sampler.h"
 
 // CHECKITOUT
 /**
- * Computes a cosine-weighted random direction in a hemisphere.
+ * Computes a cosine-weighted direction in a hemisphere from a point `u` of
+ * the unit square, e.g. from PixelSampler::get2D().
  * Used for diffuse lighting.
  */
 __host__ __device__
-glm::vec3 calculateRandomDirectionInHemisphere(
-        glm::vec3 normal, thrust::default_random_engine &rng) {
-    thrust::uniform_real_distribution<float> u01(0, 1);
-
-    float up = sqrt(u01(rng)); // cos(theta)
+inline glm::vec3 calculateRandomDirectionInHemisphere(
+        glm::vec3 normal, glm::vec2 u) {
+    float up = sqrt(u.x); // cos(theta)
     float over = sqrt(1 - up * up); // sin(theta)
-    float around = u01(rng) * TWO_PI;
+    float around = u.y * TWO_PI;
 
     // Find a direction that is not the normal based off of whether or not the
     // normal's components are all equal to sqrt(1/3) or whether or not at
@@ -48,7 +48,7 @@ void reflective(
     glm::vec3 intersect,
     glm::vec3 normal,
     const Material &m,
-    thrust::default_random_engine &rng)
+    PhiloxEngine &rng)
 {
     glm::vec3 dir = glm::normalize(pathSegment.ray.direction);
     glm::vec3 nor = glm::normalize(normal);
@@ -64,7 +64,7 @@ void refractive(
     glm::vec3 intersect,
     glm::vec3 normal,
     const Material &m,
-    thrust::default_random_engine &rng)
+    PhiloxEngine &rng)
 {
     glm::vec3 dir = glm::normalize(pathSegment.ray.direction);
     glm::vec3 nor = glm::normalize(normal);
@@ -117,16 +117,20 @@ void refractive(
  *
  * This method applies its changes to the Ray parameter `ray` in place.
  * It also modifies the color `color` of the ray in place.
+ * A diffuse direction uses dimension pair `depth` of `sampler`; the other
+ * choices draw from `rng`.
  *
  * You may need to change the parameter list for your purposes!
  */
 __host__ __device__
-void scatterRay(
+inline void scatterRay(
 		PathSegment &pathSegment,
         glm::vec3 intersect,
         glm::vec3 normal,
         const Material &m,
-        thrust::default_random_engine &rng) 
+        PhiloxEngine &rng,
+        const PixelSampler &sampler,
+        int depth) 
 {
     // TODO: implement this.
     // A basic implementation of pure-diffuse shading will just call the
@@ -195,7 +199,7 @@ void scatterRay(
     // diffuse case
     else
     {
-        pathSegment.ray.direction = calculateRandomDirectionInHemisphere(nor, rng);
+        pathSegment.ray.direction = calculateRandomDirectionInHemisphere(nor, sampler.get2D(depth, rng));
         pathSegment.color *= m.color;
         pathSegment.ray.origin = intersect + (.001f) * pathSegment.ray.direction;
     }
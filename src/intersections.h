@@ -6,6 +6,28 @@
 #include "sceneStructs.h"
 #include "utilities.h"
 
+// Object-space half extents of the implicit surfaces, i.e. the region where
+// their SDF is negative. Used for the BLAS bounds.
+#define CSG1_BOUND glm::vec3(2.3f)
+#define CSG2_BOUND glm::vec3(4.9f, 4.9f, 5.0f)
+
+// Radii of origin-centered spheres around the same regions. Each clips the
+// corners of its box, where the surface never reaches.
+#define CSG1_RADIUS 3.48f
+#define CSG2_RADIUS 5.52f
+
+// Bounds on |grad f| of the implicit surfaces where their box and sphere
+// overlap (maximum over a fine grid, rounded up)
+#define CSG1_LIPSCHITZ 37.5f
+#define CSG2_LIPSCHITZ 900.0f
+
+// Smallest sphere tracing step, in object space, and the step budget per ray
+#define SPHERE_TRACE_EPSILON 1e-4f
+#define SPHERE_TRACE_MAX_STEPS 1024
+
+// Traversal stack depth; the BVH builder never produces deeper trees
+#define BVH_STACK_SIZE 64
+
 /**
  * Handy-dandy hash function that provides seeds for random number generation.
  */
@@ -24,33 +46,42 @@ __host__ __device__ inline unsigned int utilhash(unsigned int a) {
  * Compute a point at parameter value `t` on ray `r`.
  * Falls slightly short so that it doesn't intersect the object it's hitting.
  */
-__host__ __device__ glm::vec3 getPointOnRay(Ray r, float t) {
+__host__ __device__ inline glm::vec3 getPointOnRay(Ray r, float t) {
     return r.origin + (t - .0001f) * glm::normalize(r.direction);
 }
 
 /**
  * Multiplies a mat4 and a vec4 and returns a vec3 clipped from the vec4.
  */
-__host__ __device__ glm::vec3 multiplyMV(glm::mat4 m, glm::vec4 v) {
+__host__ __device__ inline glm::vec3 multiplyMV(glm::mat4 m, glm::vec4 v) {
     return glm::vec3(m * v);
 }
 
+/**
+ * Transforms a ray by a 3x4 affine matrix given by its rows. The direction is
+ * not renormalized, so a parameter `t` along the result names the same point
+ * as `t` along `r`.
+ */
+__host__ __device__ inline Ray transformRay(glm::vec4 row0, glm::vec4 row1, glm::vec4 row2, Ray r) {
+    glm::vec4 o(r.origin, 1.0f);
+    glm::vec4 d(r.direction, 0.0f);
+    Ray q;
+    q.origin = glm::vec3(glm::dot(row0, o), glm::dot(row1, o), glm::dot(row2, o));
+    q.direction = glm::vec3(glm::dot(row0, d), glm::dot(row1, d), glm::dot(row2, d));
+    return q;
+}
+
 // CHECKITOUT
 /**
- * Test intersection between a ray and a transformed cube. Untransformed,
- * the cube ranges from -0.5 to 0.5 in each axis and is centered at the origin.
+ * Test intersection between an object-space ray and the unit cube, which
+ * ranges from -0.5 to 0.5 in each axis and is centered at the origin.
  *
- * @param intersectionPoint  Output parameter for point of intersection.
- * @param normal             Output parameter for surface normal.
+ * @param normal             Output parameter for object-space surface normal.
  * @param outside            Output param for whether the ray came from outside.
  * @return                   Ray parameter `t` value. -1 if no intersection.
  */
-__host__ __device__ float boxIntersectionTest(Geom box, Ray r,
-        glm::vec3 &intersectionPoint, glm::vec3 &normal, bool &outside) {
-    Ray q;
-    q.origin    =                multiplyMV(box.inverseTransform, glm::vec4(r.origin   , 1.0f));
-    q.direction = glm::normalize(multiplyMV(box.inverseTransform, glm::vec4(r.direction, 0.0f)));
-
+__host__ __device__ inline float boxIntersectionTest(Ray q,
+        glm::vec3 &normal, bool &outside) {
     float tmin = -1e38f;
     float tmax = 1e38f;
     glm::vec3 tmin_n;
@@ -82,70 +113,57 @@ __host__ __device__ float boxIntersectionTest(Geom box, Ray r,
             tmin_n = tmax_n;
             outside = false;
         }
-        intersectionPoint = multiplyMV(box.transform, glm::vec4(getPointOnRay(q, tmin), 1.0f));
-        normal = glm::normalize(multiplyMV(box.transform, glm::vec4(tmin_n, 0.0f)));
-        return glm::length(r.origin - intersectionPoint);
+        normal = tmin_n;
+        return tmin;
     }
     return -1;
 }
 
 // CHECKITOUT
 /**
- * Test intersection between a ray and a transformed sphere. Untransformed,
- * the sphere always has radius 0.5 and is centered at the origin.
+ * Test intersection between an object-space ray and the unit sphere, which
+ * has radius 0.5 and is centered at the origin.
  *
- * @param intersectionPoint  Output parameter for point of intersection.
- * @param normal             Output parameter for surface normal.
+ * @param normal             Output parameter for object-space surface normal.
  * @param outside            Output param for whether the ray came from outside.
  * @return                   Ray parameter `t` value. -1 if no intersection.
  */
-__host__ __device__ float sphereIntersectionTest(Geom sphere, Ray r,
-        glm::vec3 &intersectionPoint, glm::vec3 &normal, bool &outside) {
+__host__ __device__ inline float sphereIntersectionTest(Ray q,
+        glm::vec3 &normal, bool &outside) {
     float radius = .5;
 
-    glm::vec3 ro = multiplyMV(sphere.inverseTransform, glm::vec4(r.origin, 1.0f));
-    glm::vec3 rd = glm::normalize(multiplyMV(sphere.inverseTransform, glm::vec4(r.direction, 0.0f)));
-
-    Ray rt;
-    rt.origin = ro;
-    rt.direction = rd;
-
-    float vDotDirection = glm::dot(rt.origin, rt.direction);
-    float radicand = vDotDirection * vDotDirection - (glm::dot(rt.origin, rt.origin) - powf(radius, 2));
+    // the direction is not unit length, so solve the full quadratic
+    float a = glm::dot(q.direction, q.direction);
+    float b = glm::dot(q.origin, q.direction);
+    float c = glm::dot(q.origin, q.origin) - radius * radius;
+    float radicand = b * b - a * c;
     if (radicand < 0) {
         return -1;
     }
 
     float squareRoot = sqrt(radicand);
-    float firstTerm = -vDotDirection;
-    float t1 = firstTerm + squareRoot;
-    float t2 = firstTerm - squareRoot;
+    float t1 = (-b - squareRoot) / a;
+    float t2 = (-b + squareRoot) / a;
 
     float t = 0;
-    if (t1 < 0 && t2 < 0) {
+    if (t2 < 0) {
         return -1;
-    } else if (t1 > 0 && t2 > 0) {
-        t = min(t1, t2);
+    } else if (t1 > 0) {
+        t = t1;
         outside = true;
     } else {
-        t = max(t1, t2);
+        t = t2;
         outside = false;
     }
 
-    glm::vec3 objspaceIntersection = getPointOnRay(rt, t);
-
-    intersectionPoint = multiplyMV(sphere.transform, glm::vec4(objspaceIntersection, 1.f));
-    normal = glm::normalize(multiplyMV(sphere.invTranspose, glm::vec4(objspaceIntersection, 0.f)));
+    normal = q.origin + t * q.direction;
     if (!outside) {
         normal = -normal;
     }
-
-    return glm::length(r.origin - intersectionPoint);
+    return t;
 }
 
-
-
-__host__ __device__ float csg1SDF(glm::vec3 p)
+__host__ __device__ inline float csg1SDF(glm::vec3 p)
 {
     float x4 = p.x * p.x * p.x * p.x;
     float x2 = p.x * p.x;
@@ -156,43 +174,7 @@ __host__ __device__ float csg1SDF(glm::vec3 p)
     return x4 - 5 * x2 + y4 - 5 * y2 + z4 - 5 * z2 + 11.8;
 }
 
-__host__ __device__ float csg1Raytrace(glm::vec3 cam, glm::vec3 ray, float maxdist, bool &outside) 
-{
-    float BIGSTEPSIZE = 0.1;
-    float SMALLSTEPSIZE = 0.02;
-    float t = 0.0f;
-    float step = BIGSTEPSIZE;
-
-    for (int i = 0; i < 700; i++) {
-        glm::vec3 p = cam + ray * t;
-        float distance = csg1SDF(p);
-
-        if (distance < 0.001) {
-
-            //step back once, and increment slowly
-            t -= step;
-            step = SMALLSTEPSIZE;
-
-            for (int i = 0; i < 10; i++) 
-            {
-                p = cam + ray * t;
-                distance = csg1SDF(p);
-                if (distance < 0.001) {
-                    t -= step;
-                    p = cam + ray * t;
-                    // InitializeIntersection(isect, t, p);
-                    return t;
-                }
-                t += step;
-            }
-            return 0;
-        }
-        t += step;
-    }
-    return 0;
-}
-
-__host__ __device__ glm::vec3 getCsg1Normal(glm::vec3 p)
+__host__ __device__ inline glm::vec3 getCsg1Normal(glm::vec3 p)
 {
     return glm::normalize(glm::vec3(
         csg1SDF(glm::vec3(p.x + EPSILON, p.y, p.z)) - csg1SDF(glm::vec3(p.x - EPSILON, p.y, p.z)),
@@ -201,28 +183,7 @@ __host__ __device__ glm::vec3 getCsg1Normal(glm::vec3 p)
     ));
 }
 
-__host__ __device__ float csg1IntersectionTest(Geom surface, Ray r,
-    glm::vec3 &intersectionPoint, glm::vec3 &normal, bool &outside)
-{
-    glm::vec3 pt = multiplyMV(surface.inverseTransform, glm::vec4(r.origin, 1.0f));
-    glm::vec3 dir = multiplyMV(surface.inverseTransform, glm::vec4(r.direction, 0.0f));
-
-    // raytrace to get t value
-    float t = csg1Raytrace(pt, dir, 100.f, outside);
-
-    // calculate point on surface using ray and t value
-    glm::vec3 objPt = pt + t * dir;
-    intersectionPoint = multiplyMV(surface.transform, glm::vec4(objPt, 1.0f));
-
-    // calculate normal using gradient
-    normal = glm::normalize(multiplyMV(surface.invTranspose, glm::vec4(getCsg1Normal(objPt), 0.0f)));
-    if (!outside) normal = -normal;
-    return t;
-}
-
-
-
-__host__ __device__ float csg2SDF(glm::vec3 p)
+__host__ __device__ inline float csg2SDF(glm::vec3 p)
 {    
     float k = 5.0;
     float a = 0.95;
@@ -234,43 +195,7 @@ __host__ __device__ float csg2SDF(glm::vec3 p)
     return (x2 + y2 + z2 - a*k*k) *  (x2 + y2 + z2 - a*k*k) - b * ((p.z - k)*(p.z - k) - 2*p.x*p.x) * ((p.z + k)*(p.z + k) - 2 *p.y*p.y);
 }
 
-__host__ __device__ float csg2Raytrace(glm::vec3 cam, glm::vec3 ray, float maxdist, bool &outside)
-{
-    float BIGSTEPSIZE = 0.1;
-    float SMALLSTEPSIZE = 0.02;
-    float t = 0.0f;
-    float step = BIGSTEPSIZE;
-
-    for (int i = 0; i < 700; i++) {
-        glm::vec3 p = cam + ray * t;
-        float distance = csg2SDF(p);
-
-        if (distance < 0.001) {
-
-            //step back once, and increment slowly
-            t -= step;
-            step = SMALLSTEPSIZE;
-
-            for (int i = 0; i < 10; i++)
-            {
-                p = cam + ray * t;
-                distance = csg2SDF(p);
-                if (distance < 0.001) {
-                    t -= step;
-                    p = cam + ray * t;
-                    // InitializeIntersection(isect, t, p);
-                    return t;
-                }
-                t += step;
-            }
-            return 0;
-        }
-        t += step;
-    }
-    return 0;
-}
-
-__host__ __device__ glm::vec3 getCsg2Normal(glm::vec3 p)
+__host__ __device__ inline glm::vec3 getCsg2Normal(glm::vec3 p)
 {
     return glm::normalize(glm::vec3(
         csg2SDF(glm::vec3(p.x + EPSILON, p.y, p.z)) - csg2SDF(glm::vec3(p.x - EPSILON, p.y, p.z)),
@@ -279,21 +204,384 @@ __host__ __device__ glm::vec3 getCsg2Normal(glm::vec3 p)
     ));
 }
 
-__host__ __device__ float csg2IntersectionTest(Geom surface, Ray r,
-    glm::vec3 &intersectionPoint, glm::vec3 &normal, bool &outside)
+/**
+ * Slab test between a ray and an axis-aligned box.
+ *
+ * @param invDir             Componentwise reciprocal of the ray direction.
+ * @param tMax               Boxes entered beyond this distance are ignored.
+ * @return                   Entry distance (0 if the origin is inside), -1 on a miss.
+ */
+__host__ __device__ inline float aabbIntersectionTest(glm::vec3 bboxMin, glm::vec3 bboxMax,
+    glm::vec3 origin, glm::vec3 invDir, float tMax)
+{
+    glm::vec3 t0 = (bboxMin - origin) * invDir;
+    glm::vec3 t1 = (bboxMax - origin) * invDir;
+    glm::vec3 tSmall = glm::min(t0, t1);
+    glm::vec3 tBig = glm::max(t0, t1);
+    float tNear = glm::max(glm::max(tSmall.x, tSmall.y), glm::max(tSmall.z, 0.0f));
+    // widen by the rounding error of the slab distances (Ize 2013) so hits
+    // on a box face, e.g. a mesh vertex, are never culled
+    float tFar = glm::min(glm::min(tBig.x, tBig.y), tBig.z) * 1.00000024f;
+    tFar = glm::min(tFar, tMax);
+    return tNear <= tFar ? tNear : -1.0f;
+}
+
+/**
+ * Reciprocal of a ray direction, with zero components nudged so the slab
+ * test never computes 0 * inf.
+ */
+__host__ __device__ inline glm::vec3 safeInverseDirection(glm::vec3 d)
+{
+    const float tiny = 1e-12f;
+    return glm::vec3(
+        1.0f / (fabsf(d.x) > tiny ? d.x : copysignf(tiny, d.x)),
+        1.0f / (fabsf(d.y) > tiny ? d.y : copysignf(tiny, d.y)),
+        1.0f / (fabsf(d.z) > tiny ? d.z : copysignf(tiny, d.z)));
+}
+
+/**
+ * Clips an object-space ray to the analytic bounds of an implicit surface:
+ * its origin-centered sphere and its box. Rays that miss either are rejected
+ * before the surface function is evaluated at all.
+ *
+ * @param tNear              Output param for where the ray enters both.
+ * @param tFar               Output param for where it leaves one of them, at most `tMax`.
+ * @return                   false if the ray misses the bounds before `tMax`.
+ */
+__host__ __device__ inline bool implicitBoundsInterval(glm::vec3 halfExtents, float radius,
+    Ray q, float tMax, float &tNear, float &tFar)
+{
+    // sphere first: it is the cheaper test and rejects most of what misses
+    float a = glm::dot(q.direction, q.direction);
+    float b = glm::dot(q.origin, q.direction);
+    float c = glm::dot(q.origin, q.origin) - radius * radius;
+    float radicand = b * b - a * c;
+    if (radicand < 0.0f) {
+        return false;
+    }
+    float squareRoot = sqrtf(radicand);
+    tNear = glm::max((-b - squareRoot) / a, 0.0f);
+    tFar = glm::min((-b + squareRoot) / a, tMax);
+    if (tNear > tFar) {
+        return false;
+    }
+
+    glm::vec3 invDir = safeInverseDirection(q.direction);
+    glm::vec3 t0 = (-halfExtents - q.origin) * invDir;
+    glm::vec3 t1 = (halfExtents - q.origin) * invDir;
+    glm::vec3 tSmall = glm::min(t0, t1);
+    glm::vec3 tBig = glm::max(t0, t1);
+    tNear = glm::max(glm::max(tSmall.x, tSmall.y), glm::max(tSmall.z, tNear));
+    tFar = glm::min(glm::min(tBig.x, tBig.y), glm::min(tBig.z, tFar));
+    return tNear <= tFar;
+}
+
+/**
+ * Sphere traces the zero set of an implicit surface f along an object-space
+ * ray. With |grad f| <= L inside the surface's bounds, |f(p)| / L is a lower
+ * bound on the distance from p to the surface, so stepping by it never skips
+ * over a hit. Marching starts where the ray enters the bounds and gives up
+ * where it leaves them or passes `tMax`. A hit is a sign change of f, so a
+ * ray leaving the surface it starts on cannot hit it again.
+ *
+ * @param tMax               Hits beyond this distance are ignored.
+ * @param outside            Output param for whether the ray came from outside.
+ * @param steps              Output param for the number of evaluations of f.
+ * @return                   Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ inline float implicitSphereTrace(GeomType type,
+    Ray q, float tMax, bool &outside, int &steps)
+{
+    steps = 0;
+    float tNear, tFar;
+    bool bounded = type == CSG1 ?
+        implicitBoundsInterval(CSG1_BOUND, CSG1_RADIUS, q, tMax, tNear, tFar) :
+        implicitBoundsInterval(CSG2_BOUND, CSG2_RADIUS, q, tMax, tNear, tFar);
+    if (!bounded) {
+        return -1;
+    }
+    float lipschitz = type == CSG1 ? CSG1_LIPSCHITZ : CSG2_LIPSCHITZ;
+
+    // scaled instances leave the object-space direction unnormalized, so
+    // convert distances to steps in t
+    float tPerUnit = 1.0f / glm::length(q.direction);
+
+    float t = tNear;
+    float tPrev = t;
+    float fPrev = 0.0f;
+    while (t <= tFar && steps < SPHERE_TRACE_MAX_STEPS) {
+        glm::vec3 p = q.origin + t * q.direction;
+        float f = type == CSG1 ? csg1SDF(p) : csg2SDF(p);
+
+        if (steps == 0) {
+            outside = f > 0.0f;
+        } else if ((f > 0.0f) != outside) {
+            // the surface lies between the last two samples
+            return tPrev + (t - tPrev) * fPrev / (fPrev - f);
+        }
+        steps++;
+
+        tPrev = t;
+        fPrev = f;
+        t += glm::max(fabsf(f) / lipschitz, SPHERE_TRACE_EPSILON) * tPerUnit;
+    }
+    return -1;
+}
+
+/**
+ * Test intersection between an object-space ray and the first implicit surface.
+ *
+ * @param tMax               Hits beyond this distance are ignored.
+ * @param normal             Output parameter for object-space surface normal.
+ * @param outside            Output param for whether the ray came from outside.
+ * @return                   Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ inline float csg1IntersectionTest(Ray q, float tMax,
+    glm::vec3 &normal, bool &outside)
 {
-    glm::vec3 pt = multiplyMV(surface.inverseTransform, glm::vec4(r.origin, 1.0f));
-    glm::vec3 dir = multiplyMV(surface.inverseTransform, glm::vec4(r.direction, 0.0f));
+    int steps;
+    float t = implicitSphereTrace(CSG1, q, tMax, outside, steps);
 
-    // raytrace to get t value
-    float t = csg2Raytrace(pt, dir, 100.f, outside);
+    // calculate normal using gradient at the point on the surface
+    if (t > 0.0f) {
+        normal = getCsg1Normal(q.origin + t * q.direction);
+        if (!outside) normal = -normal;
+    }
+    return t;
+}
 
-    // calculate point on surface using ray and t value
-    glm::vec3 objPt = pt + t * dir;
-    intersectionPoint = multiplyMV(surface.transform, glm::vec4(objPt, 1.0f));
+/**
+ * Test intersection between an object-space ray and the second implicit surface.
+ *
+ * @param tMax               Hits beyond this distance are ignored.
+ * @param normal             Output parameter for object-space surface normal.
+ * @param outside            Output param for whether the ray came from outside.
+ * @return                   Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ inline float csg2IntersectionTest(Ray q, float tMax,
+    glm::vec3 &normal, bool &outside)
+{
+    int steps;
+    float t = implicitSphereTrace(CSG2, q, tMax, outside, steps);
 
-    // calculate normal using gradient
-    normal = glm::normalize(multiplyMV(surface.invTranspose, glm::vec4(getCsg2Normal(objPt), 0.0f)));
-    if (!outside) normal = -normal;
+    // calculate normal using gradient at the point on the surface
+    if (t > 0.0f) {
+        normal = getCsg2Normal(q.origin + t * q.direction);
+        if (!outside) normal = -normal;
+    }
     return t;
-}
\ No newline at end of file
+}
+
+/**
+ * Per-ray constants of the watertight ray/triangle test (Woop, Benthin and
+ * Wald 2013): the axis the direction is largest along becomes z, and the
+ * shear maps the direction onto +z.
+ */
+struct WatertightRay {
+    int kx, ky, kz;
+    float sx, sy, sz;
+};
+
+__host__ __device__ inline WatertightRay makeWatertightRay(glm::vec3 d)
+{
+    WatertightRay w;
+    glm::vec3 a = glm::abs(d);
+    w.kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    w.kx = w.kz == 2 ? 0 : w.kz + 1;
+    w.ky = w.kx == 2 ? 0 : w.kx + 1;
+    // swap to keep the winding of the triangle when the ray points down z
+    if (d[w.kz] < 0.0f) {
+        int tmp = w.kx;
+        w.kx = w.ky;
+        w.ky = tmp;
+    }
+    w.sx = d[w.kx] / d[w.kz];
+    w.sy = d[w.ky] / d[w.kz];
+    w.sz = 1.0f / d[w.kz];
+    return w;
+}
+
+/**
+ * Watertight ray/triangle test: rays through a shared edge or vertex hit at
+ * least one of the triangles around it, so meshes never leak light.
+ *
+ * @param tMax               Hits beyond this distance are ignored.
+ * @return                   Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ inline float triangleIntersectionTest(const WatertightRay &w, Ray q,
+    glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, float tMax)
+{
+    glm::vec3 a = v0 - q.origin;
+    glm::vec3 b = v1 - q.origin;
+    glm::vec3 c = v2 - q.origin;
+
+    float ax = a[w.kx] - w.sx * a[w.kz];
+    float ay = a[w.ky] - w.sy * a[w.kz];
+    float bx = b[w.kx] - w.sx * b[w.kz];
+    float by = b[w.ky] - w.sy * b[w.kz];
+    float cx = c[w.kx] - w.sx * c[w.kz];
+    float cy = c[w.ky] - w.sy * c[w.kz];
+
+    // scaled barycentrics
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float e = bx * ay - by * ax;
+
+    // on an edge the float result is unreliable; redo it in double precision
+    if (u == 0.0f || v == 0.0f || e == 0.0f) {
+        u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+        v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+        e = (float)((double)bx * (double)ay - (double)by * (double)ax);
+    }
+
+    if ((u < 0.0f || v < 0.0f || e < 0.0f) && (u > 0.0f || v > 0.0f || e > 0.0f)) {
+        return -1;
+    }
+    float det = u + v + e;
+    if (det == 0.0f) {
+        return -1;
+    }
+
+    // scaled hit distance, compared without dividing first
+    float tScaled = w.sz * (u * a[w.kz] + v * b[w.kz] + e * c[w.kz]);
+    float detSign = det < 0.0f ? -1.0f : 1.0f;
+    if (tScaled * detSign <= 0.0f || tScaled * detSign > tMax * det * detSign) {
+        return -1;
+    }
+    return tScaled / det;
+}
+
+/**
+ * Intersects an object-space ray with a triangle mesh by walking its BVH.
+ * The normal is the geometric normal, facing the ray; the winding decides
+ * which side is outside.
+ *
+ * @param tMax               Hits beyond this distance are ignored.
+ * @param normal             Output parameter for object-space surface normal.
+ * @param outside            Output param for whether the ray came from outside.
+ * @return                   Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ inline float meshIntersectionTest(const SceneView &scene, const Blas &blas,
+    Ray q, float tMax, glm::vec3 &normal, bool &outside)
+{
+    const BVHNode *nodes = scene.blasNodes + blas.nodeOffset;
+    glm::vec3 invDir = safeInverseDirection(q.direction);
+    WatertightRay w = makeWatertightRay(q.direction);
+
+    int hitTri = -1;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    bool visit = aabbIntersectionTest(nodes[0].bboxMin, nodes[0].bboxMax, q.origin, invDir, tMax) >= 0.0f;
+
+    while (visit) {
+        const BVHNode &node = nodes[nodeIndex];
+
+        if (node.count > 0) {
+            for (int i = blas.triOffset + node.leftFirst; i < blas.triOffset + node.leftFirst + node.count; i++) {
+                int i0 = scene.triV0[i];
+                int i1 = scene.triV1[i];
+                int i2 = scene.triV2[i];
+                float t = triangleIntersectionTest(w, q,
+                    glm::vec3(scene.vertX[i0], scene.vertY[i0], scene.vertZ[i0]),
+                    glm::vec3(scene.vertX[i1], scene.vertY[i1], scene.vertZ[i1]),
+                    glm::vec3(scene.vertX[i2], scene.vertY[i2], scene.vertZ[i2]),
+                    tMax);
+                if (t > 0.0f) {
+                    tMax = t;
+                    hitTri = i;
+                }
+            }
+            nodeIndex = -1;
+        } else {
+            int left = nodeIndex + 1;
+            int right = node.leftFirst;
+            float tLeft = aabbIntersectionTest(nodes[left].bboxMin, nodes[left].bboxMax, q.origin, invDir, tMax);
+            float tRight = aabbIntersectionTest(nodes[right].bboxMin, nodes[right].bboxMax, q.origin, invDir, tMax);
+
+            if (tLeft >= 0.0f && tRight >= 0.0f) {
+                nodeIndex = tLeft <= tRight ? left : right;
+                stack[stackSize++] = tLeft <= tRight ? right : left;
+            } else if (tLeft >= 0.0f) {
+                nodeIndex = left;
+            } else if (tRight >= 0.0f) {
+                nodeIndex = right;
+            } else {
+                nodeIndex = -1;
+            }
+        }
+
+        if (nodeIndex < 0) {
+            if (stackSize == 0) {
+                break;
+            }
+            nodeIndex = stack[--stackSize];
+        }
+    }
+
+    if (hitTri < 0) {
+        return -1;
+    }
+
+    int i0 = scene.triV0[hitTri];
+    int i1 = scene.triV1[hitTri];
+    int i2 = scene.triV2[hitTri];
+    glm::vec3 v0(scene.vertX[i0], scene.vertY[i0], scene.vertZ[i0]);
+    glm::vec3 v1(scene.vertX[i1], scene.vertY[i1], scene.vertZ[i1]);
+    glm::vec3 v2(scene.vertX[i2], scene.vertY[i2], scene.vertZ[i2]);
+    normal = glm::cross(v1 - v0, v2 - v0);
+    outside = glm::dot(normal, q.direction) < 0.0f;
+    if (!outside) {
+        normal = -normal;
+    }
+    return tMax;
+}
+
+/**
+ * Intersects an object-space ray with a bottom-level structure.
+ *
+ * @param tMax               Mesh and implicit surface hits beyond this distance are ignored.
+ * @param normal             Output parameter for object-space surface normal.
+ * @return                   Ray parameter `t` value. <= 0 if no intersection.
+ */
+__host__ __device__ inline float blasIntersectionTest(const SceneView &scene, const Blas &blas,
+    Ray q, float tMax, glm::vec3 &normal, bool &outside)
+{
+    if (blas.type == CUBE)
+    {
+        return boxIntersectionTest(q, normal, outside);
+    }
+    else if (blas.type == SPHERE)
+    {
+        return sphereIntersectionTest(q, normal, outside);
+    }
+    else if (blas.type == CSG1)
+    {
+        return csg1IntersectionTest(q, tMax, normal, outside);
+    }
+    else if (blas.type == CSG2)
+    {
+        return csg2IntersectionTest(q, tMax, normal, outside);
+    }
+    else if (blas.type == TRIANGLE_MESH)
+    {
+        return meshIntersectionTest(scene, blas, q, tMax, normal, outside);
+    }
+    return -1;
+}
+
+/**
+ * Intersects a world-space ray with one instance: the ray is moved into the
+ * instance's object space and tested against its shared BLAS.
+ *
+ * @param instance           Index into the packed instance arrays of `scene`.
+ * @param tMax               Mesh hits beyond this distance are ignored.
+ * @param normal             Output parameter for object-space surface normal.
+ * @return                   Ray parameter `t` value. <= 0 if no intersection.
+ */
+__host__ __device__ inline float instanceIntersectionTest(const SceneView &scene,
+    int instance, Ray r, float tMax, glm::vec3 &normal, bool &outside)
+{
+    Ray q = transformRay(scene.instRow0[instance], scene.instRow1[instance], scene.instRow2[instance], r);
+    return blasIntersectionTest(scene, scene.blases[scene.instBlasId[instance]], q, tMax, normal, outside);
+}
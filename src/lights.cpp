@@ -0,0 +1,92 @@
+#include <cstdio>
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include "lights.h"
+
+// Samples of the sphere used to integrate the area of a transformed sphere
+#define SPHERE_AREA_SAMPLES 256
+
+/**
+ * World area of a light's shape: the object-space area scaled by the
+ * transform's area scaling, jacobian * |normalMatrix * n|, integrated over
+ * the surface. Exact for cubes; spheres average a Fibonacci lattice.
+ */
+static float worldArea(const Light &light) {
+    if (light.type == CUBE) {
+        float area = 0.0f;
+        for (int axis = 0; axis < 3; axis++) {
+            glm::vec3 n(0.0f);
+            n[axis] = 1.0f;
+            area += 2.0f * light.jacobian * glm::length(light.normalMatrix * n);
+        }
+        return area;
+    }
+
+    float sum = 0.0f;
+    for (int i = 0; i < SPHERE_AREA_SAMPLES; i++) {
+        float z = 1.0f - (2.0f * i + 1.0f) / SPHERE_AREA_SAMPLES;
+        float r = sqrtf(1.0f - z * z);
+        float phi = i * 2.39996323f;    // golden angle
+        glm::vec3 n(r * cosf(phi), r * sinf(phi), z);
+        sum += light.jacobian * glm::length(light.normalMatrix * n);
+    }
+    return PI * sum / SPHERE_AREA_SAMPLES;
+}
+
+void lights::build(const std::vector<Instance> &instances, const std::vector<Blas> &blases,
+        const std::vector<Material> &materials,
+        std::vector<Light> &lights, std::vector<int> &instLightId) {
+    lights.clear();
+    instLightId.assign(instances.size(), -1);
+
+    std::vector<float> power;
+    int skipped = 0;
+    for (int i = 0; i < (int)instances.size(); i++) {
+        const Material &material = materials[instances[i].materialid];
+        if (material.emittance <= 0.0f) {
+            continue;
+        }
+        GeomType type = blases[instances[i].blasId].type;
+        if (type != SPHERE && type != CUBE) {
+            skipped++;
+            continue;
+        }
+
+        glm::mat4 objectToWorld = glm::inverse(glm::mat4(instances[i].worldToObject));
+        glm::mat3 linear(objectToWorld);
+
+        Light light;
+        light.objectToWorld = glm::mat4x3(objectToWorld);
+        light.normalMatrix = glm::inverseTranspose(linear);
+        light.jacobian = fabsf(glm::determinant(linear));
+        light.emission = material.color * material.emittance;
+        light.type = type;
+        light.instanceId = i;
+
+        float luminance = glm::dot(light.emission, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+        float p = luminance * worldArea(light);
+        if (p <= 0.0f) {
+            continue;
+        }
+        instLightId[i] = lights.size();
+        lights.push_back(light);
+        power.push_back(p);
+    }
+
+    float total = 0.0f;
+    for (size_t i = 0; i < power.size(); i++) {
+        total += power[i];
+    }
+    float cdf = 0.0f;
+    for (size_t i = 0; i < lights.size(); i++) {
+        lights[i].pickPdf = power[i] / total;
+        cdf += lights[i].pickPdf;
+        lights[i].pickCdf = i + 1 == lights.size() ? 1.0f : cdf;
+    }
+
+    printf("Lights: %d sampled", (int)lights.size());
+    if (skipped > 0) {
+        printf(", %d emissive meshes or implicit surfaces left to BSDF sampling", skipped);
+    }
+    printf("\n");
+}
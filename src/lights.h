@@ -0,0 +1,118 @@
+#pragma once
+
+#include <vector>
+#include <thrust/random.h>
+
+#include "sceneStructs.h"
+#include "philox.h"
+#include "utilities.h"
+
+/**
+ * Light list for next-event estimation. Every sphere and cube instance whose
+ * material emits becomes a Light; other emissive shapes are only found by
+ * BSDF sampling, which then counts them with full weight. A light is picked
+ * in proportion to its power, then a point is picked uniformly over the
+ * object-space surface and carried to the world by the instance transform.
+ * The world area pdf divides by the transform's area scaling at that point,
+ * so non-uniformly scaled spheres and cubes are sampled exactly.
+ */
+namespace lights {
+    // Builds the list from instances in TLAS leaf order. `instLightId` gets
+    // one entry per instance.
+    extern void build(const std::vector<Instance> &instances, const std::vector<Blas> &blases,
+        const std::vector<Material> &materials,
+        std::vector<Light> &lights, std::vector<int> &instLightId);
+}
+
+/**
+ * Object-space area pdf of a uniform point on a light's shape: the sphere
+ * of radius 0.5 has area PI, the unit cube 6.
+ */
+__host__ __device__
+inline float lightShapePdf(GeomType type) {
+    return type == SPHERE ? 1.0f / PI : 1.0f / 6.0f;
+}
+
+/**
+ * Uniform object-space point and outward normal on a light's shape.
+ */
+__host__ __device__
+inline void sampleLightShape(GeomType type, float u0, float u1, float u2,
+        glm::vec3 &point, glm::vec3 &normal) {
+    if (type == SPHERE) {
+        float z = 1.0f - 2.0f * u0;
+        float r = sqrtf(glm::max(0.0f, 1.0f - z * z));
+        float phi = TWO_PI * u1;
+        normal = glm::vec3(r * cosf(phi), r * sinf(phi), z);
+        point = 0.5f * normal;
+    } else {
+        // pick one of the six faces, then a point on it
+        int face = glm::min((int)(u0 * 6.0f), 5);
+        int axis = face >> 1;
+        float side = (face & 1) ? 0.5f : -0.5f;
+        normal = glm::vec3(0.0f);
+        normal[axis] = side * 2.0f;
+        point[axis] = side;
+        point[(axis + 1) % 3] = u1 - 0.5f;
+        point[(axis + 2) % 3] = u2 - 0.5f;
+    }
+}
+
+/**
+ * World area pdf with which sampleLight() returns a point on `light` whose
+ * object-space normal is `objectNormal` (any length).
+ */
+__host__ __device__
+inline float lightAreaPdf(const Light &light, glm::vec3 objectNormal) {
+    glm::vec3 n = glm::normalize(objectNormal);
+    return light.pickPdf * lightShapePdf(light.type) / (light.jacobian * glm::length(light.normalMatrix * n));
+}
+
+/**
+ * Picks a light and a point on it.
+ *
+ * @param point              Output world position of the point.
+ * @param normal             Output world unit normal, facing out of the light.
+ * @param light              Output index into lights.lights.
+ * @return                   World area pdf of the point.
+ */
+__host__ __device__
+inline float sampleLight(const LightView &lights, PhiloxEngine &rng,
+        glm::vec3 &point, glm::vec3 &normal, int &light) {
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    float u = u01(rng);
+
+    // first light whose cumulative probability exceeds u
+    int lo = 0;
+    int hi = lights.numLights - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (lights.lights[mid].pickCdf > u) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    light = lo;
+    const Light &l = lights.lights[lo];
+
+    glm::vec3 p, n;
+    float u0 = u01(rng);
+    float u1 = u01(rng);
+    float u2 = u01(rng);
+    sampleLightShape(l.type, u0, u1, u2, p, n);
+    point = l.objectToWorld * glm::vec4(p, 1.0f);
+    normal = glm::normalize(l.normalMatrix * n);
+    return lightAreaPdf(l, n);
+}
+
+/**
+ * Power heuristic (beta = 2) weight of a sample drawn with pdf `a` when
+ * another strategy could have drawn it with pdf `b`.
+ */
+__host__ __device__
+inline float powerHeuristic(float a, float b) {
+    float a2 = a * a;
+    float b2 = b * b;
+    return a2 + b2 > 0.0f ? a2 / (a2 + b2) : 0.0f;
+}
@@ -1,8 +1,24 @@
 #include "main.h"
 #include "preview.h"
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 
 static std::string startTimeString;
+static std::string profileFile;
+// split rendering: this process renders piece splitIndex of splitCount and
+// saves the raw sum to accumulationFile instead of an image
+static std::string accumulationFile;
+static int splitIndex = 0;
+static int splitCount = 1;
+// checkpoints: written to checkpointFile every checkpointInterval seconds;
+// --resume loads resumeFrom and applies it once the pathtracer is set up
+static std::string checkpointFile;
+static double checkpointInterval = 60.0;
+static bool resume = false;
+static bool resumePending = false;
+static accumulation::Checkpoint resumeFrom;
+static std::chrono::steady_clock::time_point lastCheckpoint;
 
 // For camera controls
 static bool leftMousePressed = false;
@@ -12,6 +28,8 @@ static double lastX;
 static double lastY;
 
 static bool camchanged = true;
+// set once pathtraceInit() has uploaded the scene; camera moves keep it
+static bool sceneOnDevice = false;
 static float dtheta = 0, dphi = 0;
 static glm::vec3 cammove;
 
@@ -30,18 +48,209 @@ int height;
 //-------------MAIN--------------
 //-------------------------------
 
+// True if `arg` ("name" or "name=value") names a render option
+static bool isRenderOption(const std::string &arg) {
+    return renderOptions::exists(arg.substr(0, arg.find('=')));
+}
+
+// Writes the profiler's buffer on every way out of the program
+static void exportProfile() {
+    if (profiler::exportChromeTrace(profileFile)) {
+        printf("Wrote profile to %s\n", profileFile.c_str());
+    } else {
+        printf("Could not write profile to %s\n", profileFile.c_str());
+    }
+}
+
+// Render options as a checkpoint records them: the ones that change the
+// image. Compaction, sorting and the timing printouts only change speed,
+// temporal reprojection and preview frames only the window, and denoising
+// only the images saved from the accumulated one.
+static std::string imageOptions() {
+    RenderOptions options = renderState->options;
+    options.compact = false;
+    options.sorting = false;
+    options.sortDirection = false;
+    options.temporal = false;
+    options.preview = 1;
+    options.denoise = 0;
+    options.timing = false;
+    options.sortTiming = false;
+    return renderOptions::toString(options);
+}
+
+/**
+ * Reads the --resume checkpoint, if there is one yet, and points the camera
+ * where it was. Returns false if it belongs to another render.
+ */
+static bool loadResumeCheckpoint() {
+    FILE *fp = fopen(checkpointFile.c_str(), "rb");
+    if (!fp) {
+        printf("No checkpoint at %s yet, starting from the first iteration\n", checkpointFile.c_str());
+        return true;
+    }
+    fclose(fp);
+    if (!accumulation::loadCheckpoint(checkpointFile, resumeFrom)) {
+        return false;
+    }
+
+    int first, last;
+    accumulation::splitRange(renderState->iterations, splitIndex, splitCount, first, last);
+    const accumulation::Buffer &buffer = resumeFrom.buffer;
+    if (buffer.width != width || buffer.height != height
+            || buffer.firstIteration != first || buffer.lastIteration > last) {
+        printf("%s holds a %dx%d render of iterations %d-%d, not of %d-%d at %dx%d\n", checkpointFile.c_str(),
+            buffer.width, buffer.height, buffer.firstIteration, buffer.lastIteration, first, last, width, height);
+        return false;
+    }
+    if (resumeFrom.options != imageOptions()) {
+        printf("%s was rendered with %s, not %s\n", checkpointFile.c_str(), resumeFrom.options.c_str(),
+            imageOptions().c_str());
+        return false;
+    }
+
+    phi = resumeFrom.orbit.x;
+    theta = resumeFrom.orbit.y;
+    zoom = resumeFrom.orbit.z;
+    renderState->camera.lookAt = resumeFrom.lookAt;
+    resumePending = true;
+    return true;
+}
+
+// Hands a loaded --resume checkpoint to the pathtracer. Call right after
+// pathtraceInit().
+static void applyResumeCheckpoint() {
+    if (!resumePending) {
+        return;
+    }
+    pathtraceRestore(resumeFrom.buffer.sum, resumeFrom.variance);
+    iteration = resumeFrom.buffer.lastIteration;
+    printf("Resumed from %s after iteration %d\n", checkpointFile.c_str(), iteration);
+    resumePending = false;
+    resumeFrom = accumulation::Checkpoint();
+}
+
+// Saves the image so far if a checkpoint is due, or always with `force`.
+// `first` is the first iteration of this render.
+static void writeCheckpoint(int first, bool force) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> sinceLast = now - lastCheckpoint;
+    if (checkpointFile.empty() || (!force && sinceLast.count() < checkpointInterval)) {
+        return;
+    }
+    lastCheckpoint = now;
+
+    accumulation::Checkpoint checkpoint;
+    checkpoint.buffer.width = width;
+    checkpoint.buffer.height = height;
+    checkpoint.buffer.firstIteration = first;
+    checkpoint.buffer.lastIteration = iteration;
+    pathtraceReadImage();
+    checkpoint.buffer.sum = renderState->image;
+    checkpoint.options = imageOptions();
+    checkpoint.orbit = glm::vec3(phi, theta, zoom);
+    checkpoint.lookAt = renderState->camera.lookAt;
+    pathtraceGetVariance(checkpoint.variance);
+    if (!accumulation::saveCheckpoint(checkpointFile, checkpoint)) {
+        printf("Could not write checkpoint %s\n", checkpointFile.c_str());
+    }
+}
+
 int main(int argc, char** argv) {
     startTimeString = currentTimeString();
 
-    if (argc < 2) {
-        printf("Usage: %s SCENEFILE.txt\n", argv[0]);
+    const char *sceneFile = NULL;
+    RenderBackend backend = BACKEND_CUDA;
+    int numThreads = 0;
+    bool headless = false;
+    // --name[=value] render options, applied over the scene file's OPTION lines
+    std::vector<std::pair<std::string, std::string> > optionOverrides;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu") == 0) {
+            backend = BACKEND_CPU;
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            numThreads = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profileFile = argv[i] + 10;
+        } else if (strncmp(argv[i], "--accumulation=", 15) == 0) {
+            accumulationFile = argv[i] + 15;
+        } else if (strncmp(argv[i], "--checkpoint=", 13) == 0) {
+            checkpointFile = argv[i] + 13;
+        } else if (strncmp(argv[i], "--checkpoint-interval=", 22) == 0) {
+            checkpointInterval = atof(argv[i] + 22);
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            resume = true;
+        } else if (strncmp(argv[i], "--split=", 8) == 0) {
+            if (sscanf(argv[i] + 8, "%d/%d", &splitIndex, &splitCount) != 2
+                    || splitIndex < 0 || splitIndex >= splitCount) {
+                printf("Bad value for --split: %s\n", argv[i] + 8);
+                return 1;
+            }
+        } else if (argv[i][0] != '-' && !sceneFile) {
+            sceneFile = argv[i];
+        } else if (strncmp(argv[i], "--", 2) == 0 && isRenderOption(argv[i] + 2)) {
+            std::string arg = argv[i] + 2;
+            size_t eq = arg.find('=');
+            optionOverrides.push_back(eq == std::string::npos ?
+                std::make_pair(arg, std::string("1")) :
+                std::make_pair(arg.substr(0, eq), arg.substr(eq + 1)));
+        } else {
+            printf("Unknown argument: %s\n", argv[i]);
+            sceneFile = NULL;
+            break;
+        }
+    }
+
+    if (!sceneFile) {
+        printf("Usage: %s [--cpu] [--threads=N] [--headless] [--profile=TRACE.json] [--OPTION[=0|1] ...] SCENEFILE.txt\n", argv[0]);
+        printf("       %s --headless [--split=K/N] --accumulation=FILE.acc ... SCENEFILE.txt\n", argv[0]);
+        printf("Checkpoints: --checkpoint=FILE.ckpt [--checkpoint-interval=SECONDS] [--resume]\n");
+        printf("Options: --compact --sorting --sortdirection --caching --nee --roulette --adaptive[=ERROR] --sampler=random|stratified|sobol|bluenoise --temporal --preview[=STRIDE] --denoise[=LEVELS] --timing --sorttiming\n");
         return 1;
     }
 
-    const char *sceneFile = argv[1];
+    pathtraceSetBackend(backend, numThreads);
 
     // Load scene file
+    using time_point_t = std::chrono::high_resolution_clock::time_point;
+    time_point_t loadStart = std::chrono::high_resolution_clock::now();
     scene = new Scene(sceneFile);
+    std::chrono::duration<double, std::milli> loadTime = std::chrono::high_resolution_clock::now() - loadStart;
+    printf("Cold start: scene loaded in %.2f ms\n", loadTime.count());
+
+    for (size_t i = 0; i < optionOverrides.size(); i++) {
+        if (!renderOptions::set(scene->state.options,
+                optionOverrides[i].first, optionOverrides[i].second)) {
+            printf("Bad value for --%s: %s\n", optionOverrides[i].first.c_str(), optionOverrides[i].second.c_str());
+            return 1;
+        }
+    }
+    printf("Render options: %s\n", renderOptions::toString(scene->state.options).c_str());
+
+    if ((splitCount > 1 || !accumulationFile.empty()) && !headless) {
+        printf("--split and --accumulation need --headless\n");
+        return 1;
+    }
+    if (splitCount > 1 && accumulationFile.empty()) {
+        printf("--split needs --accumulation=FILE.acc to save its piece\n");
+        return 1;
+    }
+    if (splitCount > 1 && scene->state.options.adaptive > 0.0f) {
+        // each piece would stop on its own samples' variance
+        printf("Adaptive sampling cannot be split\n");
+        return 1;
+    }
+    if (resume && checkpointFile.empty()) {
+        printf("--resume needs --checkpoint=FILE.ckpt\n");
+        return 1;
+    }
+
+    if (!profileFile.empty()) {
+        profiler::enable();
+        atexit(exportProfile);
+    }
 
     // Set up camera stuff from loaded path tracer settings
     iteration = 0;
@@ -66,6 +275,15 @@ int main(int argc, char** argv) {
     ogLookAt = cam.lookAt;
     zoom = glm::length(cam.position - ogLookAt);
 
+    if (resume && !loadResumeCheckpoint()) {
+        return 1;
+    }
+    lastCheckpoint = std::chrono::steady_clock::now();
+
+    if (headless) {
+        return runHeadless();
+    }
+
     // Initialize CUDA and GL components
     init();
 
@@ -75,73 +293,184 @@ int main(int argc, char** argv) {
     return 0;
 }
 
-void saveImage() {
-    float samples = iteration;
+// Writes `pixels`, divided by `samples`, as `filename`.png and, with
+// `saveHdr`, `filename`.hdr.
+static void writeImage(const std::vector<glm::vec3> &pixels, float samples, const std::string &filename,
+        bool saveHdr) {
     // output image file
     image img(width, height);
 
     for (int x = 0; x < width; x++) {
         for (int y = 0; y < height; y++) {
             int index = x + (y * width);
-            glm::vec3 pix = renderState->image[index];
+            glm::vec3 pix = pixels[index];
             img.setPixel(width - 1 - x, y, glm::vec3(pix) / samples);
         }
     }
 
+    // CHECKITOUT
+    img.savePNG(filename);
+    if (saveHdr) {
+        img.saveHDR(filename);  // Save a Radiance HDR file
+    }
+}
+
+// Saves the image so far and, with the denoise option, a denoised copy of it
+// next to it with ".denoised" added to its name.
+void saveImage(bool saveHdr) {
+    pathtraceReadImage();
+    float samples = iteration;
+
     std::string filename = renderState->imageName;
     std::ostringstream ss;
     ss << filename << "." << startTimeString << "." << samples << "samp";
     filename = ss.str();
+    writeImage(renderState->image, samples, filename, saveHdr);
 
-    // CHECKITOUT
-    img.savePNG(filename);
-    //img.saveHDR(filename);  // Save a Radiance HDR file
+    std::vector<glm::vec3> denoised;
+    if (pathtraceDenoise(denoised)) {
+        writeImage(denoised, 1.0f, filename + ".denoised", saveHdr);
+    }
+}
+
+void updateCamera() {
+    Camera &cam = renderState->camera;
+    cameraPosition.x = zoom * sin(phi) * sin(theta);
+    cameraPosition.y = zoom * cos(theta);
+    cameraPosition.z = zoom * cos(phi) * sin(theta);
+
+    cam.view = -glm::normalize(cameraPosition);
+    glm::vec3 v = cam.view;
+    glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
+    glm::vec3 r = glm::cross(v, u);
+    cam.up = glm::cross(r, v);
+    cam.right = r;
+
+    cam.position = cameraPosition;
+    cameraPosition += cam.lookAt;
+    cam.position = cameraPosition;
+}
+
+int runHeadless() {
+    updateCamera();
+    pathtraceInit(scene);
+
+    using time_point_t = std::chrono::high_resolution_clock::time_point;
+    time_point_t startTime = std::chrono::high_resolution_clock::now();
+
+    // no window and no PBO: every iteration only accumulates into the image.
+    // Adaptive sampling may finish before ITERATIONS. A split render covers
+    // only its own piece of the iterations.
+    int first, last;
+    accumulation::splitRange(renderState->iterations, splitIndex, splitCount, first, last);
+    iteration = first - 1;
+    applyResumeCheckpoint();
+    const int resumedAt = iteration;
+    for (iteration++; iteration <= last; iteration++) {
+        pathtrace(NULL, 0, iteration);
+        writeCheckpoint(first, false);
+        if (pathtraceConverged()) {
+            printf("Adaptive sampling converged after %d iterations\n", iteration);
+            break;
+        }
+    }
+    iteration = std::min(iteration, last);
+    int rendered = iteration - resumedAt;
+    // also waits for the device, so the time below covers every iteration
+    pathtraceReadImage();
+    writeCheckpoint(first, true);
+
+    time_point_t endTime = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = endTime - startTime;
+    double samples = (double)width * height * rendered;
+    printf("Rendered %d iterations in %.3f s (%.2f Msamples/s, %.2f iterations/s)\n",
+        rendered, elapsed.count(), samples / elapsed.count() / 1e6, rendered / elapsed.count());
+
+    int status = 0;
+    if (accumulationFile.empty()) {
+        saveImage(true);
+    } else {
+        accumulation::Buffer buffer;
+        buffer.width = width;
+        buffer.height = height;
+        buffer.firstIteration = first;
+        buffer.lastIteration = iteration;
+        buffer.sum = renderState->image;
+        if (accumulation::save(accumulationFile, buffer)) {
+            printf("Saved iterations %d-%d to %s\n", first, iteration, accumulationFile.c_str());
+        } else {
+            printf("Could not write %s\n", accumulationFile.c_str());
+            status = 1;
+        }
+    }
+    pathtraceFree();
+    if (pathtraceGetBackend() == BACKEND_CUDA) {
+        cudaDeviceReset();
+    }
+    return status;
+}
+
+// Maps the PBO for the active backend to write a frame into. The CPU backend
+// writes it through a host mapping.
+static uchar4 *mapPBO() {
+    uchar4 *pbo_dptr = NULL;
+    if (pathtraceGetBackend() == BACKEND_CPU) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        pbo_dptr = (uchar4 *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    } else {
+        cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
+    }
+    return pbo_dptr;
+}
+
+static void unmapPBO() {
+    if (pathtraceGetBackend() == BACKEND_CPU) {
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    } else {
+        cudaGLUnmapBufferObject(pbo);
+    }
 }
 
 void runCuda() {
+    const bool moving = camchanged;
     if (camchanged) {
         iteration = 0;
-        Camera &cam = renderState->camera;
-        cameraPosition.x = zoom * sin(phi) * sin(theta);
-        cameraPosition.y = zoom * cos(theta);
-        cameraPosition.z = zoom * cos(phi) * sin(theta);
-
-        cam.view = -glm::normalize(cameraPosition);
-        glm::vec3 v = cam.view;
-        glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
-        glm::vec3 r = glm::cross(v, u);
-        cam.up = glm::cross(r, v);
-        cam.right = r;
-
-        cam.position = cameraPosition;
-        cameraPosition += cam.lookAt;
-        cam.position = cameraPosition;
+        updateCamera();
         camchanged = false;
+        if (sceneOnDevice) {
+            // only the camera moved: keep the scene, drop the samples
+            pathtraceResetImage();
+        }
       }
 
     // Map OpenGL buffer object for writing from CUDA on a single GPU
     // No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this buffer
 
-    if (iteration == 0) {
-        pathtraceFree();
+    if (!sceneOnDevice) {
         pathtraceInit(scene);
+        applyResumeCheckpoint();
+        sceneOnDevice = true;
     }
 
-    if (iteration < renderState->iterations) {
-        uchar4 *pbo_dptr = NULL;
+    if (moving && renderState->options.preview > 1) {
+        // a coarse frame while the camera moves; the full-resolution image
+        // starts from its first iteration on the first frame it holds still
+        pathtracePreview(mapPBO(), renderState->options.preview);
+        unmapPBO();
+    } else if (iteration < renderState->iterations && !(iteration > 0 && pathtraceConverged())) {
         iteration++;
-        cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
-
-        // execute the kernel
         int frame = 0;
-        pathtrace(pbo_dptr, frame, iteration);
 
-        // unmap buffer object
-        cudaGLUnmapBufferObject(pbo);
+        // execute the kernel
+        pathtrace(mapPBO(), frame, iteration);
+        unmapPBO();
+        writeCheckpoint(1, false);
     } else {
         saveImage();
         pathtraceFree();
-        cudaDeviceReset();
+        if (pathtraceGetBackend() == BACKEND_CUDA) {
+            cudaDeviceReset();
+        }
         exit(EXIT_SUCCESS);
     }
 }
@@ -19,6 +19,9 @@
 #include "pathtrace.h"
 #include "utilities.h"
 #include "scene.h"
+#include "renderOptions.h"
+#include "profiler.h"
+#include "accumulation.h"
 
 using namespace std;
 
@@ -32,6 +35,8 @@ extern int iteration;
 extern int width;
 extern int height;
 
+void saveImage(bool saveHdr = false);
+int runHeadless();
 void runCuda();
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos);
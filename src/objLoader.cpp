@@ -0,0 +1,54 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include "objLoader.h"
+#include "utilities.h"
+
+// Resolves a one-based or negative OBJ index against the vertices read so far
+static int resolveIndex(const std::string &token, int numPositions) {
+    int index = atoi(token.c_str());  // stops at the first '/'
+    return index < 0 ? numPositions + index : index - 1;
+}
+
+bool loadOBJ(const std::string &filename,
+        std::vector<glm::vec3> &positions, std::vector<glm::ivec3> &triangles) {
+    std::ifstream fp_in(filename.c_str());
+    if (!fp_in.is_open()) {
+        return false;
+    }
+
+    positions.clear();
+    triangles.clear();
+
+    std::string line;
+    std::vector<int> face;
+    while (fp_in.good()) {
+        utilityCore::safeGetline(fp_in, line);
+        if (line.size() < 2) {
+            continue;
+        }
+
+        if (line[0] == 'v' && line[1] == ' ') {
+            glm::vec3 p;
+            if (sscanf(line.c_str() + 2, "%f %f %f", &p.x, &p.y, &p.z) == 3) {
+                positions.push_back(p);
+            }
+        } else if (line[0] == 'f' && line[1] == ' ') {
+            std::vector<std::string> tokens = utilityCore::tokenizeString(line);
+            face.clear();
+            for (size_t i = 1; i < tokens.size(); i++) {
+                int index = resolveIndex(tokens[i], positions.size());
+                if (index < 0 || index >= (int)positions.size()) {
+                    face.clear();
+                    break;
+                }
+                face.push_back(index);
+            }
+            for (size_t i = 2; i < face.size(); i++) {
+                triangles.push_back(glm::ivec3(face[0], face[i - 1], face[i]));
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+
+/**
+ * Minimal Wavefront OBJ reader: vertex positions and faces only. Faces may
+ * use any of the v, v/vt, v//vn and v/vt/vn forms and negative (relative)
+ * indices; polygons are fan-triangulated. Everything else is ignored.
+ *
+ * @param triangles          Output zero-based vertex indices, one ivec3 per triangle.
+ * @return                   false if the file cannot be opened.
+ */
+bool loadOBJ(const std::string &filename,
+    std::vector<glm::vec3> &positions, std::vector<glm::ivec3> &triangles);
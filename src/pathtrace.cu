@@ -4,7 +4,10 @@
 #include <thrust/execution_policy.h>
 #include <thrust/random.h>
 #include <thrust/remove.h>
+#include <thrust/count.h>
+#include <thrust/sort.h>
 #include <chrono>
+#include <utility>
 
 #include "sceneStructs.h"
 #include "scene.h"
@@ -12,8 +15,10 @@
 #include "glm/gtx/norm.hpp"
 #include "utilities.h"
 #include "pathtrace.h"
-#include "intersections.h"
-#include "interactions.h"
+#include "pathtraceCpu.h"
+#include "pathtraceStages.h"
+#include "profiler.h"
+#include "sampler.h"
 
 #define ERRORCHECK 1
 
@@ -39,86 +44,411 @@ void checkCUDAErrorFn(const char *msg, const char *file, int line) {
 #endif
 }
 
-__host__ __device__
-thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int depth) {
-    int h = utilhash((1 << 31) | (depth << 22) | iter) ^ utilhash(index);
-    return thrust::default_random_engine(h);
-}
-
 //Kernel that writes the image to the OpenGL PBO directly.
+// With temporal reprojection (`history` not NULL) blends in each pixel's history.
 __global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 resolution,
-    int iter, glm::vec3* image) {
+    int iter, glm::vec3* image, glm::vec4* history) {
     int x = (blockIdx.x * blockDim.x) + threadIdx.x;
     int y = (blockIdx.y * blockDim.y) + threadIdx.y;
 
     if (x < resolution.x && y < resolution.y) {
         int index = x + (y * resolution.x);
-        glm::vec3 pix = image[index];
-
-        glm::ivec3 color;
-        color.x = glm::clamp((int)(pix.x / iter * 255.0), 0, 255);
-        color.y = glm::clamp((int)(pix.y / iter * 255.0), 0, 255);
-        color.z = glm::clamp((int)(pix.z / iter * 255.0), 0, 255);
-
-        // Each thread writes one pixel location in the texture (textel)
-        pbo[index].w = 0;
-        pbo[index].x = color.x;
-        pbo[index].y = color.y;
-        pbo[index].z = color.z;
+        glm::vec4 h = history ? history[index] : glm::vec4(0.0f);
+        writePBOPixel(pbo, index, image[index] + glm::vec3(h) * h.w, iter + h.w);
     }
 }
 
+static RenderBackend backend = BACKEND_CUDA;
+static int cpuThreads = 0;
+static PathtraceStats * hst_stats = NULL;
+
 static Scene * hst_scene = NULL;
 static glm::vec3 * dev_image = NULL;
-static Geom * dev_geoms = NULL;
+// whether hst_scene->state.image holds dev_image's current contents
+static bool imageOnHost = true;
+static glm::vec4 * dev_instRow0 = NULL;
+static glm::vec4 * dev_instRow1 = NULL;
+static glm::vec4 * dev_instRow2 = NULL;
+static int * dev_instBlasId = NULL;
+static int * dev_instMaterialId = NULL;
+static glm::mat3 * dev_instNormalMatrix = NULL;
+static Blas * dev_blases = NULL;
+static BVHNode * dev_tlasNodes = NULL;
+static BVHNode * dev_blasNodes = NULL;
+static int * dev_triV0 = NULL;
+static int * dev_triV1 = NULL;
+static int * dev_triV2 = NULL;
+static float * dev_vertX = NULL;
+static float * dev_vertY = NULL;
+static float * dev_vertZ = NULL;
 static Material * dev_materials = NULL;
+static Light * dev_lights = NULL;
+static int * dev_instLightId = NULL;
+// blue-noise sampler only; NULL otherwise
+static glm::vec2 * dev_blueNoise = NULL;
 static PathSegment * dev_paths = NULL;
 static ShadeableIntersection * dev_intersections = NULL;
+// adaptive sampling only; NULL when it is off
+static PixelVariance * dev_pixelVariance = NULL;
+static int samplingPixels = 0;
 // TODO: static variables for device memory, any extra info you need, etc
 // ...
 // TODO: Part 1 - Caching first bounce intersections
 static ShadeableIntersection * dev_first_intersections = NULL;
+// set once an iteration has filled dev_first_intersections; a split render
+// starts past iteration 1
+static bool firstBounceCached = false;
+// material sorting only; NULL when it is off. Each path's sort key and index,
+// and the buffers the paths and intersections are gathered into in key
+// order, which then swap places with dev_paths and dev_intersections.
+static unsigned int * dev_sortKeys = NULL;
+static int * dev_sortIndices = NULL;
+static PathSegment * dev_sortedPaths = NULL;
+static ShadeableIntersection * dev_sortedIntersections = NULL;
+// temporal reprojection and denoising; NULL when both are off. Each G-buffer
+// and history has a copy for the current view and one for the previous view,
+// but only temporal reprojection uses the previous view's and the histories.
+static GBufferPixel * dev_gbuffer = NULL;
+static GBufferPixel * dev_prevGBuffer = NULL;
+static glm::vec4 * dev_history = NULL;
+static glm::vec4 * dev_prevHistory = NULL;
+// camera dev_gbuffer was recorded with, and then dev_prevGBuffer's once a
+// camera move swaps them
+static Camera gbufferCamera;
+// the next iteration records dev_gbuffer, and then reprojects dev_prevHistory
+static bool gbufferPending = false;
+static bool reprojectPending = false;
+// iterations in dev_image, for handing the image on to the next view
+static int imageIterations = 0;
+// preview frames only; NULL until the first one. Holds one sample of each
+// preview pixel, apart from dev_image.
+static glm::vec3 * dev_previewImage = NULL;
+static int previewCapacity = 0;
+// denoising only; NULL when it is off. The filter's input and output of the
+// level it runs, and its final image.
+static glm::vec4 * dev_denoiseIn = NULL;
+static glm::vec4 * dev_denoiseOut = NULL;
+static glm::vec3 * dev_denoised = NULL;
+
+void pathtraceSetBackend(RenderBackend renderBackend, int numThreads) {
+    backend = renderBackend;
+    cpuThreads = numThreads;
+}
+
+RenderBackend pathtraceGetBackend() {
+    return backend;
+}
+
+const char *pathtraceStageName(int stage) {
+    static const char *names[NUM_PATHTRACE_STAGES] = {
+        "generate", "intersect", "sort", "shade", "compact", "gather", "tiles", "denoise"
+    };
+    return stage >= 0 && stage < NUM_PATHTRACE_STAGES ? names[stage] : "unknown";
+}
+
+void pathtraceSetStats(PathtraceStats *stats) {
+    hst_stats = stats;
+}
+
+using time_point_t = std::chrono::high_resolution_clock::time_point;
+
+// Start of a stage: a host timestamp when stats are recorded, a CUDA event
+// when the profiler is on.
+struct StageTimer {
+    time_point_t start;
+    cudaEvent_t event;
+};
+
+// A profiled stage of the current iteration. Its events are only read back
+// once the iteration's last one has completed; see flushGpuSpans().
+struct GpuSpan {
+    PathtraceStage stage;
+    cudaEvent_t start;
+    cudaEvent_t stop;
+    int depth;
+    long long activePaths;
+};
+
+static std::vector<GpuSpan> gpuSpans;
+static std::vector<cudaEvent_t> idleEvents;
+// recorded and waited on when an iteration starts, to place GPU spans on the
+// profiler's host clock
+static cudaEvent_t iterationEvent = NULL;
+static double iterationStartUs = 0.0;
+
+static cudaEvent_t acquireEvent() {
+    cudaEvent_t event;
+    if (idleEvents.empty()) {
+        cudaEventCreate(&event);
+    } else {
+        event = idleEvents.back();
+        idleEvents.pop_back();
+    }
+    return event;
+}
+
+// Starts timing a stage. With stats, waits for earlier work first so it is
+// not billed to this stage.
+static StageTimer stageBegin() {
+    StageTimer timer;
+    timer.event = NULL;
+    if (hst_stats) {
+        cudaDeviceSynchronize();
+        timer.start = std::chrono::high_resolution_clock::now();
+    }
+    if (profiler::enabled()) {
+        timer.event = acquireEvent();
+        cudaEventRecord(timer.event);
+    }
+    return timer;
+}
+
+// Ends a stage of bounce `depth` (-1 outside the bounce loop). With stats,
+// waits for the stage's kernels and adds its time. `activePaths` is the
+// number of paths entering the bounce, or -1.
+static void stageEnd(PathtraceStage stage, const StageTimer &timer, int depth, long long activePaths = -1) {
+    if (hst_stats) {
+        cudaDeviceSynchronize();
+        std::chrono::duration<double, std::milli> dur = std::chrono::high_resolution_clock::now() - timer.start;
+        hst_stats->stageMs[stage] += dur.count();
+    }
+    if (timer.event) {
+        GpuSpan span = { stage, timer.event, acquireEvent(), depth, activePaths };
+        cudaEventRecord(span.stop);
+        gpuSpans.push_back(span);
+    }
+}
+
+// Anchors this iteration's GPU spans to the host clock, once the device has
+// finished the previous iteration.
+static void beginGpuSpans() {
+    if (!profiler::enabled()) {
+        return;
+    }
+    if (!iterationEvent) {
+        cudaEventCreate(&iterationEvent);
+    }
+    cudaEventRecord(iterationEvent);
+    cudaEventSynchronize(iterationEvent);
+    iterationStartUs = profiler::nowUs();
+}
+
+// Hands the iteration's GPU spans to the profiler, waiting for the last of
+// them to complete. Nothing else waits for the device at the end of an
+// iteration, so this stall only happens while profiling.
+static void flushGpuSpans(int iter) {
+    if (!gpuSpans.empty()) {
+        cudaEventSynchronize(gpuSpans.back().stop);
+    }
+    for (size_t i = 0; i < gpuSpans.size(); i++) {
+        const GpuSpan &span = gpuSpans[i];
+        float startMs, stopMs;
+        cudaEventElapsedTime(&startMs, iterationEvent, span.start);
+        cudaEventElapsedTime(&stopMs, iterationEvent, span.stop);
+        double startUs = iterationStartUs + startMs * 1000.0;
+        profiler::span(pathtraceStageName(span.stage), profiler::GPU_TRACK,
+            startUs, iterationStartUs + stopMs * 1000.0, iter, span.depth);
+        if (span.activePaths >= 0) {
+            profiler::counter("activePaths", startUs, iter, span.depth, span.activePaths);
+        }
+        idleEvents.push_back(span.start);
+        idleEvents.push_back(span.stop);
+    }
+    gpuSpans.clear();
+}
+
+// Adds the paths entering bounce `depth` to the recorded stats.
+static void recordActivePaths(int depth, long long count) {
+    if ((int)hst_stats->activePaths.size() <= depth) {
+        hst_stats->activePaths.resize(depth + 1, 0);
+    }
+    hst_stats->activePaths[depth] += count;
+}
 
 void pathtraceInit(Scene *scene) {
+    if (backend == BACKEND_CPU) {
+        pathtraceCpuInit(scene, cpuThreads);
+        return;
+    }
+
     hst_scene = scene;
     const Camera &cam = hst_scene->state.camera;
     const int pixelcount = cam.resolution.x * cam.resolution.y;
 
     cudaMalloc(&dev_image, pixelcount * sizeof(glm::vec3));
     cudaMemset(dev_image, 0, pixelcount * sizeof(glm::vec3));
+    imageOnHost = false;
 
     cudaMalloc(&dev_paths, pixelcount * sizeof(PathSegment));
 
-    cudaMalloc(&dev_geoms, scene->geoms.size() * sizeof(Geom));
-    cudaMemcpy(dev_geoms, scene->geoms.data(), scene->geoms.size() * sizeof(Geom), cudaMemcpyHostToDevice);
+    const size_t numInstances = scene->instances.size();
+    cudaMalloc(&dev_instRow0, numInstances * sizeof(glm::vec4));
+    cudaMalloc(&dev_instRow1, numInstances * sizeof(glm::vec4));
+    cudaMalloc(&dev_instRow2, numInstances * sizeof(glm::vec4));
+    cudaMalloc(&dev_instBlasId, numInstances * sizeof(int));
+    cudaMalloc(&dev_instMaterialId, numInstances * sizeof(int));
+    cudaMalloc(&dev_instNormalMatrix, numInstances * sizeof(glm::mat3));
+    cudaMemcpy(dev_instRow0, scene->instRow0.data(), numInstances * sizeof(glm::vec4), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_instRow1, scene->instRow1.data(), numInstances * sizeof(glm::vec4), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_instRow2, scene->instRow2.data(), numInstances * sizeof(glm::vec4), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_instBlasId, scene->instBlasId.data(), numInstances * sizeof(int), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_instMaterialId, scene->instMaterialId.data(), numInstances * sizeof(int), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_instNormalMatrix, scene->instNormalMatrix.data(), numInstances * sizeof(glm::mat3), cudaMemcpyHostToDevice);
+
+    cudaMalloc(&dev_blases, scene->blases.size() * sizeof(Blas));
+    cudaMemcpy(dev_blases, scene->blases.data(), scene->blases.size() * sizeof(Blas), cudaMemcpyHostToDevice);
+
+    cudaMalloc(&dev_tlasNodes, scene->tlasNodes.size() * sizeof(BVHNode));
+    cudaMemcpy(dev_tlasNodes, scene->tlasNodes.data(), scene->tlasNodes.size() * sizeof(BVHNode), cudaMemcpyHostToDevice);
+
+    cudaMalloc(&dev_blasNodes, scene->blasNodes.size() * sizeof(BVHNode));
+    cudaMemcpy(dev_blasNodes, scene->blasNodes.data(), scene->blasNodes.size() * sizeof(BVHNode), cudaMemcpyHostToDevice);
+
+    const size_t numTris = scene->triV0.size();
+    cudaMalloc(&dev_triV0, numTris * sizeof(int));
+    cudaMalloc(&dev_triV1, numTris * sizeof(int));
+    cudaMalloc(&dev_triV2, numTris * sizeof(int));
+    cudaMemcpy(dev_triV0, scene->triV0.data(), numTris * sizeof(int), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_triV1, scene->triV1.data(), numTris * sizeof(int), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_triV2, scene->triV2.data(), numTris * sizeof(int), cudaMemcpyHostToDevice);
+
+    const size_t numVerts = scene->vertX.size();
+    cudaMalloc(&dev_vertX, numVerts * sizeof(float));
+    cudaMalloc(&dev_vertY, numVerts * sizeof(float));
+    cudaMalloc(&dev_vertZ, numVerts * sizeof(float));
+    cudaMemcpy(dev_vertX, scene->vertX.data(), numVerts * sizeof(float), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_vertY, scene->vertY.data(), numVerts * sizeof(float), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_vertZ, scene->vertZ.data(), numVerts * sizeof(float), cudaMemcpyHostToDevice);
 
     cudaMalloc(&dev_materials, scene->materials.size() * sizeof(Material));
     cudaMemcpy(dev_materials, scene->materials.data(), scene->materials.size() * sizeof(Material), cudaMemcpyHostToDevice);
 
+    cudaMalloc(&dev_lights, scene->lights.size() * sizeof(Light));
+    cudaMemcpy(dev_lights, scene->lights.data(), scene->lights.size() * sizeof(Light), cudaMemcpyHostToDevice);
+    cudaMalloc(&dev_instLightId, numInstances * sizeof(int));
+    cudaMemcpy(dev_instLightId, scene->instLightId.data(), numInstances * sizeof(int), cudaMemcpyHostToDevice);
+
+    if (scene->state.options.sampler == SAMPLER_BLUE_NOISE) {
+        std::vector<glm::vec2> blueNoise;
+        sampler::buildBlueNoise(blueNoise);
+        cudaMalloc(&dev_blueNoise, blueNoise.size() * sizeof(glm::vec2));
+        cudaMemcpy(dev_blueNoise, blueNoise.data(), blueNoise.size() * sizeof(glm::vec2), cudaMemcpyHostToDevice);
+    }
+
     cudaMalloc(&dev_intersections, pixelcount * sizeof(ShadeableIntersection));
     cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
 
     // TODO: initialize any extra device memeory you need
     // TODO: Part 1 - Caching first bounce intersections
-    #if CACHING
+    if (scene->state.options.caching) {
         cudaMalloc(&dev_first_intersections, pixelcount * sizeof(ShadeableIntersection));
-    #endif
+    }
+    firstBounceCached = false;
+
+    if (scene->state.options.sorting) {
+        cudaMalloc(&dev_sortKeys, pixelcount * sizeof(unsigned int));
+        cudaMalloc(&dev_sortIndices, pixelcount * sizeof(int));
+        cudaMalloc(&dev_sortedPaths, pixelcount * sizeof(PathSegment));
+        cudaMalloc(&dev_sortedIntersections, pixelcount * sizeof(ShadeableIntersection));
+    }
+
+    if (scene->state.options.adaptive > 0.0f) {
+        cudaMalloc(&dev_pixelVariance, pixelcount * sizeof(PixelVariance));
+        cudaMemset(dev_pixelVariance, 0, pixelcount * sizeof(PixelVariance));
+    }
+    samplingPixels = pixelcount;
+
+    if (scene->state.options.temporal || scene->state.options.denoise > 0) {
+        cudaMalloc(&dev_gbuffer, pixelcount * sizeof(GBufferPixel));
+    }
+    if (scene->state.options.temporal) {
+        cudaMalloc(&dev_prevGBuffer, pixelcount * sizeof(GBufferPixel));
+        cudaMalloc(&dev_history, pixelcount * sizeof(glm::vec4));
+        cudaMemset(dev_history, 0, pixelcount * sizeof(glm::vec4));
+        cudaMalloc(&dev_prevHistory, pixelcount * sizeof(glm::vec4));
+    }
+    if (scene->state.options.denoise > 0) {
+        cudaMalloc(&dev_denoiseIn, pixelcount * sizeof(glm::vec4));
+        cudaMalloc(&dev_denoiseOut, pixelcount * sizeof(glm::vec4));
+        cudaMalloc(&dev_denoised, pixelcount * sizeof(glm::vec3));
+    }
+    gbufferPending = true;
+    reprojectPending = false;
+    imageIterations = 0;
 
     checkCUDAError("pathtraceInit");
 }
 
 void pathtraceFree() {
+    if (backend == BACKEND_CPU) {
+        pathtraceCpuFree();
+        return;
+    }
+
     cudaFree(dev_image);  // no-op if dev_image is null
     cudaFree(dev_paths);
-    cudaFree(dev_geoms);
+    cudaFree(dev_instRow0);
+    cudaFree(dev_instRow1);
+    cudaFree(dev_instRow2);
+    cudaFree(dev_instBlasId);
+    cudaFree(dev_instMaterialId);
+    cudaFree(dev_instNormalMatrix);
+    cudaFree(dev_blases);
+    cudaFree(dev_tlasNodes);
+    cudaFree(dev_blasNodes);
+    cudaFree(dev_triV0);
+    cudaFree(dev_triV1);
+    cudaFree(dev_triV2);
+    cudaFree(dev_vertX);
+    cudaFree(dev_vertY);
+    cudaFree(dev_vertZ);
     cudaFree(dev_materials);
+    cudaFree(dev_lights);
+    cudaFree(dev_instLightId);
+    cudaFree(dev_blueNoise);
+    dev_blueNoise = NULL;
     cudaFree(dev_intersections);
 
     // clean up any extra device memory you created
     // TODO: Part 1 - Cache first bounce intersections
-    #if CACHING
-        cudaFree(dev_first_intersections);
-    #endif
+    cudaFree(dev_first_intersections);
+    dev_first_intersections = NULL;
+    cudaFree(dev_sortKeys);
+    cudaFree(dev_sortIndices);
+    cudaFree(dev_sortedPaths);
+    cudaFree(dev_sortedIntersections);
+    dev_sortKeys = NULL;
+    dev_sortIndices = NULL;
+    dev_sortedPaths = NULL;
+    dev_sortedIntersections = NULL;
+    cudaFree(dev_pixelVariance);
+    dev_pixelVariance = NULL;
+    cudaFree(dev_gbuffer);
+    cudaFree(dev_prevGBuffer);
+    cudaFree(dev_history);
+    cudaFree(dev_prevHistory);
+    dev_gbuffer = NULL;
+    dev_prevGBuffer = NULL;
+    dev_history = NULL;
+    dev_prevHistory = NULL;
+    cudaFree(dev_previewImage);
+    dev_previewImage = NULL;
+    previewCapacity = 0;
+    cudaFree(dev_denoiseIn);
+    cudaFree(dev_denoiseOut);
+    cudaFree(dev_denoised);
+    dev_denoiseIn = NULL;
+    dev_denoiseOut = NULL;
+    dev_denoised = NULL;
+
+    for (size_t i = 0; i < idleEvents.size(); i++) {
+        cudaEventDestroy(idleEvents[i]);
+    }
+    idleEvents.clear();
+    if (iterationEvent) {
+        cudaEventDestroy(iterationEvent);
+        iterationEvent = NULL;
+    }
 
     checkCUDAError("pathtraceFree");
 }
@@ -130,38 +460,27 @@ void pathtraceFree() {
 * Antialiasing - add rays for sub-pixel sampling
 * motion blur - jitter rays "in time"
 * lens effect - jitter ray origin positions based on a lens
+*
+* Cached first bounces need the same camera ray every iteration, so jitter is
+* compiled out when Caching is set. Otherwise `sampler` places the jitter.
+*
+* With adaptive sampling (`variance` not NULL), converged pixels get a path
+* that has already ended.
 */
-__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments)
+template<bool Caching>
+__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments,
+    SamplerView sampler, const PixelVariance * variance, const glm::vec3 * image)
 {
     int x = (blockIdx.x * blockDim.x) + threadIdx.x;
     int y = (blockIdx.y * blockDim.y) + threadIdx.y;
 
     if (x < cam.resolution.x && y < cam.resolution.y) {
         int index = x + (y * cam.resolution.x);
-        PathSegment & segment = pathSegments[index];
-
-        segment.ray.origin = cam.position;
-        segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
-
-        
         // TODO: Part 2 - implement antialiasing by jittering the ray
-        float xOffset = 0.0f;
-        float yOffset = 0.0f;
-        #if !CACHING
-            // use random number generator to add offset to x and y
-            thrust::default_random_engine rng = makeSeededRandomEngine(iter, index, traceDepth);
-            thrust::uniform_real_distribution<float> u01(0, 1);
-            xOffset = u01(rng);
-            yOffset = u01(rng);
-        #endif
-
-        segment.ray.direction = glm::normalize(cam.view
-            - cam.right * cam.pixelLength.x * ((float)(x + xOffset) - (float)cam.resolution.x * 0.5f)
-            - cam.up * cam.pixelLength.y * ((float)(y + yOffset) - (float)cam.resolution.y * 0.5f)
-        );
-
-        segment.pixelIndex = index;
-        segment.remainingBounces = traceDepth;
+        generateCameraRay(cam, iter, traceDepth, x, y, !Caching, sampler, pathSegments[index]);
+        if (variance) {
+            skipConvergedPixel(variance[index], image[index], iter, pathSegments[index]);
+        }
     }
 }
 
@@ -173,73 +492,17 @@ __global__ void computeIntersections(
     int depth, 
     int num_paths,
     PathSegment * pathSegments,
-    Geom * geoms,
-    int geoms_size,
+    SceneView scene,
     ShadeableIntersection * intersections
 )
 {
     int path_index = blockIdx.x * blockDim.x + threadIdx.x;
 
-    if (path_index < num_paths)
+    // finished paths are left in place without compaction, and converged
+    // pixels start finished
+    if (path_index < num_paths && pathSegments[path_index].remainingBounces > 0)
     {
-        PathSegment pathSegment = pathSegments[path_index];
-
-        float t;
-        glm::vec3 intersect_point;
-        glm::vec3 normal;
-        float t_min = FLT_MAX;
-        int hit_geom_index = -1;
-        bool outside = true;
-
-        glm::vec3 tmp_intersect;
-        glm::vec3 tmp_normal;
-
-        // naive parse through global geoms
-        for (int i = 0; i < geoms_size; i++)
-        {
-            Geom & geom = geoms[i];
-
-            if (geom.type == CUBE)
-            {
-                t = boxIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-            }
-            else if (geom.type == SPHERE)
-            {
-                t = sphereIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-            }
-            // TODO: add more intersection tests here... triangle? metaball? CSG?
-            else if (geom.type == CSG1) 
-            {
-                t = csg1IntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-            }
-            else if (geom.type == CSG2)
-            {
-                t = csg2IntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-            }
-
-            // Compute the minimum t from the intersection tests to determine what
-            // scene geometry object was hit first.
-            if (t > 0.0f && t_min > t)
-            {
-                t_min = t;
-                hit_geom_index = i;
-                intersect_point = tmp_intersect;
-                normal = tmp_normal;
-            }
-        }
-
-        if (hit_geom_index == -1)
-        {
-            intersections[path_index].t = -1.0f;
-        }
-        else
-        {
-            //The ray hits something
-            intersections[path_index].t = t_min;
-            intersections[path_index].materialId = geoms[hit_geom_index].materialid;
-            intersections[path_index].surfaceNormal = normal;
-        }
-
+        computePathIntersection(pathSegments[path_index], scene, intersections[path_index]);
     }
 }
 
@@ -252,67 +515,49 @@ __global__ void computeIntersections(
 // Note that this shader does NOT do a BSDF evaluation!
 // Your shaders should handle that - this can allow techniques such as
 // bump mapping.
+//
+// With Nee, diffuse hits also sample a light directly; see
+// shadePathSegmentNEE. With roulette, dim paths may end early; see
+// surviveRoulette.
+template<bool Compact, bool Nee>
 __global__ void shadeFakeMaterial(
     int iter
     , int num_paths
     , ShadeableIntersection * shadeableIntersections
     , PathSegment * pathSegments
     , Material * materials
+    , const glm::mat3 * normalMatrices
+    , SceneView scene
+    , LightView lights
+    , SamplerView sampler
     , int depth
+    , bool roulette
 )
 {
     int idx = blockIdx.x * blockDim.x + threadIdx.x;
 
-    // not needed if using compact, needed if not using compact
-    // without compact, you don't know which rays are finished
-    #if !COMPACT
-        if (pathSegments[idx].remainingBounces == 0) return;
-    #endif
-
     if (idx < num_paths)
     {
-        ShadeableIntersection intersection = shadeableIntersections[idx];
-        if (intersection.t > 0.0f) { // if the intersection exists...
-          // Set up the RNG
-          // LOOK: this is how you use thrust's RNG! Please look at
-          // makeSeededRandomEngine as well.
-            thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, depth);
-            thrust::uniform_real_distribution<float> u01(0, 1);
-
-            Material material = materials[intersection.materialId];
-            glm::vec3 materialColor = material.color;
-
-            // If the material indicates that the object was a light, "light" the ray
-            if (material.emittance > 0.0f) {
-                pathSegments[idx].color *= (materialColor * material.emittance);
-                pathSegments[idx].remainingBounces = 0;
-            }
-            // Otherwise, do some pseudo-lighting computation. This is actually more
-            // like what you would expect from shading in a rasterizer like OpenGL.
-            // TODO: replace this! you should be able to start with basically a one-liner
-            else {
-                // float lightTerm = glm::dot(intersection.surfaceNormal, glm::vec3(0.0f, 1.0f, 0.0f));
-                // pathSegments[idx].color *= (materialColor * lightTerm) * 0.3f + ((1.0f - intersection.t * 0.02f) * materialColor) * 0.7f;
-                // pathSegments[idx].color *= u01(rng); // apply some noise because why not
-                // TODO: Part 1 - Shading kernel with BSDF evaluation
-                glm::vec3 intersectionPoint = getPointOnRay(pathSegments[idx].ray, intersection.t);
-                scatterRay(pathSegments[idx], intersectionPoint, intersection.surfaceNormal, material, rng);
-                pathSegments[idx].remainingBounces--;
-            }
-            // If there was no intersection, color the ray black.
-            // Lots of renderers use 4 channel color, RGBA, where A = alpha, often
-            // used for opacity, in which case they can indicate "no opacity".
-            // This can be useful for post-processing and image compositing.
-        }
-        else {
-            pathSegments[idx].color = glm::vec3(0.0f);
-            pathSegments[idx].remainingBounces = 0;
+        // needed without compact, where you don't know which rays are
+        // finished, and on the first bounce of adaptive sampling, where
+        // converged pixels start finished
+        if ((!Compact || depth == 1) && pathSegments[idx].remainingBounces == 0) return;
+
+        // TODO: Part 1 - Shading kernel with BSDF evaluation
+        if (Nee) {
+            shadePathSegmentNEE(iter, depth, shadeableIntersections[idx], pathSegments[idx],
+                materials, normalMatrices, scene, lights, sampler, roulette);
+        } else {
+            shadePathSegment(iter, depth, shadeableIntersections[idx], pathSegments[idx],
+                materials, normalMatrices, sampler, roulette);
         }
     }
 }
 
-// Add the current iteration's output to the overall image
-__global__ void finalGather(int nPaths, glm::vec3 * image, PathSegment * iterationPaths)
+// Add the current iteration's output to the overall image, and with adaptive
+// sampling (`variance` not NULL) to the pixel's running variance
+__global__ void finalGather(int nPaths, glm::vec3 * image, PathSegment * iterationPaths,
+    PixelVariance * variance, int iter, float threshold)
 {
     int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
@@ -320,9 +565,121 @@ __global__ void finalGather(int nPaths, glm::vec3 * image, PathSegment * iterati
     {
         PathSegment iterationPath = iterationPaths[index];
         image[iterationPath.pixelIndex] += iterationPath.color;
+        if (variance) {
+            accumulatePixelVariance(variance[iterationPath.pixelIndex], iterationPath.color, iter, threshold);
+        }
+    }
+}
+
+// Adaptive sampling: stops pixels whose neighborhood has converged. Runs
+// after finalGather, since it reads the neighbors' variance.
+__global__ void markConvergedPixels(glm::ivec2 resolution, PixelVariance * variance, int iter)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        updatePixelConvergence(variance, x, y, resolution, iter);
+    }
+}
+
+// Temporal reprojection and denoising: the G-buffer of this view, from the
+// camera rays' first intersections
+__global__ void recordGBuffer(int nPaths, PathSegment * paths, ShadeableIntersection * intersections,
+    const Material * materials, const glm::mat3 * normalMatrices, GBufferPixel * gbuffer)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (index < nPaths)
+    {
+        gbuffer[paths[index].pixelIndex] = makeGBufferPixel(paths[index], intersections[index],
+            materials, normalMatrices);
+    }
+}
+
+// Temporal reprojection: fetches each pixel's history from the previous view
+__global__ void reprojectHistory(int pixelcount, GBufferPixel * gbuffer, Camera prevCamera,
+    GBufferPixel * prevGBuffer, glm::vec4 * prevHistory, glm::vec4 * history)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (index < pixelcount)
+    {
+        history[index] = reprojectPixel(gbuffer[index], prevCamera, prevGBuffer, prevHistory);
+    }
+}
+
+// Temporal reprojection: folds the image into the history the next view
+// reprojects
+__global__ void keepHistory(int pixelcount, glm::vec3 * image, int iter, glm::vec4 * history,
+    glm::vec4 * prevHistory)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (index < pixelcount)
+    {
+        prevHistory[index] = historyForNextView(image[index], iter, history[index]);
+    }
+}
+
+// Preview frames: stretches the preview image over the full-resolution PBO
+__global__ void sendPreviewToPBO(uchar4* pbo, glm::ivec2 resolution, glm::ivec2 previewResolution,
+    int stride, glm::vec3* preview)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        writePBOPixel(pbo, index, upsamplePreview(preview, previewResolution, stride, x, y), 1.0f);
+    }
+}
+
+// Denoising: the filter input of every pixel, blending in its temporal
+// history if `history` is not NULL
+__global__ void prepareDenoise(int pixelcount, glm::vec3 * image, int iter, glm::vec4 * history,
+    GBufferPixel * gbuffer, glm::vec4 * filtered)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (index < pixelcount)
+    {
+        glm::vec4 h = history ? history[index] : glm::vec4(0.0f);
+        filtered[index] = denoiseInput(image[index] + glm::vec3(h) * h.w, iter + h.w, gbuffer[index]);
+    }
+}
+
+// Denoising: one A-Trous level
+__global__ void atrousFilter(glm::ivec2 resolution, glm::vec3 eye, int level, glm::vec4 * in,
+    GBufferPixel * gbuffer, glm::vec4 * out)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        out[x + (y * resolution.x)] = atrousPixel(in, gbuffer, eye, resolution, x, y, level);
     }
 }
 
+// Denoising: multiplies the albedo back into the filtered image
+__global__ void finishDenoise(int pixelcount, glm::vec4 * filtered, GBufferPixel * gbuffer,
+    glm::vec3 * denoised)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (index < pixelcount)
+    {
+        denoised[index] = denoiseOutput(filtered[index], gbuffer[index]);
+    }
+}
+
+// Pixels adaptive sampling has not yet converged
+struct stillSampling {
+    __host__ __device__ bool operator()(const PixelVariance &v) {
+        return v.convergedAt == 0;
+    }
+};
+
 // TODO: Part 1 - Stream Compaction
 // A predicate used for thrust::partition function to tell how to partition
 struct streamCompactPredicate {
@@ -335,106 +692,119 @@ struct streamCompactPredicate {
 };
 
 // TODO: Part 1 - Sorting rays, pathSegments, intersections
-// A predicate used for thrust::partition function to tell how to partition
-struct sortPredicate {
+// Material sorting: each path's sort key, and its index for the gather
+__global__ void buildSortKeys(int nPaths, PathSegment * paths, ShadeableIntersection * intersections,
+    bool direction, unsigned int * keys, int * indices)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (index < nPaths)
+    {
+        keys[index] = materialSortKey(paths[index], intersections[index], direction);
+        indices[index] = index;
+    }
+}
 
-    sortPredicate() {};
+// Material sorting: moves the first nSorted paths and their intersections
+// into key order, and copies the paths after them, which compaction set
+// aside as finished, as they are
+__global__ void gatherSorted(int nSorted, int nPaths, const int * indices, const PathSegment * paths,
+    const ShadeableIntersection * intersections, PathSegment * sortedPaths,
+    ShadeableIntersection * sortedIntersections)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
-    __host__ __device__ bool operator()(const ShadeableIntersection &i1, const ShadeableIntersection &i2) {
-        return (i1.materialId < i2.materialId);
+    if (index < nSorted)
+    {
+        int from = indices[index];
+        sortedPaths[index] = paths[from];
+        sortedIntersections[index] = intersections[from];
     }
-};
+    else if (index < nPaths)
+    {
+        sortedPaths[index] = paths[index];
+    }
+}
 
 /**
- * Wrapper for the __global__ call that sets up the kernel calls and does a ton
- * of memory management
+ * Traces every path of one iteration through all bounces, leaving the
+ * results in dev_paths. Compaction and first-bounce caching are template
+ * parameters, so each combination gets its own kernels; next-event
+ * estimation picks between two shading kernels. Sorting and the timing
+ * printouts only change host code and stay runtime checks.
+ *
+ * `cam` is the scene's camera, or a preview camera with fewer pixels.
+ * `variance` is the adaptive sampling state, NULL when off; `gbuffer`, if not
+ * NULL, records the camera rays' first hits.
  */
-void pathtrace(uchar4 *pbo, int frame, int iter) {
+template<bool Compact, bool Caching>
+static void traceIteration(int iter, const Camera &cam, const SceneView &sceneView, const LightView &lightView,
+        const SamplerView &samplerView, const RenderOptions &options, const PixelVariance *variance,
+        GBufferPixel *gbuffer) {
     const int traceDepth = hst_scene->state.traceDepth;
-    const Camera &cam = hst_scene->state.camera;
     const int pixelcount = cam.resolution.x * cam.resolution.y;
 
-    // 2D block for generating ray from camera
     const dim3 blockSize2d(8, 8);
     const dim3 blocksPerGrid2d(
         (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
         (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
-
-    // 1D block for path tracing
     const int blockSize1d = 128;
 
-    ///////////////////////////////////////////////////////////////////////////
-
-    // Recap:
-    // * Initialize array of path rays (using rays that come out of the camera)
-    //   * You can pass the Camera object to that kernel.
-    //   * Each path ray must carry at minimum a (ray, color) pair,
-    //   * where color starts as the multiplicative identity, white = (1, 1, 1).
-    //   * This has already been done for you.
-    // * For each depth:
-    //   * Compute an intersection in the scene for each path ray.
-    //     A very naive version of this has been implemented for you, but feel
-    //     free to add more primitives and/or a better algorithm.
-    //     Currently, intersection distance is recorded as a parametric distance,
-    //     t, or a "distance along the ray." t = -1.0 indicates no intersection.
-    //     * Color is attenuated (multiplied) by reflections off of any object
-    //   * TODO: Stream compact away all of the terminated paths.
-    //     You may use either your implementation or `thrust::remove_if` or its
-    //     cousins.
-    //     * Note that you can't really use a 2D kernel launch any more - switch
-    //       to 1D.
-    //   * TODO: Shade the rays that intersected something or didn't bottom out.
-    //     That is, color the ray by performing a color computation according
-    //     to the shader, then generate a new ray to continue the ray path.
-    //     We recommend just updating the ray's PathSegment in place.
-    //     Note that this step may come before or after stream compaction,
-    //     since some shaders you write may also cause a path to terminate.
-    // * Finally, add this iteration's results to the image. This has been done
-    //   for you.
-
-    // TODO: perform one iteration of path tracing
-
-    generateRayFromCamera << <blocksPerGrid2d, blockSize2d >> > (cam, iter, traceDepth, dev_paths);
+    StageTimer stageStart = stageBegin();
+    generateRayFromCamera<Caching> << <blocksPerGrid2d, blockSize2d >> > (cam, iter, traceDepth, dev_paths,
+        samplerView, variance, dev_image);
     checkCUDAError("generate camera ray");
+    stageEnd(STAGE_GENERATE, stageStart, -1);
 
     int depth = 0;
     PathSegment* dev_path_end = dev_paths + pixelcount;
     int num_paths = dev_path_end - dev_paths;
 
-    #if TIMING
-        using time_point_t = std::chrono::high_resolution_clock::time_point;
-        time_point_t startTime = std::chrono::high_resolution_clock::now();
-    #endif
+    time_point_t startTime;
+    if (options.timing) {
+        startTime = std::chrono::high_resolution_clock::now();
+    }
 
     // --- PathSegment Tracing Stage ---
     // Shoot ray into scene, bounce between objects, push shading chunks
 
     bool iterationComplete = false;
     while (!iterationComplete) {
+        const int bounce = depth;
 
         // clean shading chunks
         cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
 
         dim3 numblocksPathSegmentTracing = (num_paths + blockSize1d - 1) / blockSize1d;
 
-        #if CACHING
-            if ((iter == 1 && depth == 0) || depth > 0)
+        long long activePaths = -1;
+        if (hst_stats || profiler::enabled()) {
+            // without compaction, finished paths stay in the array until the
+            // end; converged pixels enter the first bounce already finished
+            activePaths = Compact && bounce > 0 ? num_paths :
+                thrust::count_if(thrust::device, dev_paths, dev_paths + num_paths, streamCompactPredicate());
+            if (hst_stats) {
+                recordActivePaths(bounce, activePaths);
+            }
+        }
+
+        stageStart = stageBegin();
+        if (Caching) {
+            if ((!firstBounceCached && depth == 0) || depth > 0)
             {
                 computeIntersections << <numblocksPathSegmentTracing, blockSize1d >> > (
                     depth,
                     num_paths,
                     dev_paths,
-                    dev_geoms,
-                    hst_scene->geoms.size(),
+                    sceneView,
                     dev_intersections
                     );
                 checkCUDAError("trace one bounce");
             }
             // TODO: Part 1 - Caching first bounce intersections
-            // iteration is the sample number of the pixel
-            // iteration == 1 means the first ray shot out of pixel
+            // the first iteration since init fills the cache
             // depth is the the bounce number
-            if (iter == 1 && depth == 0)
+            if (!firstBounceCached && depth == 0)
             {
                 // store computed intersection into cache
                 cudaMemcpy(dev_first_intersections, dev_intersections, pixelcount * sizeof(ShadeableIntersection), cudaMemcpyDeviceToDevice);
@@ -442,43 +812,61 @@ void pathtrace(uchar4 *pbo, int frame, int iter) {
             // TODO: Part 1 - Caching first bounce intersection
             // if ray is not the first ray shot out of pixel, and
             // is the first bounce, use the saved cache
-            else if (iter > 1 && depth == 0)
+            else if (firstBounceCached && depth == 0)
             {
                 cudaMemcpy(dev_intersections, dev_first_intersections, pixelcount * sizeof(ShadeableIntersection), cudaMemcpyDeviceToDevice);
             }
             cudaDeviceSynchronize();
             depth++;
         // NO CACHING
-        #else
+        } else {
             // tracing
             computeIntersections<<<numblocksPathSegmentTracing, blockSize1d>>> (
                 depth,
                 num_paths,
                 dev_paths,
-                dev_geoms,
-                hst_scene->geoms.size(),
+                sceneView,
                 dev_intersections
                 );
             checkCUDAError("trace one bounce");
             cudaDeviceSynchronize();
             depth++;
-        #endif
+        }
+        stageEnd(STAGE_INTERSECT, stageStart, bounce, activePaths);
+
+        if (bounce == 0 && gbuffer) {
+            recordGBuffer << <numblocksPathSegmentTracing, blockSize1d >> > (num_paths, dev_paths,
+                dev_intersections, dev_materials, dev_instNormalMatrix, gbuffer);
+            checkCUDAError("record G-buffer");
+        }
 
         // TODO: Part 1 - Sorting rays, pathSegments, intersections
-        #if SORTING
-            #if SORTTIMING
-                using time_point_s = std::chrono::high_resolution_clock::time_point;
-                time_point_s startTime2 = std::chrono::high_resolution_clock::now();
-            #endif      
-            thrust::sort_by_key(thrust::device, dev_intersections, dev_intersections + num_paths, dev_paths, sortPredicate());
-            #if SORTTIMING
+        if (options.sorting) {
+            stageStart = stageBegin();
+            time_point_t startTime2;
+            if (options.sortTiming) {
+                startTime2 = std::chrono::high_resolution_clock::now();
+            }
+            // unsigned keys with the default order take thrust's radix sort
+            buildSortKeys << <numblocksPathSegmentTracing, blockSize1d >> > (num_paths, dev_paths,
+                dev_intersections, options.sortDirection, dev_sortKeys, dev_sortIndices);
+            checkCUDAError("build sort keys");
+            thrust::sort_by_key(thrust::device, dev_sortKeys, dev_sortKeys + num_paths, dev_sortIndices);
+            dim3 numblocksGather = (pixelcount + blockSize1d - 1) / blockSize1d;
+            gatherSorted << <numblocksGather, blockSize1d >> > (num_paths, pixelcount, dev_sortIndices,
+                dev_paths, dev_intersections, dev_sortedPaths, dev_sortedIntersections);
+            checkCUDAError("gather sorted paths");
+            std::swap(dev_paths, dev_sortedPaths);
+            std::swap(dev_intersections, dev_sortedIntersections);
+            if (options.sortTiming) {
                 cudaDeviceSynchronize();
-                time_point_s endTime2 = std::chrono::high_resolution_clock::now();
+                time_point_t endTime2 = std::chrono::high_resolution_clock::now();
                 std::chrono::duration<double, std::milli> dur2 = endTime2 - startTime2;
                 float elapsedTime2 = static_cast<decltype(elapsedTime2)>(dur2.count());
                 std::cout << "sorting time: " << elapsedTime2 << " milliseconds" << std::endl;
-            #endif      
-        #endif
+            }
+            stageEnd(STAGE_SORT, stageStart, bounce);
+        }
 
         // TODO:
         // --- Shading Stage ---
@@ -488,45 +876,400 @@ void pathtrace(uchar4 *pbo, int frame, int iter) {
         // materials you have in the scenefile.
         // TODO: compare between directly shading the path segments and shading
         // path segments that have been reshuffled to be contiguous in memory.
-        shadeFakeMaterial << <numblocksPathSegmentTracing, blockSize1d >> > (
-            iter,
-            num_paths,
-            dev_intersections,
-            dev_paths,
-            dev_materials,
-            depth
-            );
-
-        #if COMPACT
+        stageStart = stageBegin();
+        if (options.nee) {
+            shadeFakeMaterial<Compact, true> << <numblocksPathSegmentTracing, blockSize1d >> > (
+                iter,
+                num_paths,
+                dev_intersections,
+                dev_paths,
+                dev_materials,
+                dev_instNormalMatrix,
+                sceneView,
+                lightView,
+                samplerView,
+                depth,
+                options.roulette
+                );
+        } else {
+            shadeFakeMaterial<Compact, false> << <numblocksPathSegmentTracing, blockSize1d >> > (
+                iter,
+                num_paths,
+                dev_intersections,
+                dev_paths,
+                dev_materials,
+                dev_instNormalMatrix,
+                sceneView,
+                lightView,
+                samplerView,
+                depth,
+                options.roulette
+                );
+        }
+        stageEnd(STAGE_SHADE, stageStart, bounce);
+
+        if (Compact) {
             // TODO: Part 1 - Stream Compaction
+            stageStart = stageBegin();
             PathSegment* endSegment = thrust::partition(thrust::device, dev_paths, dev_paths + num_paths, streamCompactPredicate());
             num_paths = endSegment - dev_paths;
+            stageEnd(STAGE_COMPACT, stageStart, bounce);
             iterationComplete = (depth >= traceDepth) || num_paths <= 0; // TODO: iterationComplete should be based off stream compaction results.
-        #else
+        } else {
             iterationComplete = (depth >= traceDepth);
-        #endif 
+        }
     }
 
-    #if TIMING
+    if (options.timing) {
         cudaDeviceSynchronize();
         time_point_t endTime = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double, std::milli> dur = endTime - startTime;
         float elapsedTime = static_cast<decltype(elapsedTime)>(dur.count());
         std::cout << "elapsed time: " << elapsedTime << " milliseconds" << std::endl;
-    #endif
+    }
+}
+
+// What the kernels see of the scene on the device, for rendering through `cam`
+static void makeViews(const Camera &cam, SceneView &sceneView, LightView &lightView, SamplerView &samplerView) {
+    sceneView.numInstances = hst_scene->instances.size();
+    sceneView.instRow0 = dev_instRow0;
+    sceneView.instRow1 = dev_instRow1;
+    sceneView.instRow2 = dev_instRow2;
+    sceneView.instBlasId = dev_instBlasId;
+    sceneView.instMaterialId = dev_instMaterialId;
+    sceneView.blases = dev_blases;
+    sceneView.tlasNodes = dev_tlasNodes;
+    sceneView.blasNodes = dev_blasNodes;
+    sceneView.triV0 = dev_triV0;
+    sceneView.triV1 = dev_triV1;
+    sceneView.triV2 = dev_triV2;
+    sceneView.vertX = dev_vertX;
+    sceneView.vertY = dev_vertY;
+    sceneView.vertZ = dev_vertZ;
+
+    lightView.numLights = hst_scene->lights.size();
+    lightView.lights = dev_lights;
+    lightView.instLightId = dev_instLightId;
+
+    samplerView.type = hst_scene->state.options.sampler;
+    samplerView.samplesPerPixel = hst_scene->state.iterations;
+    samplerView.width = cam.resolution.x;
+    samplerView.blueNoise = dev_blueNoise;
+}
+
+/**
+ * Denoises the image of `iter` iterations into dev_denoised, blending in the
+ * temporal history if `history` is not NULL. Needs the view's G-buffer.
+ */
+static void denoiseImage(int iter, glm::vec4 *history) {
+    const Camera &cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    const int blockSize1d = 128;
+    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+        (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+        (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+
+    StageTimer stageStart = stageBegin();
+    prepareDenoise << <numBlocksPixels, blockSize1d >> > (pixelcount, dev_image, iter, history,
+        dev_gbuffer, dev_denoiseIn);
+    stageEnd(STAGE_DENOISE, stageStart, -1);
+    for (int level = 0; level < hst_scene->state.options.denoise; level++) {
+        stageStart = stageBegin();
+        atrousFilter << <blocksPerGrid2d, blockSize2d >> > (cam.resolution, cam.position, level,
+            dev_denoiseIn, dev_gbuffer, dev_denoiseOut);
+        stageEnd(STAGE_DENOISE, stageStart, level);
+        std::swap(dev_denoiseIn, dev_denoiseOut);
+    }
+    stageStart = stageBegin();
+    finishDenoise << <numBlocksPixels, blockSize1d >> > (pixelcount, dev_denoiseIn, dev_gbuffer, dev_denoised);
+    stageEnd(STAGE_DENOISE, stageStart, -1);
+    checkCUDAError("denoise");
+}
+
+/**
+ * Wrapper for the __global__ call that sets up the kernel calls and does a ton
+ * of memory management
+ */
+void pathtrace(uchar4 *pbo, int frame, int iter) {
+    profiler::Scope scope("iteration", iter);
+    if (backend == BACKEND_CPU) {
+        pathtraceCpu(pbo, frame, iter, hst_stats);
+        return;
+    }
+
+    const Camera &cam = hst_scene->state.camera;
+    const RenderOptions &options = hst_scene->state.options;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+    // 2D block for generating ray from camera
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+        (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+        (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+
+    // 1D block for path tracing
+    const int blockSize1d = 128;
+
+    beginGpuSpans();
+
+    SceneView sceneView;
+    LightView lightView;
+    SamplerView samplerView;
+    makeViews(cam, sceneView, lightView, samplerView);
+
+    ///////////////////////////////////////////////////////////////////////////
+
+    // Recap:
+    // * Initialize array of path rays (using rays that come out of the camera)
+    //   * You can pass the Camera object to that kernel.
+    //   * Each path ray must carry at minimum a (ray, color) pair,
+    //   * where color starts as the multiplicative identity, white = (1, 1, 1).
+    //   * This has already been done for you.
+    // * For each depth:
+    //   * Compute an intersection in the scene for each path ray.
+    //     A very naive version of this has been implemented for you, but feel
+    //     free to add more primitives and/or a better algorithm.
+    //     Currently, intersection distance is recorded as a parametric distance,
+    //     t, or a "distance along the ray." t = -1.0 indicates no intersection.
+    //     * Color is attenuated (multiplied) by reflections off of any object
+    //   * TODO: Stream compact away all of the terminated paths.
+    //     You may use either your implementation or `thrust::remove_if` or its
+    //     cousins.
+    //     * Note that you can't really use a 2D kernel launch any more - switch
+    //       to 1D.
+    //   * TODO: Shade the rays that intersected something or didn't bottom out.
+    //     That is, color the ray by performing a color computation according
+    //     to the shader, then generate a new ray to continue the ray path.
+    //     We recommend just updating the ray's PathSegment in place.
+    //     Note that this step may come before or after stream compaction,
+    //     since some shaders you write may also cause a path to terminate.
+    // * Finally, add this iteration's results to the image. This has been done
+    //   for you.
+
+    // TODO: perform one iteration of path tracing
+
+    // pick the kernels compiled for these options, so no thread branches on them
+    GBufferPixel *gbuffer = gbufferPending ? dev_gbuffer : NULL;
+    if (options.compact) {
+        if (options.caching) {
+            traceIteration<true, true>(iter, cam, sceneView, lightView, samplerView, options,
+                dev_pixelVariance, gbuffer);
+        } else {
+            traceIteration<true, false>(iter, cam, sceneView, lightView, samplerView, options,
+                dev_pixelVariance, gbuffer);
+        }
+    } else {
+        if (options.caching) {
+            traceIteration<false, true>(iter, cam, sceneView, lightView, samplerView, options,
+                dev_pixelVariance, gbuffer);
+        } else {
+            traceIteration<false, false>(iter, cam, sceneView, lightView, samplerView, options,
+                dev_pixelVariance, gbuffer);
+        }
+    }
+    firstBounceCached = options.caching;
 
     // Assemble this iteration and apply it to the image
     dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
-    finalGather << <numBlocksPixels, blockSize1d >> > (pixelcount, dev_image, dev_paths);
+    StageTimer stageStart = stageBegin();
+    finalGather << <numBlocksPixels, blockSize1d >> > (pixelcount, dev_image, dev_paths,
+        dev_pixelVariance, iter, options.adaptive);
+    if (dev_pixelVariance) {
+        markConvergedPixels << <blocksPerGrid2d, blockSize2d >> > (cam.resolution, dev_pixelVariance, iter);
+        samplingPixels = thrust::count_if(thrust::device, dev_pixelVariance, dev_pixelVariance + pixelcount,
+            stillSampling());
+    }
+    stageEnd(STAGE_GATHER, stageStart, -1);
+    if (hst_stats) {
+        hst_stats->iterations++;
+    }
+    imageIterations = iter;
+
+    if (dev_gbuffer && gbufferPending) {
+        if (reprojectPending) {
+            reprojectHistory << <numBlocksPixels, blockSize1d >> > (pixelcount, dev_gbuffer, gbufferCamera,
+                dev_prevGBuffer, dev_prevHistory, dev_history);
+            reprojectPending = false;
+        }
+        gbufferCamera = cam;
+        gbufferPending = false;
+    }
 
     ///////////////////////////////////////////////////////////////////////////
 
-    // Send results to OpenGL buffer for rendering
-    sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo, cam.resolution, iter, dev_image);
+    // Send results to OpenGL buffer for rendering (skipped when headless)
+    if (pbo && dev_denoised) {
+        denoiseImage(iter, dev_history);
+        sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo, cam.resolution, 1, dev_denoised, NULL);
+    } else if (pbo) {
+        sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo, cam.resolution, iter, dev_image, dev_history);
+    }
 
-    // Retrieve image from GPU
-    cudaMemcpy(hst_scene->state.image.data(), dev_image,
-        pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    // the image stays on the device until pathtraceReadImage() asks for it
+    imageOnHost = false;
+    flushGpuSpans(iter);
 
     checkCUDAError("pathtrace");
 }
+
+void pathtracePreview(uchar4 *pbo, int stride) {
+    profiler::Scope scope("preview", 0);
+    if (backend == BACKEND_CPU) {
+        pathtraceCpuPreview(pbo, stride);
+        return;
+    }
+
+    const Camera &cam = hst_scene->state.camera;
+    const Camera preview = previewCamera(cam, stride);
+    const RenderOptions &options = hst_scene->state.options;
+    const int previewPixels = preview.resolution.x * preview.resolution.y;
+    if (previewPixels > previewCapacity) {
+        cudaFree(dev_previewImage);
+        cudaMalloc(&dev_previewImage, previewPixels * sizeof(glm::vec3));
+        previewCapacity = previewPixels;
+    }
+
+    beginGpuSpans();
+
+    SceneView sceneView;
+    LightView lightView;
+    SamplerView samplerView;
+    makeViews(preview, sceneView, lightView, samplerView);
+
+    // one sample per preview pixel, without the per-pixel state of the
+    // full-resolution image: no first-bounce cache, adaptive sampling or
+    // G-buffer, which would all be indexed by the wrong pixels
+    if (options.compact) {
+        traceIteration<true, false>(1, preview, sceneView, lightView, samplerView, options, NULL, NULL);
+    } else {
+        traceIteration<false, false>(1, preview, sceneView, lightView, samplerView, options, NULL, NULL);
+    }
+
+    const int blockSize1d = 128;
+    dim3 numBlocksPixels = (previewPixels + blockSize1d - 1) / blockSize1d;
+    StageTimer stageStart = stageBegin();
+    cudaMemset(dev_previewImage, 0, previewPixels * sizeof(glm::vec3));
+    finalGather << <numBlocksPixels, blockSize1d >> > (previewPixels, dev_previewImage, dev_paths,
+        NULL, 1, 0.0f);
+    stageEnd(STAGE_GATHER, stageStart, -1);
+
+    if (pbo) {
+        const dim3 blockSize2d(8, 8);
+        const dim3 blocksPerGrid2d(
+            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+        sendPreviewToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo, cam.resolution, preview.resolution,
+            stride, dev_previewImage);
+    }
+    flushGpuSpans(0);
+
+    checkCUDAError("pathtracePreview");
+}
+
+void pathtraceReadImage() {
+    if (backend == BACKEND_CPU || imageOnHost) {
+        return;
+    }
+    std::vector<glm::vec3> &image = hst_scene->state.image;
+    cudaMemcpy(image.data(), dev_image, image.size() * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    checkCUDAError("pathtraceReadImage");
+    imageOnHost = true;
+}
+
+bool pathtraceDenoise(std::vector<glm::vec3> &image) {
+    if (backend == BACKEND_CPU) {
+        return pathtraceCpuDenoise(image, hst_stats);
+    }
+    if (!dev_denoised || gbufferPending) {
+        return false;
+    }
+    beginGpuSpans();
+    denoiseImage(imageIterations, NULL);
+    image.resize(hst_scene->state.image.size());
+    cudaMemcpy(image.data(), dev_denoised, image.size() * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    flushGpuSpans(imageIterations);
+    checkCUDAError("pathtraceDenoise");
+    return true;
+}
+
+void pathtraceResetImage() {
+    if (backend == BACKEND_CPU) {
+        pathtraceCpuResetImage();
+        return;
+    }
+
+    const Camera &cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    if (dev_history && !gbufferPending) {
+        // the old view's G-buffer is complete: keep it and its image for
+        // reprojecting into the new view. Without a new iteration since the
+        // last move, the history from before that move is still waiting.
+        const int blockSize1d = 128;
+        dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+        keepHistory << <numBlocksPixels, blockSize1d >> > (pixelcount, dev_image, imageIterations,
+            dev_history, dev_prevHistory);
+        std::swap(dev_gbuffer, dev_prevGBuffer);
+        reprojectPending = true;
+    }
+    if (dev_history) {
+        cudaMemset(dev_history, 0, pixelcount * sizeof(glm::vec4));
+    }
+    gbufferPending = true;
+    imageIterations = 0;
+
+    cudaMemset(dev_image, 0, pixelcount * sizeof(glm::vec3));
+    imageOnHost = false;
+    firstBounceCached = false;
+    if (dev_pixelVariance) {
+        cudaMemset(dev_pixelVariance, 0, pixelcount * sizeof(PixelVariance));
+    }
+    samplingPixels = pixelcount;
+
+    checkCUDAError("pathtraceResetImage");
+}
+
+bool pathtraceConverged() {
+    if (backend == BACKEND_CPU) {
+        return pathtraceCpuConverged();
+    }
+    if (!dev_pixelVariance) {
+        return false;
+    }
+    const Camera &cam = hst_scene->state.camera;
+    return adaptiveConverged(samplingPixels, cam.resolution.x * cam.resolution.y);
+}
+
+void pathtraceGetVariance(std::vector<PixelVariance> &variance) {
+    if (backend == BACKEND_CPU) {
+        pathtraceCpuGetVariance(variance);
+        return;
+    }
+    if (!dev_pixelVariance) {
+        variance.clear();
+        return;
+    }
+    const Camera &cam = hst_scene->state.camera;
+    variance.resize(cam.resolution.x * cam.resolution.y);
+    cudaMemcpy(variance.data(), dev_pixelVariance, variance.size() * sizeof(PixelVariance), cudaMemcpyDeviceToHost);
+    checkCUDAError("pathtraceGetVariance");
+}
+
+void pathtraceRestore(const std::vector<glm::vec3> &image, const std::vector<PixelVariance> &variance) {
+    if (backend == BACKEND_CPU) {
+        pathtraceCpuRestore(image, variance);
+        return;
+    }
+    hst_scene->state.image = image;
+    cudaMemcpy(dev_image, image.data(), image.size() * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+    imageOnHost = true;
+    const Camera &cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    if (dev_pixelVariance && (int)variance.size() == pixelcount) {
+        cudaMemcpy(dev_pixelVariance, variance.data(), pixelcount * sizeof(PixelVariance), cudaMemcpyHostToDevice);
+        samplingPixels = thrust::count_if(thrust::device, dev_pixelVariance, dev_pixelVariance + pixelcount,
+            stillSampling());
+    }
+    checkCUDAError("pathtraceRestore");
+}
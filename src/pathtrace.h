@@ -3,12 +3,95 @@
 #include <vector>
 #include "scene.h"
 
-#define COMPACT 0
-#define SORTING 0
-#define CACHING 0
-#define TIMING 0
-#define SORTTIMING 0
+/**
+ * Where pathtrace() runs. BACKEND_CPU executes the same stages on a
+ * work-stealing thread pool and needs no CUDA device; its `pbo` argument is
+ * a host pointer (or NULL).
+ */
+enum RenderBackend {
+    BACKEND_CUDA,
+    BACKEND_CPU
+};
+
+// Must be called before pathtraceInit(). numThreads <= 0 uses every core.
+void pathtraceSetBackend(RenderBackend backend, int numThreads = 0);
+RenderBackend pathtraceGetBackend();
+
+/**
+ * Pipeline stages timed by PathtraceStats. The CPU backend traces each tile
+ * a bounce at a time, dropping finished paths from the tile's live list, and
+ * reports the whole pass as STAGE_TILES; its generation, intersection,
+ * shading and gathering stages split that time by the share each took on the
+ * worker threads. It never sorts.
+ * STAGE_DENOISE covers every filter level of the frames shown and of
+ * pathtraceDenoise().
+ */
+enum PathtraceStage {
+    STAGE_GENERATE,
+    STAGE_INTERSECT,
+    STAGE_SORT,
+    STAGE_SHADE,
+    STAGE_COMPACT,
+    STAGE_GATHER,
+    STAGE_TILES,
+    STAGE_DENOISE,
+    NUM_PATHTRACE_STAGES
+};
+
+// Lower-case stage name, e.g. "intersect", for reports.
+const char *pathtraceStageName(int stage);
+
+/**
+ * Measurements summed over every pathtrace() call made while the struct is
+ * registered with pathtraceSetStats(). Every timed stage waits for the device
+ * before its timer stops, so recording costs a little throughput.
+ */
+struct PathtraceStats {
+    int iterations;
+    double stageMs[NUM_PATHTRACE_STAGES];
+    // activePaths[d] is the number of paths still alive when bounce d is traced
+    std::vector<long long> activePaths;
+
+    PathtraceStats() : iterations(0), stageMs() {}
+};
+
+// Starts recording into `stats`; NULL stops recording.
+void pathtraceSetStats(PathtraceStats *stats);
 
 void pathtraceInit(Scene *scene);
 void pathtraceFree();
+
+// Starts the image over after RenderState::camera moved. The scene stays on
+// the device; only the samples and the per-pixel state built from them (the
+// first-bounce cache and adaptive sampling) are cleared.
+void pathtraceResetImage();
 void pathtrace(uchar4 *pbo, int frame, int iteration);
+
+// Renders one sample per pixel of previewCamera(camera, stride), for the
+// frames shown while the camera moves, and stretches it over `pbo`. Leaves
+// the accumulated image and its per-pixel state alone.
+void pathtracePreview(uchar4 *pbo, int stride);
+
+// Brings RenderState::image up to date with the iterations rendered so far.
+// pathtrace() leaves the CUDA backend's image on the device, so call this
+// before reading it; it copies only if an iteration ran since the last call.
+// The CPU backend accumulates into RenderState::image itself.
+void pathtraceReadImage();
+
+// Denoised mean color of every pixel of the image so far, for saving it; see
+// denoise.h. Temporal history is left out, as in the accumulated image.
+// Returns false, leaving `image` alone, with the denoise option off or
+// before the first iteration of the view.
+bool pathtraceDenoise(std::vector<glm::vec3> &image);
+
+// True once adaptive sampling has met its error threshold, so rendering more
+// iterations would only touch a few stragglers. Always false with it off.
+bool pathtraceConverged();
+
+// Adaptive sampling state of every pixel, for checkpoints. Empty with it off.
+void pathtraceGetVariance(std::vector<PixelVariance> &variance);
+
+// Replaces the accumulated image and, with adaptive sampling, its state by a
+// checkpoint's, so the next pathtrace() call adds to them. Call right after
+// pathtraceInit().
+void pathtraceRestore(const std::vector<glm::vec3> &image, const std::vector<PixelVariance> &variance);
@@ -0,0 +1,662 @@
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <cuda_runtime.h>
+
+#include "pathtrace.h"
+#include "pathtraceCpu.h"
+#include "pathtraceStages.h"
+#include "profiler.h"
+#include "sampler.h"
+#include "threadPool.h"
+
+// Tiles are the unit of work handed to the pool. 16x16 pixels is large
+// enough to amortize scheduling and small enough to balance the cost spikes
+// of refractive objects and implicit surfaces.
+#define TILE_SIZE 16
+// Pixels of a row the denoiser filters at a time; see atrousRow()
+#define DENOISE_SPAN 64
+
+static Scene * hst_scene = NULL;
+static WorkStealingPool * pool = NULL;
+static std::vector<ShadeableIntersection> first_intersections;
+// set once an iteration has filled first_intersections
+static bool firstBounceCached = false;
+// adaptive sampling only; empty when it is off
+static std::vector<PixelVariance> pixelVariance;
+// blue-noise sampler only; empty otherwise
+static std::vector<glm::vec2> blueNoise;
+static int samplingPixels = 0;
+// temporal reprojection and denoising; empty when both are off. Each
+// G-buffer and history has a copy for the current view and one for the
+// previous view, but only temporal reprojection uses the previous view's and
+// the histories.
+static std::vector<GBufferPixel> gbuffer;
+static std::vector<GBufferPixel> prevGBuffer;
+static std::vector<glm::vec4> history;
+static std::vector<glm::vec4> prevHistory;
+// camera gbuffer was recorded with, and then prevGBuffer's once a camera
+// move swaps them
+static Camera gbufferCamera;
+// the next iteration records gbuffer, and then reprojects prevHistory
+static bool gbufferPending = false;
+static bool reprojectPending = false;
+// iterations in the image, for handing it on to the next view
+static int imageIterations = 0;
+// preview frames only; one sample of each preview pixel, apart from the image
+static std::vector<glm::vec3> previewImage;
+
+/**
+ * The denoiser's per-pixel inputs as planes of one float each, so its loops
+ * over a row read every one of them contiguously and vectorize. Filled by
+ * prepareDenoise(); empty when denoising is off.
+ */
+struct DenoisePlanes {
+    std::vector<float> color[2][3];     // filter input and output of a level, swapped after each
+    std::vector<float> position[3];
+    std::vector<float> normal[3];
+    std::vector<float> hit;             // 1 where the camera ray hit, 0 where it missed
+    std::vector<float> colorScale;      // denoiseColorScale() at level 0
+    std::vector<float> planeScale;      // denoisePlaneScale()
+};
+static DenoisePlanes denoisePlanes;
+// denoising only; the denoised image of the last frame shown
+static std::vector<glm::vec3> denoisedImage;
+static std::mutex iterationCountsMutex;
+
+/**
+ * Per-bounce measurements of one iteration, summed over every tile: the
+ * paths alive when each bounce starts and the thread time spent in each
+ * stage, read off the clock after every stage of a tile.
+ */
+struct IterationCounts {
+    std::vector<long long> activePaths;
+    long long generateNs;
+    std::vector<long long> intersectNs;     // per bounce, with G-buffer recording
+    std::vector<long long> shadeNs;         // per bounce
+    long long gatherNs;
+
+    IterationCounts(int traceDepth) : activePaths(traceDepth, 0), generateNs(0),
+        intersectNs(traceDepth, 0), shadeNs(traceDepth, 0), gatherNs(0) {}
+};
+
+// Nanoseconds since `last`, which moves on to now
+static long long lapNs(std::chrono::steady_clock::time_point &last) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+    last = now;
+    return ns;
+}
+
+void pathtraceCpuInit(Scene *scene, int numThreads) {
+    hst_scene = scene;
+
+    // accumulate straight into the host image; nothing to copy back
+    std::fill(hst_scene->state.image.begin(), hst_scene->state.image.end(), glm::vec3());
+
+    const Camera &cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    if (hst_scene->state.options.caching) {
+        first_intersections.resize(pixelcount);
+    }
+    firstBounceCached = false;
+    if (hst_scene->state.options.adaptive > 0.0f) {
+        pixelVariance.assign(pixelcount, PixelVariance());
+    }
+    samplingPixels = pixelcount;
+    if (hst_scene->state.options.sampler == SAMPLER_BLUE_NOISE) {
+        sampler::buildBlueNoise(blueNoise);
+    }
+    if (hst_scene->state.options.temporal || hst_scene->state.options.denoise > 0) {
+        gbuffer.resize(pixelcount);
+    }
+    if (hst_scene->state.options.temporal) {
+        prevGBuffer.resize(pixelcount);
+        history.assign(pixelcount, glm::vec4(0.0f));
+        prevHistory.resize(pixelcount);
+    }
+    if (hst_scene->state.options.denoise > 0) {
+        std::vector<float> *planes[] = {
+            &denoisePlanes.color[0][0], &denoisePlanes.color[0][1], &denoisePlanes.color[0][2],
+            &denoisePlanes.color[1][0], &denoisePlanes.color[1][1], &denoisePlanes.color[1][2],
+            &denoisePlanes.position[0], &denoisePlanes.position[1], &denoisePlanes.position[2],
+            &denoisePlanes.normal[0], &denoisePlanes.normal[1], &denoisePlanes.normal[2],
+            &denoisePlanes.hit, &denoisePlanes.colorScale, &denoisePlanes.planeScale
+        };
+        for (size_t i = 0; i < sizeof(planes) / sizeof(planes[0]); i++) {
+            planes[i]->resize(pixelcount);
+        }
+    }
+    gbufferPending = true;
+    reprojectPending = false;
+    imageIterations = 0;
+
+    pool = new WorkStealingPool(numThreads);
+    printf("CPU backend: %d threads\n", pool->size());
+}
+
+void pathtraceCpuResetImage() {
+    std::vector<glm::vec3> &image = hst_scene->state.image;
+    if (!history.empty() && !gbufferPending) {
+        // the old view's G-buffer is complete: keep it and its image for
+        // reprojecting into the new view. Without a new iteration since the
+        // last move, the history from before that move is still waiting.
+        for (size_t i = 0; i < image.size(); i++) {
+            prevHistory[i] = historyForNextView(image[i], imageIterations, history[i]);
+        }
+        gbuffer.swap(prevGBuffer);
+        reprojectPending = true;
+    }
+    std::fill(history.begin(), history.end(), glm::vec4(0.0f));
+    gbufferPending = true;
+    imageIterations = 0;
+
+    std::fill(image.begin(), image.end(), glm::vec3());
+    firstBounceCached = false;
+    if (!pixelVariance.empty()) {
+        pixelVariance.assign(pixelVariance.size(), PixelVariance());
+    }
+    samplingPixels = (int)hst_scene->state.image.size();
+}
+
+void pathtraceCpuFree() {
+    delete pool;  // no-op if pool is null
+    pool = NULL;
+    first_intersections.clear();
+    pixelVariance.clear();
+    blueNoise.clear();
+    gbuffer.clear();
+    prevGBuffer.clear();
+    history.clear();
+    prevHistory.clear();
+    previewImage.clear();
+    denoisePlanes = DenoisePlanes();
+    denoisedImage.clear();
+}
+
+/**
+ * What traceTile() renders: the camera, which may be a preview camera, and
+ * the buffers its pixels fill.
+ */
+struct TileTarget {
+    Camera cam;
+    glm::vec3 *image;
+    PixelVariance *variance;    // adaptive sampling only
+    GBufferPixel *gbuffer;      // only when this iteration records it
+};
+
+/**
+ * Traces every pixel of one tile through all bounces, a bounce at a time,
+ * leaving finished paths out of the next. Mirrors the CUDA pipeline;
+ * random numbers are keyed by pixel, so the result matches it whether or
+ * not that compacts or sorts. Adds the paths alive at each bounce and the
+ * time of each stage to `counts` unless it is NULL. With adaptive sampling,
+ * converged pixels are skipped.
+ */
+template<bool Caching>
+static void traceTile(int tile, int iter, const TileTarget &target, IterationCounts *counts) {
+    profiler::Scope scope("tile", iter);
+    const Camera &cam = target.cam;
+    const int traceDepth = hst_scene->state.traceDepth;
+    SceneView scene;
+    scene.numInstances = hst_scene->instances.size();
+    scene.instRow0 = hst_scene->instRow0.data();
+    scene.instRow1 = hst_scene->instRow1.data();
+    scene.instRow2 = hst_scene->instRow2.data();
+    scene.instBlasId = hst_scene->instBlasId.data();
+    scene.instMaterialId = hst_scene->instMaterialId.data();
+    scene.blases = hst_scene->blases.data();
+    scene.tlasNodes = hst_scene->tlasNodes.data();
+    scene.blasNodes = hst_scene->blasNodes.data();
+    scene.triV0 = hst_scene->triV0.data();
+    scene.triV1 = hst_scene->triV1.data();
+    scene.triV2 = hst_scene->triV2.data();
+    scene.vertX = hst_scene->vertX.data();
+    scene.vertY = hst_scene->vertY.data();
+    scene.vertZ = hst_scene->vertZ.data();
+    LightView lights;
+    lights.numLights = hst_scene->lights.size();
+    lights.lights = hst_scene->lights.data();
+    lights.instLightId = hst_scene->instLightId.data();
+    SamplerView sampler;
+    sampler.type = hst_scene->state.options.sampler;
+    sampler.samplesPerPixel = hst_scene->state.iterations;
+    sampler.width = cam.resolution.x;
+    sampler.blueNoise = blueNoise.empty() ? NULL : blueNoise.data();
+    const bool nee = hst_scene->state.options.nee;
+    const bool roulette = hst_scene->state.options.roulette;
+    const float threshold = hst_scene->state.options.adaptive;
+    PixelVariance *variance = target.variance;
+    const Material *materials = hst_scene->materials.data();
+    const glm::mat3 *normalMatrices = hst_scene->instNormalMatrix.data();
+    glm::vec3 *image = target.image;
+    GBufferPixel *recordGBuffer = target.gbuffer;
+
+    const int tilesX = (cam.resolution.x + TILE_SIZE - 1) / TILE_SIZE;
+    const int x0 = (tile % tilesX) * TILE_SIZE;
+    const int y0 = (tile / tilesX) * TILE_SIZE;
+    const int x1 = std::min(x0 + TILE_SIZE, cam.resolution.x);
+    const int y1 = std::min(y0 + TILE_SIZE, cam.resolution.y);
+
+    // counted per tile so the shared counts are locked once per tile
+    IterationCounts tileCounts(counts ? traceDepth : 0);
+    std::chrono::steady_clock::time_point last;
+    if (counts) {
+        last = std::chrono::steady_clock::now();
+    }
+
+    // the tile's paths, traced a bounce at a time like the CUDA pipeline's,
+    // so timing reads the clock per stage rather than per path; `live` lists
+    // the ones still bouncing
+    PathSegment segments[TILE_SIZE * TILE_SIZE];
+    ShadeableIntersection intersections[TILE_SIZE * TILE_SIZE];
+    int live[TILE_SIZE * TILE_SIZE];
+    int numPaths = 0;
+    int numLive = 0;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            const int index = x + (y * cam.resolution.x);
+            PathSegment &segment = segments[numPaths];
+            generateCameraRay(cam, iter, traceDepth, x, y, !Caching, sampler, segment);
+            if (variance && skipConvergedPixel(variance[index], image[index], iter, segment)) {
+                image[index] += segment.color;
+                continue;
+            }
+            live[numLive++] = numPaths++;
+        }
+    }
+    if (counts) {
+        tileCounts.generateNs += lapNs(last);
+    }
+
+    for (int depth = 0; depth < traceDepth && numLive > 0; ) {
+        const int bounce = depth;
+        if (counts) {
+            tileCounts.activePaths[bounce] += numLive;
+        }
+        for (int i = 0; i < numLive; i++) {
+            PathSegment &segment = segments[live[i]];
+            ShadeableIntersection &intersection = intersections[live[i]];
+            const int index = segment.pixelIndex;
+            if (Caching && depth == 0 && firstBounceCached) {
+                intersection = first_intersections[index];
+            } else {
+                computePathIntersection(segment, scene, intersection);
+                if (Caching && depth == 0) {
+                    first_intersections[index] = intersection;
+                }
+            }
+            if (depth == 0 && recordGBuffer) {
+                recordGBuffer[index] = makeGBufferPixel(segment, intersection, materials, normalMatrices);
+            }
+        }
+        depth++;
+        if (counts) {
+            tileCounts.intersectNs[bounce] += lapNs(last);
+        }
+
+        int stillLive = 0;
+        for (int i = 0; i < numLive; i++) {
+            PathSegment &segment = segments[live[i]];
+            if (nee) {
+                shadePathSegmentNEE(iter, depth, intersections[live[i]], segment,
+                    materials, normalMatrices, scene, lights, sampler, roulette);
+            } else {
+                shadePathSegment(iter, depth, intersections[live[i]], segment,
+                    materials, normalMatrices, sampler, roulette);
+            }
+            if (segment.remainingBounces > 0) {
+                live[stillLive++] = live[i];
+            }
+        }
+        numLive = stillLive;
+        if (counts) {
+            tileCounts.shadeNs[bounce] += lapNs(last);
+        }
+    }
+
+    for (int i = 0; i < numPaths; i++) {
+        const PathSegment &segment = segments[i];
+        image[segment.pixelIndex] += segment.color;
+        if (variance) {
+            accumulatePixelVariance(variance[segment.pixelIndex], segment.color, iter, threshold);
+        }
+    }
+    if (counts) {
+        tileCounts.gatherNs += lapNs(last);
+    }
+
+    if (counts) {
+        std::lock_guard<std::mutex> lock(iterationCountsMutex);
+        counts->generateNs += tileCounts.generateNs;
+        counts->gatherNs += tileCounts.gatherNs;
+        for (int d = 0; d < traceDepth; d++) {
+            counts->activePaths[d] += tileCounts.activePaths[d];
+            counts->intersectNs[d] += tileCounts.intersectNs[d];
+            counts->shadeNs[d] += tileCounts.shadeNs[d];
+        }
+    }
+}
+
+/**
+ * One A-Trous level of row y: atrousPixel() for every pixel of the row, from
+ * color set `src` of denoisePlanes into the other. The row goes in spans of
+ * DENOISE_SPAN pixels whose sums stay on the stack, so the only memory the
+ * loops write cannot alias their inputs. Each tap is a pass over the span
+ * that leaves out the pixels whose neighbor falls off the image, so the loop
+ * has no branches and vectorizes.
+ */
+static void atrousRow(int y, int level, int src, glm::ivec2 resolution) {
+    const int width = resolution.x;
+    const int row = y * width;
+    const int step = 1 << level;
+    const float levelScale = (float)(1 << (2 * level));
+    const float normalScale = 1.0f / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL);
+    DenoisePlanes &d = denoisePlanes;
+    // offset to the row, so index x is the pixel and x + offset its neighbor
+    const float *r = d.color[src][0].data() + row;
+    const float *g = d.color[src][1].data() + row;
+    const float *b = d.color[src][2].data() + row;
+    const float *px = d.position[0].data() + row;
+    const float *py = d.position[1].data() + row;
+    const float *pz = d.position[2].data() + row;
+    const float *nx = d.normal[0].data() + row;
+    const float *ny = d.normal[1].data() + row;
+    const float *nz = d.normal[2].data() + row;
+    const float *hit = d.hit.data() + row;
+    const float *colorScale = d.colorScale.data() + row;
+    const float *planeScale = d.planeScale.data() + row;
+    float *outR = d.color[1 - src][0].data() + row;
+    float *outG = d.color[1 - src][1].data() + row;
+    float *outB = d.color[1 - src][2].data() + row;
+
+    for (int x0 = 0; x0 < width; x0 += DENOISE_SPAN) {
+        const int x1 = std::min(x0 + DENOISE_SPAN, width);
+        float sumR[DENOISE_SPAN] = {};
+        float sumG[DENOISE_SPAN] = {};
+        float sumB[DENOISE_SPAN] = {};
+        float sumW[DENOISE_SPAN] = {};
+
+        for (int dy = -2; dy <= 2; dy++) {
+            const int yq = y + dy * step;
+            if (yq < 0 || yq >= resolution.y) {
+                continue;
+            }
+            for (int dx = -2; dx <= 2; dx++) {
+                const int offset = (yq - y) * width + dx * step;
+                const float kernel = atrousKernel(dx < 0 ? -dx : dx) * atrousKernel(dy < 0 ? -dy : dy);
+                const int begin = std::max(x0, -dx * step);
+                const int end = std::min(x1, width - dx * step);
+                for (int x = begin; x < end; x++) {
+                    const int q = x + offset;
+                    const float dr = r[q] - r[x];
+                    const float dg = g[q] - g[x];
+                    const float db = b[q] - b[x];
+                    const float dnx = nx[q] - nx[x];
+                    const float dny = ny[q] - ny[x];
+                    const float dnz = nz[q] - nz[x];
+                    const float dp = (px[q] - px[x]) * nx[x] + (py[q] - py[x]) * ny[x] + (pz[q] - pz[x]) * nz[x];
+                    const float w = kernel * (1.0f - fabsf(hit[q] - hit[x]))
+                        * edgeStop((dr * dr + dg * dg + db * db) * (colorScale[x] * levelScale)
+                            + (dnx * dnx + dny * dny + dnz * dnz) * normalScale + dp * dp * planeScale[x]);
+                    sumR[x - x0] += w * r[q];
+                    sumG[x - x0] += w * g[q];
+                    sumB[x - x0] += w * b[q];
+                    sumW[x - x0] += w;
+                }
+            }
+        }
+
+        // the center tap always counts, so sumW > 0
+        for (int x = x0; x < x1; x++) {
+            outR[x] = sumR[x - x0] / sumW[x - x0];
+            outG[x] = sumG[x - x0] / sumW[x - x0];
+            outB[x] = sumB[x - x0] / sumW[x - x0];
+        }
+    }
+}
+
+/**
+ * Denoises the image of `iter` iterations into `out`, blending in the
+ * temporal history if `withHistory`. Mirrors denoiseImage() in pathtrace.cu
+ * with the filter input in denoisePlanes, a row per task.
+ */
+static void denoiseImage(int iter, bool withHistory, std::vector<glm::vec3> &out, PathtraceStats *stats) {
+    using time_point_t = std::chrono::high_resolution_clock::time_point;
+    time_point_t startTime = std::chrono::high_resolution_clock::now();
+    const Camera &cam = hst_scene->state.camera;
+    const glm::ivec2 resolution = cam.resolution;
+    const glm::vec3 *image = hst_scene->state.image.data();
+    DenoisePlanes &d = denoisePlanes;
+
+    pool->parallelFor(resolution.y, [&](int y) {
+        for (int i = y * resolution.x; i < (y + 1) * resolution.x; i++) {
+            const GBufferPixel &pixel = gbuffer[i];
+            glm::vec4 h = withHistory && !history.empty() ? history[i] : glm::vec4(0.0f);
+            glm::vec4 input = denoiseInput(image[i] + glm::vec3(h) * h.w, iter + h.w, pixel);
+            for (int c = 0; c < 3; c++) {
+                d.color[0][c][i] = input[c];
+                d.position[c][i] = pixel.position[c];
+                d.normal[c][i] = pixel.normal[c];
+            }
+            d.hit[i] = pixel.materialId >= 0 ? 1.0f : 0.0f;
+            d.colorScale[i] = denoiseColorScale(input.w, 0);
+            d.planeScale[i] = denoisePlaneScale(pixel, cam.position);
+        }
+    });
+
+    int src = 0;
+    for (int level = 0; level < hst_scene->state.options.denoise; level++) {
+        profiler::Scope scope(pathtraceStageName(STAGE_DENOISE), iter, level);
+        pool->parallelFor(resolution.y, [level, src, resolution](int y) {
+            atrousRow(y, level, src, resolution);
+        });
+        src = 1 - src;
+    }
+
+    out.resize(gbuffer.size());
+    pool->parallelFor(resolution.y, [&](int y) {
+        for (int i = y * resolution.x; i < (y + 1) * resolution.x; i++) {
+            glm::vec4 filtered(d.color[src][0][i], d.color[src][1][i], d.color[src][2][i], 0.0f);
+            out[i] = denoiseOutput(filtered, gbuffer[i]);
+        }
+    });
+
+    if (stats) {
+        std::chrono::duration<double, std::milli> dur = std::chrono::high_resolution_clock::now() - startTime;
+        stats->stageMs[STAGE_DENOISE] += dur.count();
+    }
+}
+
+/**
+ * Splits `wallMs`, the wall time of an iteration's tiles, among the stages
+ * in proportion to the thread time `counts` gives each. The stages then add
+ * up to STAGE_TILES at any thread count, like the CUDA backend's. Adds them
+ * to `stats` unless it is NULL and, while profiling, records one span per
+ * stage and bounce, laid end to end inside the tiles span from `startUs`.
+ */
+static void reportStageTimes(const IterationCounts &counts, int iter, double startUs, double wallMs,
+        PathtraceStats *stats) {
+    const int traceDepth = counts.activePaths.size();
+    long long totalNs = counts.generateNs + counts.gatherNs;
+    for (int d = 0; d < traceDepth; d++) {
+        totalNs += counts.intersectNs[d] + counts.shadeNs[d];
+    }
+    if (totalNs == 0) {
+        return;
+    }
+    const double msPerNs = wallMs / totalNs;
+    const bool profiling = profiler::enabled();
+    const int track = profiling ? profiler::threadTrack() : 0;
+    double us = startUs;
+    // one stage of one bounce, -1 for the per-pixel stages
+    auto report = [&](PathtraceStage stage, int depth, long long ns) {
+        const double ms = ns * msPerNs;
+        if (stats) {
+            stats->stageMs[stage] += ms;
+        }
+        if (profiling) {
+            profiler::span(pathtraceStageName(stage), track, us, us + ms * 1e3, iter, depth);
+            us += ms * 1e3;
+        }
+    };
+    report(STAGE_GENERATE, -1, counts.generateNs);
+    for (int d = 0; d < traceDepth; d++) {
+        report(STAGE_INTERSECT, d, counts.intersectNs[d]);
+        report(STAGE_SHADE, d, counts.shadeNs[d]);
+    }
+    report(STAGE_GATHER, -1, counts.gatherNs);
+}
+
+void pathtraceCpu(uchar4 *pbo, int frame, int iter, PathtraceStats *stats) {
+    const Camera &cam = hst_scene->state.camera;
+    const int tilesX = (cam.resolution.x + TILE_SIZE - 1) / TILE_SIZE;
+    const int tilesY = (cam.resolution.y + TILE_SIZE - 1) / TILE_SIZE;
+
+    const int traceDepth = hst_scene->state.traceDepth;
+    const bool profiling = profiler::enabled();
+    IterationCounts iterationCounts(traceDepth);
+    IterationCounts *counts = stats || profiling ? &iterationCounts : NULL;
+    const std::vector<long long> &activePaths = iterationCounts.activePaths;
+
+    using time_point_t = std::chrono::high_resolution_clock::time_point;
+    time_point_t startTime = std::chrono::high_resolution_clock::now();
+    double startUs = profiling ? profiler::nowUs() : 0.0;
+
+    if (gbufferPending && !gbuffer.empty()) {
+        // pixels adaptive sampling skips see nothing
+        GBufferPixel miss = GBufferPixel();
+        miss.materialId = -1;
+        std::fill(gbuffer.begin(), gbuffer.end(), miss);
+    }
+
+    TileTarget target;
+    target.cam = cam;
+    target.image = hst_scene->state.image.data();
+    target.variance = pixelVariance.empty() ? NULL : pixelVariance.data();
+    target.gbuffer = gbufferPending && !gbuffer.empty() ? gbuffer.data() : NULL;
+    if (hst_scene->state.options.caching) {
+        pool->parallelFor(tilesX * tilesY, [iter, &target, counts](int tile) {
+            traceTile<true>(tile, iter, target, counts);
+        });
+    } else {
+        pool->parallelFor(tilesX * tilesY, [iter, &target, counts](int tile) {
+            traceTile<false>(tile, iter, target, counts);
+        });
+    }
+    firstBounceCached = hst_scene->state.options.caching;
+
+    std::chrono::duration<double, std::milli> tilesMs = std::chrono::high_resolution_clock::now() - startTime;
+    if (profiling) {
+        profiler::span(pathtraceStageName(STAGE_TILES), profiler::threadTrack(),
+            startUs, profiler::nowUs(), iter, -1);
+        for (int d = 0; d < traceDepth; d++) {
+            profiler::counter("activePaths", startUs, iter, d, activePaths[d]);
+        }
+    }
+    if (counts) {
+        reportStageTimes(iterationCounts, iter, startUs, tilesMs.count(), stats);
+    }
+    if (stats) {
+        stats->stageMs[STAGE_TILES] += tilesMs.count();
+        stats->iterations++;
+        if ((int)stats->activePaths.size() < traceDepth) {
+            stats->activePaths.resize(traceDepth, 0);
+        }
+        for (int d = 0; d < traceDepth; d++) {
+            stats->activePaths[d] += activePaths[d];
+        }
+    }
+
+    // after every tile, since a pixel's convergence depends on its neighbors
+    if (!pixelVariance.empty()) {
+        samplingPixels = 0;
+        for (int y = 0; y < cam.resolution.y; y++) {
+            for (int x = 0; x < cam.resolution.x; x++) {
+                updatePixelConvergence(pixelVariance.data(), x, y, cam.resolution, iter);
+                samplingPixels += pixelVariance[x + y * cam.resolution.x].convergedAt == 0;
+            }
+        }
+    }
+
+    imageIterations = iter;
+    if (gbufferPending && !gbuffer.empty()) {
+        if (reprojectPending) {
+            for (size_t i = 0; i < gbuffer.size(); i++) {
+                history[i] = reprojectPixel(gbuffer[i], gbufferCamera, prevGBuffer.data(), prevHistory.data());
+            }
+            reprojectPending = false;
+        }
+        gbufferCamera = cam;
+        gbufferPending = false;
+    }
+
+    // Send results to the (host-mapped) OpenGL buffer for rendering
+    if (pbo && hst_scene->state.options.denoise > 0) {
+        denoiseImage(iter, true, denoisedImage, stats);
+        for (size_t i = 0; i < denoisedImage.size(); i++) {
+            writePBOPixel(pbo, i, denoisedImage[i], 1.0f);
+        }
+    } else if (pbo) {
+        const glm::vec3 *image = hst_scene->state.image.data();
+        const int pixelcount = cam.resolution.x * cam.resolution.y;
+        for (int i = 0; i < pixelcount; i++) {
+            glm::vec4 h = history.empty() ? glm::vec4(0.0f) : history[i];
+            writePBOPixel(pbo, i, image[i] + glm::vec3(h) * h.w, iter + h.w);
+        }
+    }
+}
+
+void pathtraceCpuPreview(uchar4 *pbo, int stride) {
+    const Camera &cam = hst_scene->state.camera;
+    // one sample per preview pixel, without the full-resolution image's
+    // first-bounce cache, adaptive sampling or G-buffer
+    TileTarget target;
+    target.cam = previewCamera(cam, stride);
+    previewImage.assign(target.cam.resolution.x * target.cam.resolution.y, glm::vec3());
+    target.image = previewImage.data();
+    target.variance = NULL;
+    target.gbuffer = NULL;
+
+    const int tilesX = (target.cam.resolution.x + TILE_SIZE - 1) / TILE_SIZE;
+    const int tilesY = (target.cam.resolution.y + TILE_SIZE - 1) / TILE_SIZE;
+    pool->parallelFor(tilesX * tilesY, [&target](int tile) {
+        traceTile<false>(tile, 1, target, NULL);
+    });
+
+    if (pbo) {
+        for (int y = 0; y < cam.resolution.y; y++) {
+            for (int x = 0; x < cam.resolution.x; x++) {
+                glm::vec3 color = upsamplePreview(previewImage.data(), target.cam.resolution, stride, x, y);
+                writePBOPixel(pbo, x + y * cam.resolution.x, color, 1.0f);
+            }
+        }
+    }
+}
+
+bool pathtraceCpuDenoise(std::vector<glm::vec3> &image, PathtraceStats *stats) {
+    if (hst_scene->state.options.denoise <= 0 || gbufferPending) {
+        return false;
+    }
+    denoiseImage(imageIterations, false, image, stats);
+    return true;
+}
+
+bool pathtraceCpuConverged() {
+    return !pixelVariance.empty() && adaptiveConverged(samplingPixels, pixelVariance.size());
+}
+
+void pathtraceCpuGetVariance(std::vector<PixelVariance> &variance) {
+    variance = pixelVariance;
+}
+
+void pathtraceCpuRestore(const std::vector<glm::vec3> &image, const std::vector<PixelVariance> &variance) {
+    hst_scene->state.image = image;
+    if (!pixelVariance.empty() && variance.size() == pixelVariance.size()) {
+        pixelVariance = variance;
+        samplingPixels = 0;
+        for (size_t i = 0; i < pixelVariance.size(); i++) {
+            samplingPixels += pixelVariance[i].convergedAt == 0;
+        }
+    }
+}
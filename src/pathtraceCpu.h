@@ -0,0 +1,17 @@
+#pragma once
+
+#include "pathtrace.h"
+
+/**
+ * CPU implementation of the pathtrace() pipeline, selected at runtime with
+ * pathtraceSetBackend(BACKEND_CPU). Not meant to be called directly.
+ */
+void pathtraceCpuInit(Scene *scene, int numThreads);
+void pathtraceCpuFree();
+void pathtraceCpuResetImage();
+void pathtraceCpu(uchar4 *pbo, int frame, int iteration, PathtraceStats *stats);
+void pathtraceCpuPreview(uchar4 *pbo, int stride);
+bool pathtraceCpuDenoise(std::vector<glm::vec3> &image, PathtraceStats *stats);
+bool pathtraceCpuConverged();
+void pathtraceCpuGetVariance(std::vector<PixelVariance> &variance);
+void pathtraceCpuRestore(const std::vector<glm::vec3> &image, const std::vector<PixelVariance> &variance);
@@ -0,0 +1,510 @@
+#pragma once
+
+#include <cfloat>
+#include <thrust/random.h>
+
+#include "sceneStructs.h"
+#include "intersections.h"
+#include "interactions.h"
+#include "lights.h"
+#include "sampler.h"
+#include "temporal.h"
+#include "denoise.h"
+
+// First bounce at which Russian roulette may end a path
+#define ROULETTE_MIN_DEPTH 3
+
+// Samples a pixel takes before adaptive sampling may call it converged
+#define ADAPTIVE_MIN_SAMPLES 16
+// Neighborhood that must be below the error threshold with a pixel
+#define ADAPTIVE_RADIUS 2
+// Mean luminance below which adaptive sampling stops relaxing its error bound
+#define ADAPTIVE_MIN_MEAN 0.05f
+// Fraction of pixels allowed to still be sampling when the render stops
+#define ADAPTIVE_STRAGGLERS 0.01f
+
+// Low bits of a material sort key that hold the ray direction's octant
+#define SORT_DIRECTION_BITS 3
+
+/**
+ * Per-path bodies of the pathtrace stages. The CUDA kernels in pathtrace.cu
+ * and the CPU backend in pathtraceCpu.cpp both call these, so the two
+ * backends run exactly the same math for a given pixel, depth and iteration.
+ */
+
+/**
+ * Random numbers of bounce `depth` (0 for the camera ray) of iteration
+ * `iter` in pixel `pixel`. They depend on nothing else, so a pixel's
+ * samples come out the same whatever order or place they are rendered in.
+ */
+__host__ __device__
+inline PhiloxEngine makeSeededRandomEngine(int iter, int pixel, int depth) {
+    return PhiloxEngine(pixel, iter - 1, depth);
+}
+
+/**
+ * Russian roulette: from bounce ROULETTE_MIN_DEPTH on, a path survives with
+ * probability equal to its largest throughput channel (at most 1), and
+ * survivors are divided by that probability, so the expected contribution
+ * is unchanged while dark paths stop early. Returns false if the path dies.
+ */
+__host__ __device__
+inline bool surviveRoulette(PathSegment &pathSegment, int depth, PhiloxEngine &rng) {
+    if (depth < ROULETTE_MIN_DEPTH) {
+        return true;
+    }
+    const glm::vec3 &c = pathSegment.color;
+    float survival = glm::min(glm::max(c.x, glm::max(c.y, c.z)), 1.0f);
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    if (u01(rng) >= survival) {
+        return false;
+    }
+    pathSegment.color /= survival;
+    return true;
+}
+
+/**
+ * Converts an accumulated pixel into the 8-bit PBO format used for display.
+ * `samples` is fractional when the pixel includes temporal history.
+ */
+__host__ __device__
+inline void writePBOPixel(uchar4 *pbo, int index, glm::vec3 pix, float samples) {
+    glm::ivec3 color;
+    color.x = glm::clamp((int)(pix.x / samples * 255.0), 0, 255);
+    color.y = glm::clamp((int)(pix.y / samples * 255.0), 0, 255);
+    color.z = glm::clamp((int)(pix.z / samples * 255.0), 0, 255);
+
+    // Each thread writes one pixel location in the texture (textel)
+    pbo[index].w = 0;
+    pbo[index].x = color.x;
+    pbo[index].y = color.y;
+    pbo[index].z = color.z;
+}
+
+/**
+ * `cam` with every `stride` x `stride` block of pixels merged into one, for
+ * the low-resolution frames shown while the camera moves. It sees the same
+ * view through fewer, larger pixels.
+ */
+__host__ __device__
+inline Camera previewCamera(const Camera &cam, int stride) {
+    Camera preview = cam;
+    preview.resolution = (cam.resolution + (stride - 1)) / stride;
+    preview.pixelLength = cam.pixelLength * (float)stride;
+    return preview;
+}
+
+/**
+ * Full-resolution pixel (x, y) of a preview frame rendered through
+ * previewCamera(cam, stride), interpolated bilinearly between the centers of
+ * the preview pixels.
+ */
+__host__ __device__
+inline glm::vec3 upsamplePreview(const glm::vec3 *preview, glm::ivec2 previewResolution, int stride,
+        int x, int y) {
+    float u = glm::clamp((x + 0.5f) / stride - 0.5f, 0.0f, (float)(previewResolution.x - 1));
+    float v = glm::clamp((y + 0.5f) / stride - 0.5f, 0.0f, (float)(previewResolution.y - 1));
+    int x0 = (int)u;
+    int y0 = (int)v;
+    int x1 = glm::min(x0 + 1, previewResolution.x - 1);
+    int y1 = glm::min(y0 + 1, previewResolution.y - 1);
+    float fx = u - x0;
+    float fy = v - y0;
+    glm::vec3 top = glm::mix(preview[x0 + y0 * previewResolution.x], preview[x1 + y0 * previewResolution.x], fx);
+    glm::vec3 bottom = glm::mix(preview[x0 + y1 * previewResolution.x], preview[x1 + y1 * previewResolution.x], fx);
+    return glm::mix(top, bottom, fy);
+}
+
+/**
+ * Initializes the camera ray through pixel (x, y). When `jitter` is set the
+ * ray is offset inside the pixel for antialiasing, by dimension pair 0 of
+ * the pixel's sampler.
+ */
+__host__ __device__
+inline void generateCameraRay(const Camera &cam, int iter, int traceDepth,
+        int x, int y, bool jitter, const SamplerView &sampler, PathSegment &segment) {
+    int index = x + (y * cam.resolution.x);
+
+    segment.ray.origin = cam.position;
+    segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
+
+    float xOffset = 0.0f;
+    float yOffset = 0.0f;
+    if (jitter) {
+        // use the sampler to add offset to x and y
+        PhiloxEngine rng = makeSeededRandomEngine(iter, index, 0);
+        glm::vec2 offset = PixelSampler(sampler, index, iter - 1).get2D(0, rng);
+        xOffset = offset.x;
+        yOffset = offset.y;
+    }
+
+    segment.ray.direction = glm::normalize(cam.view
+        - cam.right * cam.pixelLength.x * ((float)(x + xOffset) - (float)cam.resolution.x * 0.5f)
+        - cam.up * cam.pixelLength.y * ((float)(y + yOffset) - (float)cam.resolution.y * 0.5f)
+    );
+
+    segment.radiance = glm::vec3(0.0f);
+    segment.bsdfPdf = -1.0f;
+    segment.pixelIndex = index;
+    segment.remainingBounces = traceDepth;
+}
+
+/**
+ * Adaptive sampling: ends the camera path of a converged pixel before its
+ * first bounce. Its color is the pixel's mean so far, so the accumulated
+ * image still divides by the iteration count everywhere. Returns true if
+ * the pixel is converged.
+ */
+__host__ __device__
+inline bool skipConvergedPixel(const PixelVariance &variance, const glm::vec3 &accumulated,
+        int iter, PathSegment &segment) {
+    if (variance.convergedAt == 0) {
+        return false;
+    }
+    segment.color = accumulated / (float)(iter - 1);
+    segment.remainingBounces = 0;
+    return true;
+}
+
+/**
+ * Whether a pixel's standard error of the mean is below `threshold` times
+ * the square root of its mean, the scale of the noise an eye sees in a
+ * displayed image. Means below ADAPTIVE_MIN_MEAN count as that mean.
+ */
+__host__ __device__
+inline bool pixelBelowError(const PixelVariance &variance, int iter, float threshold) {
+    float n = (float)iter;
+    if (iter < ADAPTIVE_MIN_SAMPLES) {
+        return false;
+    }
+    float stdErr = sqrtf(variance.m2 / ((n - 1.0f) * n));
+    return stdErr < threshold * sqrtf(glm::max(variance.mean, ADAPTIVE_MIN_MEAN));
+}
+
+/**
+ * Adds iteration `iter`'s sample of a still sampling pixel to its running
+ * luminance mean and variance (Welford's update) and retests its error.
+ */
+__host__ __device__
+inline void accumulatePixelVariance(PixelVariance &variance, const glm::vec3 &sample,
+        int iter, float threshold) {
+    if (variance.convergedAt > 0) {
+        return;
+    }
+    // a sampling pixel has taken one sample in every iteration so far
+    float n = (float)iter;
+    float l = glm::dot(sample, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    float delta = l - variance.mean;
+    variance.mean += delta / n;
+    variance.m2 += delta * (l - variance.mean);
+    variance.belowError = pixelBelowError(variance, iter, threshold);
+}
+
+/**
+ * Marks pixel (x, y) converged after iteration `iter` once every pixel
+ * within ADAPTIVE_RADIUS of it is below the error threshold. A lone pixel
+ * whose few bright samples have not turned up yet looks converged by its
+ * own variance, and would otherwise freeze too dark.
+ */
+__host__ __device__
+inline void updatePixelConvergence(PixelVariance *variance, int x, int y, glm::ivec2 resolution,
+        int iter) {
+    PixelVariance &pixel = variance[x + y * resolution.x];
+    if (pixel.convergedAt > 0) {
+        return;
+    }
+    for (int dy = -ADAPTIVE_RADIUS; dy <= ADAPTIVE_RADIUS; dy++) {
+        for (int dx = -ADAPTIVE_RADIUS; dx <= ADAPTIVE_RADIUS; dx++) {
+            int nx = glm::clamp(x + dx, 0, resolution.x - 1);
+            int ny = glm::clamp(y + dy, 0, resolution.y - 1);
+            if (!variance[nx + ny * resolution.x].belowError) {
+                return;
+            }
+        }
+    }
+    pixel.convergedAt = iter;
+}
+
+/**
+ * Whether an adaptive render with `samplingPixels` of `pixelcount` pixels
+ * left unconverged has met its error threshold.
+ */
+__host__ __device__
+inline bool adaptiveConverged(int samplingPixels, int pixelcount) {
+    return samplingPixels <= (int)(pixelcount * ADAPTIVE_STRAGGLERS);
+}
+
+/**
+ * Finds the closest instance hit by `ray` before `tMax` and fills in
+ * `intersection`. t = -1 indicates no intersection. Walks the TLAS front to
+ * back, skipping every subtree whose box is entered beyond the closest hit
+ * so far.
+ */
+__host__ __device__
+inline void closestHit(const Ray &ray, const SceneView &scene, float tMax,
+        ShadeableIntersection &intersection) {
+    glm::vec3 invDir = safeInverseDirection(ray.direction);
+
+    const BVHNode *tlasNodes = scene.tlasNodes;
+
+    float t;
+    glm::vec3 normal;
+    float t_min = tMax;
+    int hit_instance_index = -1;
+    bool outside = true;
+
+    glm::vec3 tmp_normal;
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    bool visit = scene.numInstances > 0 &&
+        aabbIntersectionTest(tlasNodes[0].bboxMin, tlasNodes[0].bboxMax, ray.origin, invDir, t_min) >= 0.0f;
+
+    while (visit) {
+        const BVHNode &node = tlasNodes[nodeIndex];
+
+        if (node.count > 0) {
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                t = instanceIntersectionTest(scene, i, ray, t_min, tmp_normal, outside);
+
+                // Compute the minimum t from the intersection tests to determine what
+                // scene geometry object was hit first.
+                if (t > 0.0f && t_min > t)
+                {
+                    t_min = t;
+                    hit_instance_index = i;
+                    normal = tmp_normal;
+                }
+            }
+            nodeIndex = -1;
+        } else {
+            int left = nodeIndex + 1;
+            int right = node.leftFirst;
+            float tLeft = aabbIntersectionTest(tlasNodes[left].bboxMin, tlasNodes[left].bboxMax, ray.origin, invDir, t_min);
+            float tRight = aabbIntersectionTest(tlasNodes[right].bboxMin, tlasNodes[right].bboxMax, ray.origin, invDir, t_min);
+
+            if (tLeft >= 0.0f && tRight >= 0.0f) {
+                // descend into the nearer child first, come back for the other
+                nodeIndex = tLeft <= tRight ? left : right;
+                stack[stackSize++] = tLeft <= tRight ? right : left;
+            } else if (tLeft >= 0.0f) {
+                nodeIndex = left;
+            } else if (tRight >= 0.0f) {
+                nodeIndex = right;
+            } else {
+                nodeIndex = -1;
+            }
+        }
+
+        if (nodeIndex < 0) {
+            if (stackSize == 0) {
+                break;
+            }
+            nodeIndex = stack[--stackSize];
+        }
+    }
+
+    if (hit_instance_index == -1)
+    {
+        intersection.t = -1.0f;
+    }
+    else
+    {
+        //The ray hits something
+        intersection.t = t_min;
+        intersection.materialId = scene.instMaterialId[hit_instance_index];
+        intersection.instanceId = hit_instance_index;
+        intersection.surfaceNormal = normal;
+    }
+}
+
+/**
+ * Finds the closest instance hit by `pathSegment` and fills in `intersection`.
+ * t = -1 indicates no intersection.
+ */
+__host__ __device__
+inline void computePathIntersection(const PathSegment &pathSegment,
+        const SceneView &scene, ShadeableIntersection &intersection) {
+    closestHit(pathSegment.ray, scene, FLT_MAX, intersection);
+}
+
+/**
+ * Key that material sorting orders paths by before shading: misses first,
+ * then hits by material, then paths that already finished. With
+ * `direction`, paths of one material are further grouped by the octant of
+ * the ray that hit it. Radix sorting these 4-byte keys with path indices
+ * moves far fewer bytes than sorting the intersections themselves.
+ */
+__host__ __device__
+inline unsigned int materialSortKey(const PathSegment &pathSegment,
+        const ShadeableIntersection &intersection, bool direction) {
+    unsigned int key;
+    if (pathSegment.remainingBounces <= 0) {
+        key = 0xffffffffu >> SORT_DIRECTION_BITS;
+    } else if (intersection.t <= 0.0f) {
+        key = 0;
+    } else {
+        key = (unsigned int)intersection.materialId + 1;
+    }
+    key <<= SORT_DIRECTION_BITS;
+    if (direction) {
+        const glm::vec3 &d = pathSegment.ray.direction;
+        key |= (d.x < 0.0f ? 1u : 0u) | (d.y < 0.0f ? 2u : 0u) | (d.z < 0.0f ? 4u : 0u);
+    }
+    return key;
+}
+
+/**
+ * Next-event estimation at a diffuse point: picks a point on a light, traces
+ * a shadow ray to it and returns the radiance it reflects towards the path,
+ * weighted against BSDF sampling with the power heuristic.
+ *
+ * @param normal             World unit normal on the side the path arrived from.
+ */
+__host__ __device__
+inline glm::vec3 sampleDirectLight(const SceneView &scene, const LightView &lights,
+        glm::vec3 point, glm::vec3 normal, glm::vec3 albedo, PhiloxEngine &rng) {
+    glm::vec3 lightPoint, lightNormal;
+    int light;
+    float areaPdf = sampleLight(lights, rng, lightPoint, lightNormal, light);
+
+    glm::vec3 toLight = lightPoint - point;
+    float distance2 = glm::dot(toLight, toLight);
+    glm::vec3 wi = toLight / sqrtf(distance2);
+    float cosSurface = glm::dot(normal, wi);
+    float cosLight = -glm::dot(lightNormal, wi);
+    if (cosSurface <= 0.0f || cosLight <= 0.0f) {
+        return glm::vec3(0.0f);
+    }
+
+    // the shadow ray spans t in [0, 1]; stop short of the light itself
+    Ray shadow;
+    shadow.origin = point + .001f * wi;
+    shadow.direction = lightPoint - shadow.origin;
+    ShadeableIntersection blocker;
+    closestHit(shadow, scene, 1.0f - 1e-3f, blocker);
+    if (blocker.t > 0.0f) {
+        return glm::vec3(0.0f);
+    }
+
+    float lightPdf = areaPdf * distance2 / cosLight;
+    float bsdfPdf = cosSurface / PI;
+    return albedo / PI * lights.lights[light].emission * cosSurface
+        * powerHeuristic(lightPdf, bsdfPdf) / lightPdf;
+}
+
+/**
+ * shadePathSegment() with next-event estimation. `color` is the path
+ * throughput and `radiance` gathers light; when the path ends its color is
+ * set to its radiance, so finalGather is unchanged. Diffuse hits sample a
+ * light directly, and light then reached by the BSDF sample is weighted
+ * against that. Reflective and refractive bounces are delta distributions
+ * that light sampling cannot reach, so light found after them, or by the
+ * camera ray, counts fully.
+ */
+__host__ __device__
+inline void shadePathSegmentNEE(int iter, int depth,
+        const ShadeableIntersection &intersection, PathSegment &pathSegment,
+        const Material *materials, const glm::mat3 *normalMatrices,
+        const SceneView &scene, const LightView &lights, const SamplerView &sampler, bool roulette) {
+    if (intersection.t <= 0.0f) {
+        pathSegment.color = pathSegment.radiance;
+        pathSegment.remainingBounces = 0;
+        return;
+    }
+
+    PhiloxEngine rng = makeSeededRandomEngine(iter, pathSegment.pixelIndex, depth);
+    PixelSampler pixelSampler(sampler, pathSegment.pixelIndex, iter - 1);
+    Material material = materials[intersection.materialId];
+    glm::vec3 normal = glm::normalize(normalMatrices[intersection.instanceId] * intersection.surfaceNormal);
+    glm::vec3 dir = glm::normalize(pathSegment.ray.direction);
+
+    if (material.emittance > 0.0f) {
+        float weight = 1.0f;
+        int light = lights.instLightId[intersection.instanceId];
+        if (light >= 0 && pathSegment.bsdfPdf >= 0.0f) {
+            glm::vec3 travelled = intersection.t * pathSegment.ray.direction;
+            float cosLight = glm::max(fabsf(glm::dot(normal, dir)), 1e-6f);
+            float lightPdf = lightAreaPdf(lights.lights[light], intersection.surfaceNormal)
+                * glm::dot(travelled, travelled) / cosLight;
+            weight = powerHeuristic(pathSegment.bsdfPdf, lightPdf);
+        }
+        pathSegment.radiance += pathSegment.color * material.color * material.emittance * weight;
+        pathSegment.color = pathSegment.radiance;
+        pathSegment.remainingBounces = 0;
+        return;
+    }
+
+    glm::vec3 intersectionPoint = getPointOnRay(pathSegment.ray, intersection.t);
+    if (!material.hasReflective && !material.hasRefractive) {
+        glm::vec3 facing = glm::dot(normal, dir) < 0.0f ? normal : -normal;
+        // the last bounce's BSDF sample is never traced, so the light
+        // sample would have nothing to be weighted against
+        if (lights.numLights > 0 && pathSegment.remainingBounces > 1) {
+            pathSegment.radiance += pathSegment.color
+                * sampleDirectLight(scene, lights, intersectionPoint, facing, material.color, rng);
+        }
+        pathSegment.ray.direction = calculateRandomDirectionInHemisphere(facing, pixelSampler.get2D(depth, rng));
+        pathSegment.ray.origin = intersectionPoint + .001f * pathSegment.ray.direction;
+        pathSegment.color *= material.color;
+        pathSegment.bsdfPdf = glm::max(glm::dot(facing, pathSegment.ray.direction), 0.0f) / PI;
+    } else {
+        scatterRay(pathSegment, intersectionPoint, normal, material, rng, pixelSampler, depth);
+        pathSegment.bsdfPdf = -1.0f;
+    }
+
+    pathSegment.remainingBounces--;
+    if (roulette && pathSegment.remainingBounces > 0 && !surviveRoulette(pathSegment, depth, rng)) {
+        pathSegment.remainingBounces = 0;
+    }
+    if (pathSegment.remainingBounces == 0) {
+        pathSegment.color = pathSegment.radiance;
+    }
+}
+
+/**
+ * Shades one path segment at its intersection: lights terminate the path,
+ * other materials scatter it via the BSDF, and misses color it black. With
+ * `roulette`, scattered paths may also be ended by surviveRoulette(), which
+ * colors them black.
+ * Random numbers are keyed by the path's pixel, so the result does not
+ * depend on its slot in the path pool; the diffuse direction comes from
+ * `sampler` in dimension pair `depth`.
+ * `normalMatrices` is the per-instance table that takes the object-space
+ * hit normal to world space.
+ */
+__host__ __device__
+inline void shadePathSegment(int iter, int depth,
+        const ShadeableIntersection &intersection, PathSegment &pathSegment,
+        const Material *materials, const glm::mat3 *normalMatrices,
+        const SamplerView &sampler, bool roulette) {
+    if (intersection.t > 0.0f) { // if the intersection exists...
+        PhiloxEngine rng = makeSeededRandomEngine(iter, pathSegment.pixelIndex, depth);
+        PixelSampler pixelSampler(sampler, pathSegment.pixelIndex, iter - 1);
+
+        Material material = materials[intersection.materialId];
+        glm::vec3 materialColor = material.color;
+
+        // If the material indicates that the object was a light, "light" the ray
+        if (material.emittance > 0.0f) {
+            pathSegment.color *= (materialColor * material.emittance);
+            pathSegment.remainingBounces = 0;
+        }
+        else {
+            glm::vec3 intersectionPoint = getPointOnRay(pathSegment.ray, intersection.t);
+            glm::vec3 normal = glm::normalize(normalMatrices[intersection.instanceId] * intersection.surfaceNormal);
+            scatterRay(pathSegment, intersectionPoint, normal, material, rng, pixelSampler, depth);
+            pathSegment.remainingBounces--;
+            if (roulette && pathSegment.remainingBounces > 0 && !surviveRoulette(pathSegment, depth, rng)) {
+                pathSegment.color = glm::vec3(0.0f);
+                pathSegment.remainingBounces = 0;
+            }
+        }
+    }
+    // If there was no intersection, color the ray black.
+    else {
+        pathSegment.color = glm::vec3(0.0f);
+        pathSegment.remainingBounces = 0;
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+// Rounds of the Philox bijection; 10 is the count its authors validated
+#define PHILOX_ROUNDS 10
+
+/**
+ * Counter-based random numbers (Salmon et al., "Parallel Random Numbers: As
+ * Easy as 1, 2, 3", 2011). Philox4x32 maps a 128-bit counter and a 64-bit
+ * key to 128 random bits with no state in between, so any draw of any path
+ * can be computed on its own. Every path's stream is keyed by its pixel and
+ * bounce and counted from its sample index: a range of samples renders the
+ * same on any device, thread count or node, and nothing depends on where the
+ * path sits in the path pool after compaction or sorting.
+ *
+ * The engine plugs into thrust's distributions. It returns 24 bits per draw,
+ * so thrust::uniform_real_distribution<float> stays inside [0, 1).
+ */
+class PhiloxEngine {
+public:
+    typedef unsigned int result_type;
+    static const result_type min = 0;
+    static const result_type max = 0xffffff;
+
+    /**
+     * Stream of draws for bounce `depth` (0 for the camera ray) of sample
+     * `sampleIndex` in pixel `pixel`.
+     */
+    __host__ __device__
+    PhiloxEngine(unsigned int pixel, unsigned int sampleIndex, unsigned int depth)
+        : used(4) {
+        key[0] = pixel;
+        key[1] = depth;
+        counter[0] = sampleIndex;
+        counter[1] = 0;
+        counter[2] = 0;
+        counter[3] = 0;
+    }
+
+    __host__ __device__
+    result_type operator()() {
+        if (used == 4) {
+            philox4x32(counter, key, block);
+            counter[1]++;
+            used = 0;
+        }
+        return block[used++] >> 8;
+    }
+
+private:
+    __host__ __device__
+    static unsigned int mulhilo(unsigned int a, unsigned int b, unsigned int &hi) {
+#ifdef __CUDA_ARCH__
+        hi = __umulhi(a, b);
+        return a * b;
+#else
+        unsigned long long product = (unsigned long long)a * b;
+        hi = (unsigned int)(product >> 32);
+        return (unsigned int)product;
+#endif
+    }
+
+    __host__ __device__
+    static void philox4x32(const unsigned int in[4], const unsigned int inKey[2], unsigned int out[4]) {
+        unsigned int c0 = in[0], c1 = in[1], c2 = in[2], c3 = in[3];
+        unsigned int k0 = inKey[0], k1 = inKey[1];
+        for (int round = 0; round < PHILOX_ROUNDS; round++) {
+            unsigned int hi0, hi1;
+            unsigned int lo0 = mulhilo(0xd2511f53u, c0, hi0);
+            unsigned int lo1 = mulhilo(0xcd9e8d57u, c2, hi1);
+            c0 = hi1 ^ c1 ^ k0;
+            c1 = lo1;
+            c2 = hi0 ^ c3 ^ k1;
+            c3 = lo0;
+            k0 += 0x9e3779b9u;
+            k1 += 0xbb67ae85u;
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+    }
+
+    unsigned int key[2];
+    unsigned int counter[4];
+    unsigned int block[4];
+    int used;
+};
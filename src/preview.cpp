@@ -80,7 +80,9 @@ GLuint initShader() {
 void deletePBO(GLuint* pbo) {
     if (pbo) {
         // unregister this buffer object with CUDA
-        cudaGLUnregisterBufferObject(*pbo);
+        if (pathtraceGetBackend() == BACKEND_CUDA) {
+            cudaGLUnregisterBufferObject(*pbo);
+        }
 
         glBindBuffer(GL_ARRAY_BUFFER, *pbo);
         glDeleteBuffers(1, pbo);
@@ -124,7 +126,9 @@ void initPBO() {
 
     // Allocate data for the buffer. 4-channel 8-bit image
     glBufferData(GL_PIXEL_UNPACK_BUFFER, size_tex_data, NULL, GL_DYNAMIC_COPY);
-    cudaGLRegisterBufferObject(pbo);
+    if (pathtraceGetBackend() == BACKEND_CUDA) {
+        cudaGLRegisterBufferObject(pbo);
+    }
 
 }
 
@@ -158,7 +162,11 @@ bool init() {
     // Initialize other stuff
     initVAO();
     initTextures();
-    initCuda();
+    if (pathtraceGetBackend() == BACKEND_CUDA) {
+        initCuda();
+    } else {
+        atexit(cleanupCuda);
+    }
     initPBO();
     GLuint passthroughProgram = initShader();
 
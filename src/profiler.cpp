@@ -0,0 +1,131 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <set>
+#include <vector>
+
+#include "profiler.h"
+
+namespace {
+struct Event {
+    const char *name;
+    bool isCounter;
+    int track;
+    int iteration;
+    int depth;
+    double startUs;
+    double durationUs;
+    long long value;
+};
+
+using time_point_t = std::chrono::high_resolution_clock::time_point;
+
+std::vector<Event> events;
+std::atomic<unsigned long long> nextEvent(0);
+std::atomic<bool> recording(false);
+std::atomic<int> nextTrack(profiler::GPU_TRACK + 1);
+time_point_t epoch;
+
+void push(const Event &e) {
+    // concurrent writers claim distinct slots; the oldest slot is overwritten
+    unsigned long long slot = nextEvent.fetch_add(1);
+    events[slot % events.size()] = e;
+}
+}
+
+void profiler::enable(int capacity) {
+    recording = false;
+    events.assign(capacity > 0 ? capacity : 1, Event());
+    nextEvent = 0;
+    epoch = std::chrono::high_resolution_clock::now();
+    recording = true;
+}
+
+void profiler::disable() {
+    recording = false;
+}
+
+bool profiler::enabled() {
+    return recording;
+}
+
+double profiler::nowUs() {
+    std::chrono::duration<double, std::micro> dur = std::chrono::high_resolution_clock::now() - epoch;
+    return dur.count();
+}
+
+int profiler::threadTrack() {
+    static thread_local int track = nextTrack.fetch_add(1);
+    return track;
+}
+
+void profiler::span(const char *name, int track, double startUs, double endUs,
+        int iteration, int depth) {
+    if (!recording) {
+        return;
+    }
+    Event e = { name, false, track, iteration, depth, startUs, endUs - startUs, 0 };
+    push(e);
+}
+
+void profiler::counter(const char *name, double timeUs, int iteration, int depth, long long value) {
+    if (!recording) {
+        return;
+    }
+    Event e = { name, true, GPU_TRACK, iteration, depth, timeUs, 0.0, value };
+    push(e);
+}
+
+bool profiler::exportChromeTrace(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        return false;
+    }
+
+    unsigned long long end = nextEvent;
+    unsigned long long begin = end > events.size() ? end - events.size() : 0;
+
+    std::set<int> tracks;
+    for (unsigned long long i = begin; i < end; i++) {
+        const Event &e = events[i % events.size()];
+        if (!e.isCounter) {
+            tracks.insert(e.track);
+        }
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (std::set<int>::const_iterator t = tracks.begin(); t != tracks.end(); ++t) {
+        std::string name = *t == GPU_TRACK ? "gpu" : "host thread " + std::to_string(*t);
+        fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, "
+            "\"args\": {\"name\": \"%s\"}}", first ? "" : ",\n", *t, name.c_str());
+        first = false;
+    }
+    for (unsigned long long i = begin; i < end; i++) {
+        const Event &e = events[i % events.size()];
+        if (e.isCounter) {
+            // one counter track per bounce, so every depth plots on its own
+            fprintf(fp, "%s{\"name\": \"%s[%d]\", \"ph\": \"C\", \"pid\": 0, \"ts\": %.3f, "
+                "\"args\": {\"value\": %lld}}",
+                first ? "" : ",\n", e.name, e.depth, e.startUs, e.value);
+        } else {
+            fprintf(fp, "%s{\"name\": \"%s\", \"cat\": \"pathtrace\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, "
+                "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"iteration\": %d, \"depth\": %d}}",
+                first ? "" : ",\n", e.name, e.track, e.startUs, e.durationUs, e.iteration, e.depth);
+        }
+        first = false;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return true;
+}
+
+profiler::Scope::Scope(const char *name, int iteration, int depth)
+    : name(name), iteration(iteration), depth(depth), startUs(recording ? nowUs() : 0.0) {
+}
+
+profiler::Scope::~Scope() {
+    if (recording) {
+        span(name, threadTrack(), startUs, nowUs(), iteration, depth);
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+
+/**
+ * Timeline of the pathtrace stages for finding out where a slow frame goes.
+ * Spans and counters land in a fixed-size ring buffer, so a long interactive
+ * session keeps only its most recent events, and export as Chrome trace-event
+ * JSON for chrome://tracing or Perfetto. Recording is off until enable() and
+ * costs one branch per scope while off.
+ */
+namespace profiler {
+    // Track of spans measured with CUDA events; host threads get 1, 2, ...
+    const int GPU_TRACK = 0;
+
+    // Clears the buffer, restarts the clock and starts recording.
+    extern void enable(int capacity = 1 << 16);
+    extern void disable();
+    extern bool enabled();
+
+    // Microseconds since enable().
+    extern double nowUs();
+
+    // Track of the calling host thread, numbered in order of first use.
+    extern int threadTrack();
+
+    // `name` must outlive the profiler, e.g. a string literal. `depth` is the
+    // bounce, or -1 for spans that cover a whole iteration.
+    extern void span(const char *name, int track, double startUs, double endUs,
+        int iteration, int depth);
+
+    // A sample of the counter `name` for bounce `depth`, e.g. the paths
+    // still alive when it starts.
+    extern void counter(const char *name, double timeUs, int iteration, int depth, long long value);
+
+    // Writes the buffered events oldest first. Returns false if the file
+    // cannot be written.
+    extern bool exportChromeTrace(const std::string &path);
+
+    // Records its own lifetime as a span on the calling thread.
+    class Scope {
+    public:
+        Scope(const char *name, int iteration, int depth = -1);
+        ~Scope();
+
+    private:
+        const char *name;
+        int iteration;
+        int depth;
+        double startUs;
+    };
+}
@@ -0,0 +1,168 @@
+#include <cstdlib>
+#include <sstream>
+
+#include "renderOptions.h"
+
+// Threshold picked by a bare `--adaptive` or `OPTION adaptive on`
+#define DEFAULT_ADAPTIVE_THRESHOLD 0.05f
+// Stride picked by a bare `--preview`: a quarter of the pixels
+#define DEFAULT_PREVIEW_STRIDE 2
+// Coarsest preview stride accepted
+#define MAX_PREVIEW_STRIDE 16
+// Denoiser levels picked by a bare `--denoise`: a kernel 125 pixels across
+#define DEFAULT_DENOISE_LEVELS 5
+// Most denoiser levels accepted
+#define MAX_DENOISE_LEVELS 10
+
+// Option values of the samplers, in SamplerType order
+static const char *samplerNames[] = { "random", "stratified", "sobol", "bluenoise" };
+
+RenderOptions renderOptions::defaults() {
+    RenderOptions options;
+    options.compact = false;
+    options.sorting = false;
+    options.sortDirection = false;
+    options.caching = false;
+    options.nee = false;
+    options.roulette = false;
+    options.adaptive = 0.0f;
+    options.sampler = SAMPLER_RANDOM;
+    options.temporal = false;
+    options.preview = 1;
+    options.denoise = 0;
+    options.timing = false;
+    options.sortTiming = false;
+    return options;
+}
+
+static bool parseBool(const std::string &value, bool &out) {
+    if (value == "1" || value == "on" || value == "true") {
+        out = true;
+    } else if (value == "0" || value == "off" || value == "false") {
+        out = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Adaptive sampling takes a threshold, or a boolean for the default one
+static bool parseThreshold(const std::string &value, float &out) {
+    bool on;
+    if (parseBool(value, on)) {
+        out = on ? DEFAULT_ADAPTIVE_THRESHOLD : 0.0f;
+        return true;
+    }
+    char *end;
+    float threshold = strtof(value.c_str(), &end);
+    if (value.empty() || *end != '\0' || !(threshold >= 0.0f && threshold < 1.0f)) {
+        return false;
+    }
+    out = threshold;
+    return true;
+}
+
+// Preview takes a pixel stride, or a boolean for the default one
+static bool parseStride(const std::string &value, int &out) {
+    bool on;
+    if (parseBool(value, on)) {
+        out = on ? DEFAULT_PREVIEW_STRIDE : 1;
+        return true;
+    }
+    char *end;
+    long stride = strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || stride < 1 || stride > MAX_PREVIEW_STRIDE) {
+        return false;
+    }
+    out = (int)stride;
+    return true;
+}
+
+// Denoise takes a number of filter levels, or a boolean for the default one
+static bool parseLevels(const std::string &value, int &out) {
+    bool on;
+    if (parseBool(value, on)) {
+        out = on ? DEFAULT_DENOISE_LEVELS : 0;
+        return true;
+    }
+    char *end;
+    long levels = strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || levels < 0 || levels > MAX_DENOISE_LEVELS) {
+        return false;
+    }
+    out = (int)levels;
+    return true;
+}
+
+static bool parseSampler(const std::string &value, SamplerType &out) {
+    for (int i = 0; i < (int)(sizeof(samplerNames) / sizeof(samplerNames[0])); i++) {
+        if (value == samplerNames[i]) {
+            out = (SamplerType)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool renderOptions::set(RenderOptions &options, const std::string &name, const std::string &value) {
+    if (name == "adaptive") {
+        return parseThreshold(value, options.adaptive);
+    }
+    if (name == "sampler") {
+        return parseSampler(value, options.sampler);
+    }
+    if (name == "preview") {
+        return parseStride(value, options.preview);
+    }
+    if (name == "denoise") {
+        return parseLevels(value, options.denoise);
+    }
+    bool *field = NULL;
+    if (name == "compact") {
+        field = &options.compact;
+    } else if (name == "sorting") {
+        field = &options.sorting;
+    } else if (name == "sortdirection") {
+        field = &options.sortDirection;
+    } else if (name == "caching") {
+        field = &options.caching;
+    } else if (name == "nee") {
+        field = &options.nee;
+    } else if (name == "roulette") {
+        field = &options.roulette;
+    } else if (name == "temporal") {
+        field = &options.temporal;
+    } else if (name == "timing") {
+        field = &options.timing;
+    } else if (name == "sorttiming") {
+        field = &options.sortTiming;
+    }
+    return field && parseBool(value, *field);
+}
+
+bool renderOptions::exists(const std::string &name) {
+    RenderOptions probe = defaults();
+    return set(probe, name, "1") || set(probe, name, samplerNames[0]);
+}
+
+const char *renderOptions::samplerName(SamplerType sampler) {
+    return samplerNames[sampler];
+}
+
+std::string renderOptions::toString(const RenderOptions &options) {
+    std::ostringstream ss;
+    ss << "compact=" << options.compact
+        << " sorting=" << options.sorting
+        << " sortdirection=" << options.sortDirection
+        << " caching=" << options.caching
+        << " nee=" << options.nee
+        << " roulette=" << options.roulette
+        << " adaptive=" << options.adaptive
+        << " sampler=" << samplerName(options.sampler)
+        << " temporal=" << options.temporal
+        << " preview=" << options.preview
+        << " denoise=" << options.denoise
+        << " timing=" << options.timing
+        << " sorttiming=" << options.sortTiming;
+    return ss.str();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include "sceneStructs.h"
+
+/**
+ * Runtime pipeline switches. Scene files set them with `OPTION name value`
+ * lines and the command line overrides them with `--name[=value]`. Names are
+ * compact, sorting, sortdirection, caching, nee, roulette, adaptive, temporal,
+ * preview, denoise, timing and sorttiming; values are 1/0, on/off or
+ * true/false.
+ * adaptive also takes its error threshold, a number below 1, where on picks
+ * 0.05. preview also takes a pixel stride up to 16, where on picks 2.
+ * denoise also takes a number of filter levels up to 10, where on picks 5.
+ * sampler takes random, stratified, sobol or bluenoise.
+ */
+namespace renderOptions {
+    // All switches off, matching the old compile-time defaults.
+    extern RenderOptions defaults();
+
+    // Returns false if `name` is not an option or `value` does not fit it.
+    extern bool set(RenderOptions &options, const std::string &name, const std::string &value);
+
+    // True if `name` is an option, whatever values it takes.
+    extern bool exists(const std::string &name);
+
+    // Option value that selects `sampler`, e.g. "sobol".
+    extern const char *samplerName(SamplerType sampler);
+
+    // "compact=0 sorting=1 ..." for logs and benchmark output.
+    extern std::string toString(const RenderOptions &options);
+}
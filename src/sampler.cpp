@@ -0,0 +1,127 @@
+#include <cmath>
+#include <random>
+
+#include "sampler.h"
+
+// Spread of the energy kernel, in pixels, as in Ulichney's paper
+#define VOID_CLUSTER_SIGMA 1.5f
+
+namespace {
+const int N = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+
+/**
+ * Binary pattern on the torus plus, for every pixel, the Gaussian-weighted
+ * count of set pixels around it. Large energy marks a cluster, small a void.
+ */
+struct Pattern {
+    std::vector<bool> set;
+    std::vector<float> energy;
+    std::vector<float> kernel;
+
+    Pattern() : set(N, false), energy(N, 0.0f), kernel(N) {
+        for (int y = 0; y < BLUE_NOISE_SIZE; y++) {
+            for (int x = 0; x < BLUE_NOISE_SIZE; x++) {
+                int dx = std::min(x, BLUE_NOISE_SIZE - x);
+                int dy = std::min(y, BLUE_NOISE_SIZE - y);
+                kernel[x + y * BLUE_NOISE_SIZE] =
+                    expf(-(dx * dx + dy * dy) / (2.0f * VOID_CLUSTER_SIGMA * VOID_CLUSTER_SIGMA));
+            }
+        }
+    }
+
+    void toggle(int p) {
+        set[p] = !set[p];
+        float sign = set[p] ? 1.0f : -1.0f;
+        int px = p % BLUE_NOISE_SIZE;
+        int py = p / BLUE_NOISE_SIZE;
+        for (int y = 0; y < BLUE_NOISE_SIZE; y++) {
+            int ky = (y - py + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+            for (int x = 0; x < BLUE_NOISE_SIZE; x++) {
+                int kx = (x - px + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+                energy[x + y * BLUE_NOISE_SIZE] += sign * kernel[kx + ky * BLUE_NOISE_SIZE];
+            }
+        }
+    }
+
+    int tightestCluster() const {
+        int best = -1;
+        for (int i = 0; i < N; i++) {
+            if (set[i] && (best < 0 || energy[i] > energy[best])) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    int largestVoid() const {
+        int best = -1;
+        for (int i = 0; i < N; i++) {
+            if (!set[i] && (best < 0 || energy[i] < energy[best])) {
+                best = i;
+            }
+        }
+        return best;
+    }
+};
+
+/**
+ * Void-and-cluster dither array (Ulichney 1993): ranks every pixel so that
+ * the first k of them form an evenly spread pattern for every k. Returns the
+ * ranks mapped to the centers of N equal intervals of [0, 1).
+ */
+std::vector<float> voidAndCluster(unsigned int seed) {
+    std::mt19937 rng(seed);
+    Pattern pattern;
+
+    // initial pattern: a tenth of the pixels at random, then relaxed by
+    // moving the tightest cluster to the largest void until it stops moving
+    int ones = N / 10;
+    for (int placed = 0; placed < ones; ) {
+        int p = rng() % N;
+        if (!pattern.set[p]) {
+            pattern.toggle(p);
+            placed++;
+        }
+    }
+    for (;;) {
+        int cluster = pattern.tightestCluster();
+        pattern.toggle(cluster);
+        int hole = pattern.largestVoid();
+        pattern.toggle(hole);
+        if (hole == cluster) {
+            break;
+        }
+    }
+    Pattern prototype = pattern;
+
+    std::vector<int> rank(N);
+    // the prototype's own pixels, most clustered last
+    for (int r = ones - 1; r >= 0; r--) {
+        int cluster = pattern.tightestCluster();
+        pattern.toggle(cluster);
+        rank[cluster] = r;
+    }
+    // then every other pixel, filling the largest void first
+    pattern = prototype;
+    for (int r = ones; r < N; r++) {
+        int hole = pattern.largestVoid();
+        pattern.toggle(hole);
+        rank[hole] = r;
+    }
+
+    std::vector<float> values(N);
+    for (int i = 0; i < N; i++) {
+        values[i] = (rank[i] + 0.5f) / N;
+    }
+    return values;
+}
+}
+
+void sampler::buildBlueNoise(std::vector<glm::vec2> &tile) {
+    std::vector<float> x = voidAndCluster(1);
+    std::vector<float> y = voidAndCluster(2);
+    tile.resize(N);
+    for (int i = 0; i < N; i++) {
+        tile[i] = glm::vec2(x[i], y[i]);
+    }
+}
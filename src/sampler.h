@@ -0,0 +1,203 @@
+#pragma once
+
+#include <vector>
+#include <thrust/random.h>
+
+#include "sceneStructs.h"
+#include "philox.h"
+#include "intersections.h"
+
+// Side of the tileable blue-noise texture used by SAMPLER_BLUE_NOISE
+#define BLUE_NOISE_SIZE 64
+
+/**
+ * Sample points for the dimensions that dominate a path's noise: the
+ * antialiasing jitter of the camera ray (dimension pair 0) and the diffuse
+ * direction of each bounce (pair = depth). Every other random decision, such
+ * as Fresnel, light picking and Russian roulette, stays on the per-bounce
+ * random engine. See SamplerType for the implementations.
+ */
+namespace sampler {
+    // Builds a BLUE_NOISE_SIZE^2 tile of 2D offsets by void and cluster,
+    // one independent mask per coordinate. Deterministic.
+    extern void buildBlueNoise(std::vector<glm::vec2> &tile);
+}
+
+/**
+ * What every pixel's sampler shares. `samplesPerPixel` is the planned sample
+ * count, which sets the stratified grid; `blueNoise` is the tile from
+ * sampler::buildBlueNoise(), NULL unless `type` is SAMPLER_BLUE_NOISE.
+ */
+struct SamplerView {
+    SamplerType type;
+    int samplesPerPixel;
+    int width;
+    const glm::vec2 *blueNoise;
+};
+
+__host__ __device__
+inline unsigned int reverseBits(unsigned int x) {
+#ifdef __CUDA_ARCH__
+    return __brev(x);
+#else
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+#endif
+}
+
+__host__ __device__
+inline unsigned int hashCombine(unsigned int seed, unsigned int v) {
+    return utilhash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// [0, 1) float from the top 24 bits
+__host__ __device__
+inline float bitsToFloat(unsigned int x) {
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/**
+ * First two dimensions of the Sobol sequence, which together form a (0, 2)
+ * sequence: every power-of-two prefix puts one point in each of the
+ * elementary intervals of its size.
+ */
+__host__ __device__
+inline void sobol2D(unsigned int index, unsigned int &x, unsigned int &y) {
+    x = reverseBits(index);
+    y = 0;
+    for (unsigned int v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            y ^= v;
+        }
+    }
+}
+
+/**
+ * Owen scrambling by hashing (Burley, "Practical Hash-based Owen
+ * Scrambling", 2020): flips each bit depending on the bits above it, so the
+ * scrambled points keep the sequence's stratification.
+ */
+__host__ __device__
+inline unsigned int owenScramble(unsigned int x, unsigned int seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+/**
+ * Element `i` of a pseudorandom permutation of [0, n) selected by `seed`
+ * (Kensler, "Correlated Multi-Jittered Sampling", 2013). Cycle-walks a
+ * bijection on the next power of two until it lands inside the range.
+ */
+__host__ __device__
+inline unsigned int permuteIndex(unsigned int i, unsigned int n, unsigned int seed) {
+    unsigned int w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+/**
+ * Point `sampleIndex` of a pixel's sequence in dimension pair `dimension`.
+ * SAMPLER_RANDOM draws both coordinates from `rng`, in the order the
+ * renderer always has; the others leave `rng` untouched.
+ */
+__host__ __device__
+inline glm::vec2 sample2D(const SamplerView &view, int pixel, int sampleIndex, int dimension,
+        PhiloxEngine &rng) {
+    unsigned int seed = hashCombine(utilhash(pixel), dimension);
+
+    if (view.type == SAMPLER_SOBOL) {
+        // shuffle the sequence per pixel and dimension, then scramble it
+        unsigned int index = owenScramble(sampleIndex, seed);
+        unsigned int x, y;
+        sobol2D(index, x, y);
+        return glm::vec2(bitsToFloat(owenScramble(x, hashCombine(seed, 1))),
+            bitsToFloat(owenScramble(y, hashCombine(seed, 2))));
+    }
+
+    if (view.type == SAMPLER_STRATIFIED) {
+        // one sample per cell of a grid covering the planned sample count,
+        // visited in a random order; later samples start a new pass
+        int nx = glm::max((int)ceilf(sqrtf((float)view.samplesPerPixel)), 1);
+        int ny = glm::max((view.samplesPerPixel + nx - 1) / nx, 1);
+        unsigned int cells = nx * ny;
+        unsigned int pass = sampleIndex / cells;
+        unsigned int passSeed = hashCombine(seed, pass);
+        unsigned int cell = permuteIndex(sampleIndex % cells, cells, passSeed);
+        unsigned int jitter = hashCombine(passSeed, sampleIndex);
+        return glm::vec2(((cell % nx) + bitsToFloat(utilhash(jitter))) / nx,
+            ((cell / nx) + bitsToFloat(utilhash(jitter ^ 0x5bd1e995u))) / ny);
+    }
+
+    if (view.type == SAMPLER_BLUE_NOISE) {
+        // every pixel walks the same Sobol points, shifted by a blue-noise
+        // offset, so neighboring pixels make errors of opposite sign
+        int x = pixel % view.width;
+        int y = pixel / view.width;
+        unsigned int shift = utilhash(dimension + 1);
+        int tx = (x + (shift & 0xffff)) % BLUE_NOISE_SIZE;
+        int ty = (y + (shift >> 16)) % BLUE_NOISE_SIZE;
+        glm::vec2 offset = view.blueNoise[tx + ty * BLUE_NOISE_SIZE];
+        unsigned int sx, sy;
+        sobol2D(sampleIndex, sx, sy);
+        glm::vec2 u = glm::vec2(bitsToFloat(sx), bitsToFloat(sy)) + offset;
+        return u - glm::floor(u);
+    }
+
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    float u0 = u01(rng);
+    float u1 = u01(rng);
+    return glm::vec2(u0, u1);
+}
+
+/**
+ * The samples of one path: pixel and sample index fixed, dimension pair
+ * chosen per use.
+ */
+struct PixelSampler {
+    SamplerView view;
+    int pixel;
+    int sampleIndex;
+
+    __host__ __device__
+    PixelSampler(const SamplerView &view, int pixel, int sampleIndex)
+        : view(view), pixel(pixel), sampleIndex(sampleIndex) {
+    }
+
+    __host__ __device__
+    glm::vec2 get2D(int dimension, PhiloxEngine &rng) const {
+        return sample2D(view, pixel, sampleIndex, dimension, rng);
+    }
+};
@@ -1,12 +1,22 @@
 #include <iostream>
 #include "scene.h"
+#include "bvh.h"
+#include "bvhCache.h"
+#include "lights.h"
+#include "objLoader.h"
+#include "renderOptions.h"
+#include <chrono>
 #include <cstring>
 #include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/string_cast.hpp>
 
 Scene::Scene(string filename) {
     cout << "Reading scene from " << filename << " ..." << endl;
     cout << " " << endl;
+    size_t slash = filename.find_last_of("/\\");
+    sceneDirectory = slash == string::npos ? "" : filename.substr(0, slash + 1);
+    state.options = renderOptions::defaults();
     char* fname = (char*)filename.c_str();
     fp_in.open(fname);
     if (!fp_in.is_open()) {
@@ -27,9 +37,161 @@ Scene::Scene(string filename) {
             } else if (strcmp(tokens[0].c_str(), "CAMERA") == 0) {
                 loadCamera();
                 cout << " " << endl;
+            } else if (strcmp(tokens[0].c_str(), "OPTION") == 0) {
+                if (tokens.size() < 3 || !renderOptions::set(state.options, tokens[1], tokens[2])) {
+                    cout << "Ignoring unknown option: " << line << endl;
+                }
             }
         }
     }
+
+    buildTLAS(filename + ".bvh");
+    packInstances();
+    lights::build(instances, blases, materials, lights, instLightId);
+}
+
+/**
+ * Returns the BLAS shared by every instance of an implicit shape, creating
+ * it the first time the shape is used.
+ */
+int Scene::findOrAddImplicitBlas(GeomType type) {
+    for (int i = 0; i < (int)blases.size(); i++) {
+        if (blases[i].type == type) {
+            return i;
+        }
+    }
+    blases.push_back(bvh::makeImplicitBlas(type));
+    return blases.size() - 1;
+}
+
+/**
+ * Returns the BLAS of the triangle mesh in the OBJ file `path`, loading it
+ * and building its BVH the first time the file is used. The BVH is cached in
+ * `path`.bvh, keyed by a hash of the loaded mesh, and only rebuilt when the
+ * mesh changes. The mesh is appended to the shared vertex, triangle and
+ * node arrays. Returns -1 if the file cannot be read or holds no triangles.
+ */
+int Scene::findOrAddMeshBlas(const string &path) {
+    map<string, int>::const_iterator found = meshBlasIds.find(path);
+    if (found != meshBlasIds.end()) {
+        return found->second;
+    }
+
+    using time_point_t = std::chrono::high_resolution_clock::time_point;
+    time_point_t startTime = std::chrono::high_resolution_clock::now();
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::ivec3> triangles;
+    if (!loadOBJ(path, positions, triangles) || triangles.empty()) {
+        cout << "ERROR: could not read any triangles from " << path << endl;
+        return -1;
+    }
+
+    const string cachePath = path + ".bvh";
+    unsigned long long hash = bvhCache::hashMesh(positions, triangles);
+    std::vector<BVHNode> nodes;
+    std::vector<int> order;
+    bool cached = bvhCache::load(cachePath, hash, nodes, order) && order.size() == triangles.size();
+    if (!cached) {
+        bvh::buildMesh(positions, triangles, nodes, order);
+        if (!bvhCache::save(cachePath, hash, nodes, order)) {
+            cout << "Could not write BVH cache " << cachePath << endl;
+        }
+    }
+    Blas blas = bvh::makeMeshBlas(triangles, nodes, order);
+    blas.nodeOffset = blasNodes.size();
+    blas.triOffset = triV0.size();
+    blasNodes.insert(blasNodes.end(), nodes.begin(), nodes.end());
+
+    int vertexOffset = vertX.size();
+    for (size_t i = 0; i < positions.size(); i++) {
+        vertX.push_back(positions[i].x);
+        vertY.push_back(positions[i].y);
+        vertZ.push_back(positions[i].z);
+    }
+    for (size_t i = 0; i < triangles.size(); i++) {
+        triV0.push_back(vertexOffset + triangles[i].x);
+        triV1.push_back(vertexOffset + triangles[i].y);
+        triV2.push_back(vertexOffset + triangles[i].z);
+    }
+
+    blases.push_back(blas);
+    meshBlasIds[path] = blases.size() - 1;
+
+    time_point_t endTime = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> dur = endTime - startTime;
+    cout << "Loaded " << path << ": " << positions.size() << " vertices, " << triangles.size()
+        << " triangles, " << nodes.size() << (cached ? " cached" : "") << " BVH nodes in "
+        << dur.count() << " ms" << endl;
+    return blases.size() - 1;
+}
+
+/**
+ * Builds the top-level SAH BVH over the world-space bounds of every instance
+ * and reorders `instances` so that each leaf covers a contiguous range of
+ * them. The tree is cached in `cachePath`, keyed by a hash of the instances
+ * and BLASes, and only rebuilt when they change.
+ */
+void Scene::buildTLAS(const string &cachePath) {
+    using time_point_t = std::chrono::high_resolution_clock::time_point;
+    time_point_t startTime = std::chrono::high_resolution_clock::now();
+
+    unsigned long long hash = bvhCache::hashInstances(instances, blases);
+    std::vector<int> order;
+    bool cached = bvhCache::load(cachePath, hash, tlasNodes, order) && order.size() == instances.size();
+    if (!cached) {
+        std::vector<AABB> bounds(instances.size());
+        for (int i = 0; i < (int)instances.size(); i++) {
+            bounds[i] = bvh::instanceBounds(instances[i], blases[instances[i].blasId]);
+        }
+        bvh::build(bounds, tlasNodes, order);
+
+        if (!bvhCache::save(cachePath, hash, tlasNodes, order)) {
+            cout << "Could not write BVH cache " << cachePath << endl;
+        }
+    }
+
+    std::vector<Instance> sorted(instances.size());
+    for (int i = 0; i < (int)order.size(); i++) {
+        sorted[i] = instances[order[i]];
+    }
+    instances.swap(sorted);
+
+    time_point_t endTime = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> dur = endTime - startTime;
+    cout << (cached ? "Loaded cached TLAS" : "Built TLAS") << " over " << instances.size() << " instances of "
+        << blases.size() << " shapes: " << tlasNodes.size() << " nodes in " << dur.count() << " ms" << endl;
+}
+
+/**
+ * Splits `instances` into the structure-of-arrays layout the renderers read:
+ * the hot rows, BLAS ids and material ids used during traversal, and the
+ * cold normal matrices used only when shading.
+ */
+void Scene::packInstances() {
+    const int n = instances.size();
+    instRow0.resize(n);
+    instRow1.resize(n);
+    instRow2.resize(n);
+    instBlasId.resize(n);
+    instMaterialId.resize(n);
+    instNormalMatrix.resize(n);
+
+    for (int i = 0; i < n; i++) {
+        glm::mat3x4 rows = glm::transpose(instances[i].worldToObject);
+        instRow0[i] = rows[0];
+        instRow1[i] = rows[1];
+        instRow2[i] = rows[2];
+        instBlasId[i] = instances[i].blasId;
+        instMaterialId[i] = instances[i].materialid;
+        // inverse transpose of object-to-world = transpose of world-to-object
+        instNormalMatrix[i] = glm::transpose(glm::mat3(instances[i].worldToObject));
+    }
+
+    const size_t hot = 3 * sizeof(glm::vec4) + 2 * sizeof(int);
+    const size_t cold = sizeof(glm::mat3);
+    cout << "Instance data: " << n * hot << " bytes traversed (" << hot << " per instance), "
+        << n * cold << " bytes shading-only (" << cold << " per instance)" << endl;
 }
 
 int Scene::loadGeom(string objectid) {
@@ -40,12 +202,22 @@ int Scene::loadGeom(string objectid) {
     } else {
         cout << "Loading Geom " << id << "..." << endl;
         Geom newGeom;
+        string meshPath;
         string line;
 
         //load object type
         utilityCore::safeGetline(fp_in, line);
         if (!line.empty() && fp_in.good()) {
-            if (strcmp(line.c_str(), "sphere") == 0) {
+            vector<string> tokens = utilityCore::tokenizeString(line);
+            if (strcmp(tokens[0].c_str(), "mesh") == 0 && tokens.size() > 1) {
+                // mesh path/to/file.obj
+                cout << "Creating new mesh..." << endl;
+                newGeom.type = TRIANGLE_MESH;
+                bool absolute = tokens[1][0] == '/' || tokens[1][0] == '\\' ||
+                    (tokens[1].size() > 1 && tokens[1][1] == ':');
+                meshPath = absolute ? tokens[1] : sceneDirectory + tokens[1];
+            }
+            else if (strcmp(line.c_str(), "sphere") == 0) {
                 cout << "Creating new sphere..." << endl;
                 newGeom.type = SPHERE;
             } 
@@ -72,6 +244,8 @@ int Scene::loadGeom(string objectid) {
         }
 
         //load transformations
+        glm::ivec3 arrayCount(1);
+        glm::vec3 arraySpacing(0.0f);
         utilityCore::safeGetline(fp_in, line);
         while (!line.empty() && fp_in.good()) {
             vector<string> tokens = utilityCore::tokenizeString(line);
@@ -83,6 +257,10 @@ int Scene::loadGeom(string objectid) {
                 newGeom.rotation = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
             } else if (strcmp(tokens[0].c_str(), "SCALE") == 0) {
                 newGeom.scale = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+            } else if (strcmp(tokens[0].c_str(), "ARRAY") == 0) {
+                // ARRAY nx ny nz dx dy dz: a grid of copies spaced in world space
+                arrayCount = glm::ivec3(atoi(tokens[1].c_str()), atoi(tokens[2].c_str()), atoi(tokens[3].c_str()));
+                arraySpacing = glm::vec3(atof(tokens[4].c_str()), atof(tokens[5].c_str()), atof(tokens[6].c_str()));
             }
 
             utilityCore::safeGetline(fp_in, line);
@@ -94,6 +272,22 @@ int Scene::loadGeom(string objectid) {
         newGeom.invTranspose = glm::inverseTranspose(newGeom.transform);
 
         geoms.push_back(newGeom);
+
+        // every copy shares the shape's BLAS and only adds a transform
+        int blasId = newGeom.type == TRIANGLE_MESH ?
+            findOrAddMeshBlas(meshPath) : findOrAddImplicitBlas(newGeom.type);
+        if (blasId < 0) {
+            return -1;
+        }
+        for (int z = 0; z < arrayCount.z; z++) {
+            for (int y = 0; y < arrayCount.y; y++) {
+                for (int x = 0; x < arrayCount.x; x++) {
+                    glm::vec3 offset = arraySpacing * glm::vec3(x, y, z);
+                    glm::mat4 transform = glm::translate(glm::mat4(), offset) * newGeom.transform;
+                    instances.push_back(bvh::makeInstance(transform, blasId, newGeom.materialid));
+                }
+            }
+        }
         return 1;
     }
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <map>
 #include <vector>
 #include <sstream>
 #include <fstream>
@@ -13,14 +14,38 @@ using namespace std;
 class Scene {
 private:
     ifstream fp_in;
+    string sceneDirectory;              // OBJ paths are relative to the scene file
+    map<string, int> meshBlasIds;       // OBJ path -> blas, so each file is loaded once
     int loadMaterial(string materialid);
     int loadGeom(string objectid);
     int loadCamera();
+    int findOrAddImplicitBlas(GeomType type);
+    int findOrAddMeshBlas(const string &path);
+    void buildTLAS(const string &cachePath);
+    void packInstances();
 public:
     Scene(string filename);
     ~Scene();
 
-    std::vector<Geom> geoms;
+    std::vector<Geom> geoms;            // objects as written in the scene file
+    std::vector<Blas> blases;           // one per unique shape
+    std::vector<Instance> instances;    // one per placed copy, in TLAS leaf order
+    std::vector<BVHNode> tlasNodes;
+
+    // `instances` packed for the renderers, same order; see SceneView
+    std::vector<glm::vec4> instRow0, instRow1, instRow2;
+    std::vector<int> instBlasId, instMaterialId;
+    std::vector<glm::mat3> instNormalMatrix;    // cold: only read when shading a hit
+
+    // emitters sampled by next-event estimation; see lights.h
+    std::vector<Light> lights;
+    std::vector<int> instLightId;
+
+    // triangle meshes, structure-of-arrays; see SceneView
+    std::vector<BVHNode> blasNodes;
+    std::vector<int> triV0, triV1, triV2;
+    std::vector<float> vertX, vertY, vertZ;
+
     std::vector<Material> materials;
     RenderState state;
 };
@@ -11,7 +11,8 @@ enum GeomType {
     SPHERE,
     CUBE,
     CSG1,
-    CSG2
+    CSG2,
+    TRIANGLE_MESH
 };
 
 struct Ray {
@@ -30,6 +31,69 @@ struct Geom {
     glm::mat4 invTranspose;
 };
 
+/**
+ * Bottom-level acceleration structure: the geometry of one unique shape in
+ * its own object space, shared by every instance of that shape.
+ */
+struct Blas {
+    enum GeomType type;
+    glm::vec3 bboxMin;
+    glm::vec3 bboxMax;
+    int nodeOffset;     // TRIANGLE_MESH only: root of its BVH in the blasNodes array
+    int triOffset;      // TRIANGLE_MESH only: first of its triangles, in leaf order
+};
+
+/**
+ * One placement of a Blas in the world, as built and hashed on the host.
+ * The renderers read instances from the packed arrays in SceneView instead.
+ */
+struct Instance {
+    glm::mat4x3 worldToObject;  // inverse of the affine object-to-world transform
+    int blasId;
+    int materialid;
+};
+
+/**
+ * Node of a flattened bounding volume hierarchy. Nodes are stored depth
+ * first, so an interior node's left child is the node right after it.
+ */
+struct BVHNode {
+    glm::vec3 bboxMin;
+    int leftFirst;  // interior: index of the right child; leaf: first primitive
+    glm::vec3 bboxMax;
+    int count;      // number of primitives in a leaf, 0 for interior nodes
+};
+
+/**
+ * The two-level acceleration structure, as seen by the intersection code:
+ * device pointers for the CUDA kernels, host pointers for the CPU backend.
+ */
+struct SceneView {
+    // Instances, structure-of-arrays in TLAS leaf order. Only what the
+    // traversal reads: the rows of the 3x4 world-to-object affine and the
+    // BLAS id. The normal matrix is a separate table read only when shading.
+    int numInstances;
+    const glm::vec4 *instRow0;
+    const glm::vec4 *instRow1;
+    const glm::vec4 *instRow2;
+    const int *instBlasId;
+    const int *instMaterialId;   // read once per ray, for the closest hit
+
+    const Blas *blases;
+    const BVHNode *tlasNodes;
+
+    // Triangle meshes, structure-of-arrays. Leaf ranges of a mesh BVH index
+    // the triangle arrays relative to Blas::triOffset; triangles hold
+    // absolute vertex indices.
+    const BVHNode *blasNodes;
+    const int *triV0;
+    const int *triV1;
+    const int *triV2;
+    const float *vertX;
+    const float *vertY;
+    const float *vertZ;
+};
+
 struct Material {
     glm::vec3 color;
     struct {
@@ -42,6 +106,31 @@ struct Material {
     float emittance;
 };
 
+/**
+ * An emissive sphere or cube instance that next-event estimation samples
+ * directly. Lights are picked in proportion to their power; see lights.h.
+ */
+struct Light {
+    glm::mat4x3 objectToWorld;
+    glm::mat3 normalMatrix;     // inverse transpose of the linear part
+    float jacobian;             // |det| of the linear part
+    glm::vec3 emission;         // material color * emittance
+    float pickCdf;              // probability of picking this light or an earlier one
+    float pickPdf;              // probability of picking this light
+    enum GeomType type;
+    int instanceId;             // in TLAS leaf order, like ShadeableIntersection::instanceId
+};
+
+/**
+ * The light list as seen by shading: device pointers for the CUDA kernels,
+ * host pointers for the CPU backend.
+ */
+struct LightView {
+    int numLights;
+    const Light *lights;
+    const int *instLightId;     // per instance: index into lights, or -1
+};
+
 struct Camera {
     glm::ivec2 resolution;
     glm::vec3 position;
@@ -53,8 +142,44 @@ struct Camera {
     glm::vec2 pixelLength;
 };
 
+/**
+ * Source of the camera jitter and diffuse bounce samples; see sample2D().
+ * RANDOM draws from the per-bounce random engine. STRATIFIED jitters one
+ * point per cell of a grid sized to the planned sample count. SOBOL uses an
+ * Owen-scrambled, per-pixel shuffled Sobol sequence. BLUE_NOISE shifts one
+ * shared Sobol sequence by a blue-noise tile, so the error of neighboring
+ * pixels is anticorrelated.
+ */
+enum SamplerType {
+    SAMPLER_RANDOM,
+    SAMPLER_STRATIFIED,
+    SAMPLER_SOBOL,
+    SAMPLER_BLUE_NOISE
+};
+
+/**
+ * Pipeline switches that used to be compile-time macros; see renderOptions.h.
+ * pathtraceInit() reads them, so changes take effect on the next init.
+ */
+struct RenderOptions {
+    bool compact;       // stream compact terminated paths after each bounce
+    bool sorting;       // sort paths by material before shading
+    bool sortDirection; // also group each material's paths by ray direction; see materialSortKey()
+    bool caching;       // reuse first-bounce intersections; turns off antialiasing jitter
+    bool nee;           // next-event estimation with MIS; see lights.h
+    bool roulette;      // Russian roulette on path throughput; see surviveRoulette()
+    float adaptive;     // adaptive sampling error threshold, 0 = off; see accumulatePixelVariance()
+    SamplerType sampler;    // camera jitter and diffuse bounce sequence
+    bool temporal;      // reproject the preview's samples on camera moves; see temporal.h
+    int preview;        // pixel stride of the frames shown while the camera moves, 1 = off; see pathtracePreview()
+    int denoise;        // A-Trous filter levels of shown and saved images, 0 = off; see denoise.h
+    bool timing;        // print the time of each iteration
+    bool sortTiming;    // print the time of each sort
+};
+
 struct RenderState {
     Camera camera;
+    RenderOptions options;
     unsigned int iterations;
     int traceDepth;
     std::vector<glm::vec3> image;
@@ -63,16 +188,41 @@ struct RenderState {
 
 struct PathSegment {
 	Ray ray;
-	glm::vec3 color;
+	glm::vec3 color;        // throughput; the final radiance once the path ends with nee
+	glm::vec3 radiance;     // nee only: light gathered so far
+	float bsdfPdf;          // nee only: solid angle pdf of the last bounce, < 0 after a delta bounce
 	int pixelIndex;
 	int remainingBounces;
 };
 
+/**
+ * Adaptive sampling state of one pixel: running mean and sum of squared
+ * deviations (Welford) of its sample luminance.
+ */
+struct PixelVariance {
+    float mean;
+    float m2;
+    int convergedAt;        // samples taken when it converged, 0 while sampling
+    bool belowError;        // standard error below the threshold; see pixelBelowError()
+};
+
+/**
+ * What the camera ray of a pixel hit, in world space. materialId is -1 where
+ * the ray left the scene.
+ */
+struct GBufferPixel {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec3 albedo;       // reflectance at the hit; see surfaceAlbedo()
+    int materialId;
+};
+
 // Use with a corresponding PathSegment to do:
 // 1) color contribution computation
 // 2) BSDF evaluation: generate a new ray
 struct ShadeableIntersection {
   float t;
-  glm::vec3 surfaceNormal;
+  glm::vec3 surfaceNormal;  // object space; shading moves it to world space
   int materialId;
+  int instanceId;
 };
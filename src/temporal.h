@@ -0,0 +1,118 @@
+#pragma once
+
+#include "sceneStructs.h"
+#include "intersections.h"
+
+// Most samples' worth of weight a pixel's history carries into the next
+// view, so shading the reprojection got wrong fades within a few frames
+#define TEMPORAL_MAX_HISTORY 16.0f
+// Largest distance between a reprojected point and the surface it lands on,
+// as a fraction of its distance from the camera
+#define TEMPORAL_PLANE_TOLERANCE 0.02f
+// Smallest cosine between a pixel's normal and its history's normal
+#define TEMPORAL_MIN_NORMAL_COS 0.9f
+
+/**
+ * Temporal reprojection for the interactive preview. Each view records the
+ * G-buffer of its first iteration's camera rays. When the camera moves, every
+ * pixel of the new view finds where its surface point was in the old view
+ * and keeps that pixel's mean as history, unless the old pixel saw another
+ * material or another surface (a disocclusion). The preview shows the
+ * history blended with the new samples by sample count; the accumulated
+ * image, and so every saved file, holds only the new samples.
+ *
+ * A history entry is the mean color in rgb and its weight, in samples, in w.
+ */
+
+/**
+ * Reflectance the denoiser factors out of a pixel's color: the specular
+ * color of mirrors and glass, the diffuse color of everything else.
+ */
+__host__ __device__
+inline glm::vec3 surfaceAlbedo(const Material &material) {
+    if (material.hasReflective > 0.0f || material.hasRefractive > 0.0f) {
+        return material.specular.color;
+    }
+    return material.color;
+}
+
+/**
+ * G-buffer entry of a camera ray and its first intersection. Call before
+ * shading, which moves the ray on. Temporal reprojection and the denoiser
+ * (denoise.h) share it.
+ */
+__host__ __device__
+inline GBufferPixel makeGBufferPixel(const PathSegment &segment, const ShadeableIntersection &intersection,
+        const Material *materials, const glm::mat3 *normalMatrices) {
+    GBufferPixel pixel;
+    if (intersection.t > 0.0f) {
+        pixel.position = getPointOnRay(segment.ray, intersection.t);
+        pixel.normal = glm::normalize(normalMatrices[intersection.instanceId] * intersection.surfaceNormal);
+        pixel.albedo = surfaceAlbedo(materials[intersection.materialId]);
+        pixel.materialId = intersection.materialId;
+    } else {
+        pixel.position = glm::vec3(0.0f);
+        pixel.normal = glm::vec3(0.0f);
+        pixel.albedo = glm::vec3(0.0f);
+        pixel.materialId = -1;
+    }
+    return pixel;
+}
+
+/**
+ * Pixel of `cam` whose camera rays pass through `point`, inverting
+ * generateCameraRay(). Returns false if the point is behind the camera or
+ * outside the image. The camera's right and up vectors are orthogonal to
+ * its view but need not be unit length.
+ */
+__host__ __device__
+inline bool projectToPixel(const Camera &cam, const glm::vec3 &point, int &x, int &y) {
+    glm::vec3 d = point - cam.position;
+    float z = glm::dot(d, cam.view);
+    if (z <= 0.0f) {
+        return false;
+    }
+    float u = cam.resolution.x * 0.5f
+        - glm::dot(d, cam.right) / (z * cam.pixelLength.x * glm::dot(cam.right, cam.right));
+    float v = cam.resolution.y * 0.5f
+        - glm::dot(d, cam.up) / (z * cam.pixelLength.y * glm::dot(cam.up, cam.up));
+    x = (int)floorf(u);
+    y = (int)floorf(v);
+    return x >= 0 && x < cam.resolution.x && y >= 0 && y < cam.resolution.y;
+}
+
+/**
+ * History of a pixel of the new view from the previous view's G-buffer and
+ * history. Weight 0 where the pixel's surface was not visible before.
+ */
+__host__ __device__
+inline glm::vec4 reprojectPixel(const GBufferPixel &pixel, const Camera &prevCamera,
+        const GBufferPixel *prevGBuffer, const glm::vec4 *prevHistory) {
+    int x, y;
+    if (pixel.materialId < 0 || !projectToPixel(prevCamera, pixel.position, x, y)) {
+        return glm::vec4(0.0f);
+    }
+    const int index = x + y * prevCamera.resolution.x;
+    const GBufferPixel &prev = prevGBuffer[index];
+    float distance = glm::length(pixel.position - prevCamera.position);
+    if (prev.materialId != pixel.materialId
+            || fabsf(glm::dot(prev.position - pixel.position, pixel.normal)) > TEMPORAL_PLANE_TOLERANCE * distance
+            || glm::dot(prev.normal, pixel.normal) < TEMPORAL_MIN_NORMAL_COS) {
+        return glm::vec4(0.0f);
+    }
+    return prevHistory[index];
+}
+
+/**
+ * What a pixel hands to the next view: its accumulated `sum` of `iter`
+ * samples blended with its own `history`, capped at TEMPORAL_MAX_HISTORY.
+ */
+__host__ __device__
+inline glm::vec4 historyForNextView(const glm::vec3 &sum, int iter, const glm::vec4 &history) {
+    float weight = iter + history.w;
+    if (weight <= 0.0f) {
+        return glm::vec4(0.0f);
+    }
+    glm::vec3 mean = (sum + glm::vec3(history) * history.w) / weight;
+    return glm::vec4(mean, glm::min(weight, TEMPORAL_MAX_HISTORY));
+}
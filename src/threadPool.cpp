@@ -0,0 +1,121 @@
+#include <algorithm>
+
+#include "threadPool.h"
+
+WorkStealingPool::WorkStealingPool(int numThreads) :
+        numWorkers(numThreads),
+        currentTask(NULL),
+        batch(0),
+        remaining(0),
+        stopping(false) {
+    if (numWorkers <= 0) {
+        numWorkers = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (int i = 0; i < numWorkers; i++) {
+        queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+    }
+    // worker 0 is whichever thread calls parallelFor()
+    for (int i = 1; i < numWorkers; i++) {
+        threads.push_back(std::thread(&WorkStealingPool::workerLoop, this, i));
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(stateLock);
+        stopping = true;
+    }
+    wakeWorkers.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+void WorkStealingPool::parallelFor(int count, const std::function<void(int)> &task) {
+    if (count <= 0) {
+        return;
+    }
+
+    currentTask = &task;
+    {
+        std::lock_guard<std::mutex> lock(stateLock);
+        remaining = count;
+    }
+
+    // contiguous ranges keep neighbouring tiles on the same core
+    for (int w = 0; w < numWorkers; w++) {
+        int begin = (int)((long long)count * w / numWorkers);
+        int end = (int)((long long)count * (w + 1) / numWorkers);
+        std::lock_guard<std::mutex> lock(queues[w]->lock);
+        for (int i = begin; i < end; i++) {
+            queues[w]->tasks.push_back(i);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stateLock);
+        batch++;
+    }
+    wakeWorkers.notify_all();
+
+    runTasks(0);
+
+    std::unique_lock<std::mutex> lock(stateLock);
+    batchDone.wait(lock, [this] { return remaining == 0; });
+}
+
+void WorkStealingPool::workerLoop(int worker) {
+    unsigned int seenBatch = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(stateLock);
+            wakeWorkers.wait(lock, [&] { return stopping || batch != seenBatch; });
+            if (stopping) {
+                return;
+            }
+            seenBatch = batch;
+        }
+        runTasks(worker);
+    }
+}
+
+void WorkStealingPool::runTasks(int worker) {
+    int finished = 0;
+    int task;
+    while (popOrSteal(worker, task)) {
+        (*currentTask)(task);
+        finished++;
+    }
+
+    if (finished > 0) {
+        std::lock_guard<std::mutex> lock(stateLock);
+        remaining -= finished;
+        if (remaining == 0) {
+            batchDone.notify_all();
+        }
+    }
+}
+
+bool WorkStealingPool::popOrSteal(int worker, int &task) {
+    {
+        TaskQueue &own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.lock);
+        if (!own.tasks.empty()) {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    for (int i = 1; i < numWorkers; i++) {
+        TaskQueue &victim = *queues[(worker + i) % numWorkers];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
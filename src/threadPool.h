@@ -0,0 +1,53 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads that execute batches of independent tasks.
+ * Each batch is split into contiguous per-worker queues; a worker pops from
+ * the front of its own queue and, once that runs dry, steals from the back
+ * of the other queues, so uneven task costs still keep every core busy.
+ */
+class WorkStealingPool {
+public:
+    // numThreads <= 0 uses std::thread::hardware_concurrency().
+    explicit WorkStealingPool(int numThreads = 0);
+    ~WorkStealingPool();
+
+    int size() const { return numWorkers; }
+
+    // Runs task(i) for every i in [0, count) and blocks until all are done.
+    // The calling thread participates as worker 0.
+    void parallelFor(int count, const std::function<void(int)> &task);
+
+private:
+    struct TaskQueue {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    void workerLoop(int worker);
+    void runTasks(int worker);
+    bool popOrSteal(int worker, int &task);
+
+    int numWorkers;
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+
+    // Published before the queues are filled; the queue locks order the
+    // write with any worker that later pops a task of the batch.
+    const std::function<void(int)> *currentTask;
+
+    std::mutex stateLock;
+    std::condition_variable wakeWorkers;
+    std::condition_variable batchDone;
+    unsigned int batch;
+    int remaining;
+    bool stopping;
+};
@@ -0,0 +1,176 @@
+/**
+ * Renders one frame with several path tracer processes and merges their
+ * accumulation buffers into one image, or merges buffers rendered elsewhere.
+ *
+ * With --workers=N, runs N copies of COMMAND at once, the k-th with
+ * `--split=k/N --accumulation=OUT.k.acc` appended, waits for all of them,
+ * then merges their buffers into OUT.png and OUT.hdr and deletes them. The
+ * processes share nothing but those files. A --cpu COMMAND without
+ * --threads also gets `--threads=T`, T being the hardware threads divided
+ * among the workers, so together they fill the machine without
+ * oversubscribing it.
+ * Without --workers, merges the given buffers, e.g. from other machines.
+ *
+ * Usage: split_render --workers=N [--out=NAME] COMMAND [ARGS ...]
+ *        split_render [--out=NAME] FILE.acc ...
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "src/accumulation.h"
+#include "src/image.h"
+
+typedef std::vector<std::string> Args;
+
+// Whether `args` holds `flag`, alone or as `flag=VALUE`
+static bool hasFlag(const Args &args, const std::string &flag) {
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == flag || args[i].compare(0, flag.size() + 1, flag + "=") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Starts `args` without waiting for it. Returns a handle for waitWorker(),
+ * or -1 if it could not be started.
+ */
+static long startWorker(const Args &args) {
+    std::vector<char *> argv;
+    for (size_t i = 0; i < args.size(); i++) {
+        argv.push_back(const_cast<char *>(args[i].c_str()));
+    }
+    argv.push_back(NULL);
+#ifdef _WIN32
+    return (long)_spawnvp(_P_NOWAIT, argv[0], argv.data());
+#else
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv.data());
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+#endif
+}
+
+// Returns the worker's exit code, or -1 if it did not exit normally.
+static int waitWorker(long handle) {
+#ifdef _WIN32
+    int status;
+    if (_cwait(&status, (intptr_t)handle, 0) == -1) {
+        return -1;
+    }
+    return status;
+#else
+    int status;
+    if (waitpid((pid_t)handle, &status, 0) == -1 || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+#endif
+}
+
+// Averages the merged samples and writes them like the path tracer's own
+// saveImage()
+static void saveMerged(const accumulation::Buffer &merged, const std::string &name) {
+    float samples = (float)merged.samples();
+    image img(merged.width, merged.height);
+    for (int y = 0; y < merged.height; y++) {
+        for (int x = 0; x < merged.width; x++) {
+            img.setPixel(merged.width - 1 - x, y, merged.sum[x + y * merged.width] / samples);
+        }
+    }
+    img.savePNG(name);
+    img.saveHDR(name);
+}
+
+int main(int argc, char **argv) {
+    int workers = 0;
+    std::string out = "split";
+    int argi = 1;
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+        if (strncmp(argv[argi], "--workers=", 10) == 0) {
+            workers = atoi(argv[argi] + 10);
+            if (workers < 1) {
+                printf("Bad value for --workers: %s\n", argv[argi] + 10);
+                return 1;
+            }
+        } else if (strncmp(argv[argi], "--out=", 6) == 0) {
+            out = argv[argi] + 6;
+        } else {
+            printf("Unknown argument: %s\n", argv[argi]);
+            return 1;
+        }
+    }
+    if (argi >= argc) {
+        printf("Usage: %s --workers=N [--out=NAME] COMMAND [ARGS ...]\n", argv[0]);
+        printf("       %s [--out=NAME] FILE.acc ...\n", argv[0]);
+        return 1;
+    }
+
+    Args files;
+    bool ok = true;
+    if (workers > 0) {
+        // each CPU worker's pool would otherwise take every hardware thread
+        const Args command(argv + argi, argv + argc);
+        std::string threads;
+        if (hasFlag(command, "--cpu") && !hasFlag(command, "--threads")) {
+            int perWorker = std::max(1, (int)std::thread::hardware_concurrency() / workers);
+            threads = "--threads=" + std::to_string(perWorker);
+        }
+        std::vector<long> handles;
+        for (int k = 0; k < workers; k++) {
+            Args args(command);
+            if (!threads.empty()) {
+                args.push_back(threads);
+            }
+            files.push_back(out + "." + std::to_string(k) + ".acc");
+            args.push_back("--split=" + std::to_string(k) + "/" + std::to_string(workers));
+            args.push_back("--accumulation=" + files.back());
+            handles.push_back(startWorker(args));
+        }
+        for (int k = 0; k < workers; k++) {
+            int status = handles[k] == -1 ? -1 : waitWorker(handles[k]);
+            if (status != 0) {
+                printf("Worker %d failed with status %d\n", k, status);
+                ok = false;
+            }
+        }
+    } else {
+        files.assign(argv + argi, argv + argc);
+    }
+
+    std::vector<accumulation::Buffer> pieces(files.size());
+    for (size_t i = 0; ok && i < files.size(); i++) {
+        ok = accumulation::load(files[i], pieces[i]);
+    }
+    accumulation::Buffer merged;
+    if (ok && accumulation::merge(pieces, merged)) {
+        printf("Merged iterations %d-%d from %d buffers\n", merged.firstIteration, merged.lastIteration,
+            (int)pieces.size());
+        saveMerged(merged, out);
+    } else {
+        ok = false;
+    }
+
+    // only the buffers this run made itself
+    for (size_t i = 0; workers > 0 && i < files.size(); i++) {
+        remove(files[i].c_str());
+    }
+    return ok ? 0 : 1;
+}